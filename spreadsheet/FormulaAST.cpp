@@ -4,12 +4,19 @@
 #include "FormulaListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "vector_kernels.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
-#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 using namespace std::literals;
 
@@ -70,279 +77,554 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
-class Expr {
+// How cell references are printed: moved by shift, either in the A1 notation
+// or, when relative, as R[row]C[col] offsets
+struct CellFormat {
+    Position shift;
+    bool relative = false;
+};
+
+namespace {
+// Appends the nodes of a tree in postfix order: every call adds a node whose
+// operands are the subtrees added right before it
+class TreeBuilder {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<const CellInterface*(const Position*)> cell_getter) const = 0;
+    explicit TreeBuilder(std::size_t expected_nodes = 0) {
+        nodes_.reserve(expected_nodes);
+    }
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+    void AddNumber(double value) {
+        Add(OpCode::PushNumber, Size()).number = value;
+    }
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
-        }
+    void AddCell(Position cell) {
+        Add(OpCode::LoadCell, Size()).cell = cell;
+    }
 
-        DoPrintFormula(out, precedence);
+    void AddRange(const Range& range) {
+        // the call the range is an argument of moves it into ranges_
+        Add(OpCode::Range, Size()).range = static_cast<std::uint32_t>(pending_ranges_.size());
+        pending_ranges_.push_back(range);
+    }
 
-        if (parens_needed) {
-            out << ')';
-        }
+    // the operands are the last two subtrees
+    void AddBinaryOp(OpCode op) {
+        const NodeIndex rhs_first = nodes_.back().first;
+        Add(op, nodes_[rhs_first - 1].first);
     }
-};
 
-namespace {
-class BinaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        Add = '+',
-        Subtract = '-',
-        Multiply = '*',
-        Divide = '/',
-    };
+    // the operand is the last subtree
+    void AddUnaryOp(OpCode op) {
+        Add(op, nodes_.back().first);
+    }
 
-public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
-    }
-
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
-            case Add:
-                return EP_ADD;
-            case Subtract:
-                return EP_SUB;
-            case Multiply:
-                return EP_MUL;
-            case Divide:
-                return EP_DIV;
-            default:
-                // have to do this because VC++ has a buggy warning
-                assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
+    // The arguments are the last arg_count subtrees. The ranges among them go
+    // to ranges_ one after another, so the call finds them without the tree
+    void AddAggregate(Function function, std::size_t arg_count) {
+        if (arg_count > std::numeric_limits<std::uint16_t>::max()) {
+            throw FormulaException("Too many arguments: " + std::to_string(arg_count));
         }
-    }
 
-    double Evaluate(std::function<const CellInterface*(const Position*)> cell_getter) const override {
-        double lhs = lhs_->Evaluate(cell_getter);
-        double rhs = rhs_->Evaluate(cell_getter);
+        std::uint32_t range_count = 0;
+        NodeIndex first = Size();
+        for (std::size_t i = 0; i < arg_count; ++i) {
+            const Node& arg = nodes_[first - 1];
+            range_count += arg.op == OpCode::Range;
+            first = arg.first;
+        }
 
-        switch (type_)
-        {
-        case Type::Add:
-            if (!std::isfinite(lhs + rhs)) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs + rhs;
-        case Type::Subtract:
-            if (!std::isfinite(lhs - rhs)) {
-                throw FormulaError(FormulaError::Category::Div0);
-            }
-            return lhs - rhs;
-        case Type::Multiply:
-            if (!std::isfinite(lhs * rhs)) {
-                throw FormulaError(FormulaError::Category::Div0);
+        const auto begin = static_cast<std::uint32_t>(ranges_.size());
+        ranges_.resize(begin + range_count);
+        std::uint32_t next = begin + range_count;
+        for (NodeIndex arg = Size(); arg != first;) {
+            Node& node = nodes_[arg - 1];
+            if (node.op == OpCode::Range) {
+                ranges_[--next] = pending_ranges_[node.range];
+                node.range = next;
             }
-            return lhs * rhs;
-        case Type::Divide:
-            if (std::abs(rhs - 0) <= 1e-6) {
-                auto category = FormulaError::Category::Div0;
-                throw FormulaError(category);
-            }
-            return lhs / rhs;
-        default:
-            break;
+            arg = node.first;
         }
 
-        return 0;
+        Node& node = Add(OpCode::Aggregate, first);
+        node.function = function;
+        node.arg_count = static_cast<std::uint16_t>(arg_count);
+        node.ranges = {begin, range_count};
+    }
+
+    FormulaAST Build() {
+        // the whole array is one tree
+        assert(!nodes_.empty() && nodes_.back().first == 0);
+        nodes_.shrink_to_fit();
+        ranges_.shrink_to_fit();
+        return FormulaAST(std::move(nodes_), std::move(ranges_));
     }
 
 private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    NodeIndex Size() const {
+        return static_cast<NodeIndex>(nodes_.size());
+    }
+
+    Node& Add(OpCode op, NodeIndex first) {
+        Node& node = nodes_.emplace_back();
+        node.op = op;
+        node.first = first;
+        return node;
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<Range> ranges_;
+    std::vector<Range> pending_ranges_;
 };
 
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
+constexpr std::pair<std::string_view, Function> FUNCTION_NAMES[] = {
+    {"SUM"sv, Function::Sum},
+    {"AVERAGE"sv, Function::Average},
+    {"MIN"sv, Function::Min},
+    {"MAX"sv, Function::Max},
+    {"COUNT"sv, Function::Count},
+};
 
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
+std::string_view GetFunctionName(Function function) {
+    for (const auto& [name, value] : FUNCTION_NAMES) {
+        if (value == function) {
+            return name;
+        }
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
-    }
+    assert(false);
+    return {};
+}
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+Function ParseFunctionName(std::string_view name) {
+    for (const auto& [known_name, value] : FUNCTION_NAMES) {
+        if (known_name == name) {
+            return value;
+        }
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    throw FormulaException("Unknown function: " + std::string(name));
+}
+
+// a range as written in a formula; the corners can be given in any order
+Range ParseRange(std::string_view first, std::string_view last) {
+    const Position lhs = Position::FromString(first);
+    const Position rhs = Position::FromString(last);
+    if (!lhs.IsValid() || !rhs.IsValid()) {
+        throw FormulaException("Invalid range: " + std::string(first) + ':' + std::string(last));
     }
 
-    double Evaluate(std::function<const CellInterface*(const Position*)> cell_getter) const override {
-        auto res = operand_->Evaluate(cell_getter);
-        
-        if (type_ == Type::UnaryMinus) {
-            return -res;
-        }
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
 
-        return res;
+char GetOperatorSign(OpCode op) {
+    switch (op) {
+        case OpCode::Add:
+        case OpCode::UnaryPlus:
+            return '+';
+        case OpCode::Subtract:
+        case OpCode::Negate:
+            return '-';
+        case OpCode::Multiply:
+            return '*';
+        case OpCode::Divide:
+            return '/';
+        default:
+            assert(false);
+            return '?';
     }
+}
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
-};
+// higher is tighter
+ExprPrecedence GetPrecedence(OpCode op) {
+    switch (op) {
+        case OpCode::Add:
+            return EP_ADD;
+        case OpCode::Subtract:
+            return EP_SUB;
+        case OpCode::Multiply:
+            return EP_MUL;
+        case OpCode::Divide:
+            return EP_DIV;
+        case OpCode::Negate:
+        case OpCode::UnaryPlus:
+            return EP_UNARY;
+        default:
+            return EP_ATOM;
+    }
+}
 
-class CellExpr final : public Expr {
+// Prints a constant the way a default stream does (6 significant digits) if
+// that reads back as the same double, otherwise with as few more digits as
+// it takes. Formula texts and the formula cache keys built from them then
+// tell apart constants that differ past the 6th digit
+void PrintNumber(std::ostream& out, double number) {
+    char buffer[32];
+    for (int precision = 6; precision <= std::numeric_limits<double>::max_digits10; ++precision) {
+        std::snprintf(buffer, sizeof(buffer), "%.*g", precision, number);
+        if (std::strtod(buffer, nullptr) == number) {
+            break;
+        }
+    }
+    out << buffer;
+}
+
+// Prints a tree stored in postfix order. The last operand of a node is right
+// before it, and each earlier one ends right before the next one starts
+class TreePrinter {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_(cell) {
+    TreePrinter(const std::vector<Node>& nodes, const std::vector<Range>& ranges, std::ostream& out)
+        : nodes_(nodes)
+        , ranges_(ranges)
+        , out_(out) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
+    // the subtree of index as an S-expression
+    void Print(NodeIndex index) const {
+        const Node& node = nodes_[index];
+        switch (node.op) {
+            case OpCode::PushNumber:
+                PrintNumber(out_, node.number);
+                break;
+            case OpCode::LoadCell:
+                if (!node.cell.IsValid()) {
+                    out_ << FormulaError::Category::Ref;
+                } else {
+                    out_ << node.cell.ToString();
+                }
+                break;
+            case OpCode::Range:
+                out_ << ranges_[node.range].ToString();
+                break;
+            case OpCode::Negate:
+            case OpCode::UnaryPlus:
+                out_ << '(' << GetOperatorSign(node.op) << ' ';
+                Print(index - 1);
+                out_ << ')';
+                break;
+            case OpCode::Aggregate:
+                out_ << '(' << GetFunctionName(node.function);
+                for (NodeIndex arg : GetArgs(index)) {
+                    out_ << ' ';
+                    Print(arg);
+                }
+                out_ << ')';
+                break;
+            default:
+                out_ << '(' << GetOperatorSign(node.op) << ' ';
+                Print(GetLhs(index));
+                out_ << ' ';
+                Print(index - 1);
+                out_ << ')';
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    // the subtree of index in the formula syntax, with only the parentheses
+    // PRECEDENCE_RULES require
+    void PrintFormula(NodeIndex index, ExprPrecedence parent_precedence, const CellFormat& format,
+                      bool right_child = false) const {
+        const Node& node = nodes_[index];
+        const ExprPrecedence precedence = GetPrecedence(node.op);
+        const auto mask = right_child ? PR_RIGHT : PR_LEFT;
+        const bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+        if (parens_needed) {
+            out_ << '(';
+        }
+
+        switch (node.op) {
+            case OpCode::PushNumber:
+                PrintNumber(out_, node.number);
+                break;
+            case OpCode::LoadCell:
+                PrintCell(node.cell, format);
+                break;
+            case OpCode::Range: {
+                const Range& range = ranges_[node.range];
+                const Position first{range.first.row + format.shift.row, range.first.col + format.shift.col};
+                const Position last{range.last.row + format.shift.row, range.last.col + format.shift.col};
+                if (!format.relative && (!first.IsValid() || !last.IsValid())) {
+                    out_ << FormulaError::Category::Ref;
+                } else {
+                    PrintCell(range.first, format);
+                    out_ << ':';
+                    PrintCell(range.last, format);
+                }
+                break;
+            }
+            case OpCode::Negate:
+            case OpCode::UnaryPlus:
+                out_ << GetOperatorSign(node.op);
+                PrintFormula(index - 1, precedence, format);
+                break;
+            case OpCode::Aggregate: {
+                out_ << GetFunctionName(node.function) << '(';
+                bool first = true;
+                for (NodeIndex arg : GetArgs(index)) {
+                    if (!first) {
+                        out_ << ',';
+                    }
+                    first = false;
+                    // the parentheses of the call already separate the argument
+                    PrintFormula(arg, EP_ATOM, format);
+                }
+                out_ << ')';
+                break;
+            }
+            default:
+                PrintFormula(GetLhs(index), precedence, format);
+                out_ << GetOperatorSign(node.op);
+                PrintFormula(index - 1, precedence, format, /* right_child = */ true);
+        }
+
+        if (parens_needed) {
+            out_ << ')';
+        }
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+private:
+    NodeIndex GetLhs(NodeIndex index) const {
+        return nodes_[index - 1].first - 1;
     }
 
-    // Для ячеек метод возвращает вычисленное значение ячейки
-    double Evaluate(std::function<const CellInterface*(const Position*)> cell_getter) const override {
-        // взять ячейку из таблицы
-        const CellInterface* cell = cell_getter(cell_);
+    // the roots of the arguments of a call, in order
+    std::vector<NodeIndex> GetArgs(NodeIndex index) const {
+        std::vector<NodeIndex> args(nodes_[index].arg_count);
+        NodeIndex arg = index - 1;
+        for (auto it = args.rbegin(); it != args.rend(); ++it) {
+            *it = arg;
+            arg = nodes_[arg].first - 1;
+        }
+        return args;
+    }
 
-        if (!cell) {
-            return VALUE_IF_EMPTY_CELL;
+    void PrintCell(Position cell, const CellFormat& format) const {
+        const Position pos{cell.row + format.shift.row, cell.col + format.shift.col};
+        if (format.relative) {
+            out_ << 'R' << '[' << pos.row << ']' << 'C' << '[' << pos.col << ']';
+        } else if (!pos.IsValid()) {
+            out_ << FormulaError::Category::Ref;
+        } else {
+            out_ << pos.ToString();
         }
+    }
 
-        const CellInterface::Value& value = cell->GetValue();
-        // в ней может быть CellInterface::Value = std::variant<std::string, double, FormulaError>
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
-        } else if (std::holds_alternative<std::string>(value)) {
-            // строку нужно попробовать превратить в число
-            try {
-                std::string as_string = std::get<std::string>(value);
-                std::size_t sz = 0;
-                double as_double = std::stod(as_string, &sz);
-                if (sz == as_string.size()) {
-                    return as_double;
-                }
+    const std::vector<Node>& nodes_;
+    const std::vector<Range>& ranges_;
+    std::ostream& out_;
+};
 
-                throw std::runtime_error("cannot convert to double: "s + as_string);
-            } catch (const std::exception& ex) {
-                auto category = FormulaError::Category::Value;
-                throw FormulaError(category);
-            }
+// A stack for a formula deeper than the inline stack of FormulaAST::Execute.
+// The thread keeps one stack per nesting level of evaluations (reading a cell
+// may evaluate its formula) and only grows them, so a deep formula allocates
+// only the first time the thread meets such a depth
+class ScratchStack {
+public:
+    explicit ScratchStack(std::size_t size)
+        : levels_(GetLevels()) {
+        if (levels_.stacks.size() == levels_.in_use) {
+            levels_.stacks.emplace_back();
         }
+        // the buffers of the outer levels stay in place when stacks grows
+        std::vector<double>& stack = levels_.stacks[levels_.in_use++];
+        if (stack.size() < size) {
+            stack.resize(size);
+        }
+        data_ = stack.data();
+    }
 
-        throw std::get<FormulaError>(value);
+    ScratchStack(const ScratchStack&) = delete;
+    ScratchStack& operator=(const ScratchStack&) = delete;
+
+    ~ScratchStack() {
+        --levels_.in_use;
+    }
+
+    double* Get() const {
+        return data_;
     }
+
 private:
-    const Position* cell_;
+    struct Levels {
+        std::vector<std::vector<double>> stacks;
+        std::size_t in_use = 0;
+    };
+
+    static Levels& GetLevels() {
+        thread_local Levels levels;
+        return levels;
+    }
+
+    Levels& levels_;
+    double* data_ = nullptr;
 };
 
-class NumberExpr final : public Expr {
-public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+// Для значения ячейки вычисляет его как число.
+// Если значение - ошибка или текст, не являющийся числом, возвращает false
+// и записывает категорию ошибки в error
+bool GetValueAsNumber(const CellInterface::Value& value, double& result, FormulaError::Category& error) {
+    // в ней может быть CellInterface::Value = std::variant<std::string, double, FormulaError>
+    if (std::holds_alternative<double>(value)) {
+        result = std::get<double>(value);
+        return true;
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    if (std::holds_alternative<std::string>(value)) {
+        // строку нужно попробовать превратить в число; разбор такой же, как у std::stod,
+        // но без исключений: вся строка должна быть числом, переполнение - ошибка
+        const std::string& as_string = std::get<std::string>(value);
+        const char* begin = as_string.c_str();
+        char* end = nullptr;
+        errno = 0;
+        double as_double = std::strtod(begin, &end);
+        if (end != begin && errno != ERANGE && end == begin + as_string.size()) {
+            result = as_double;
+            return true;
+        }
+
+        error = FormulaError::Category::Value;
+        return false;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    error = std::get<FormulaError>(value).GetCategory();
+    return false;
+}
+
+// То же для ячейки; отсутствующая ячейка - ноль
+bool GetCellValue(const CellInterface* cell, double& result, FormulaError::Category& error) {
+    if (!cell) {
+        result = VALUE_IF_EMPTY_CELL;
+        return true;
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    // текст, разобранный при записи, читается без копирования и разбора
+    if (const std::optional<double> number = cell->GetTextAsNumber()) {
+        result = *number;
+        return true;
     }
+    return GetValueAsNumber(cell->GetValue(), result, error);
+}
+
+// Computes the aggregate call over the values of its scalar arguments and
+// the cells of its ranges, taken from ranges and moved by shift. Empty cells of a range are skipped,
+// the others are read as GetCellValue reads a referenced cell. The values go
+// through a block buffer, so SUM, MIN and MAX reduce contiguous numbers.
+// Returns false and sets error on the first error met
+bool EvaluateAggregate(const Node& call, const std::vector<Range>& ranges, const double* scalars,
+                       FormulaAST::CellGetter cell_getter, Position shift, double& result,
+                       FormulaError::Category& error) {
+    constexpr std::size_t BLOCK_SIZE = 1024;
+    double block[BLOCK_SIZE];
+    std::size_t size = 0;
+
+    double sum = 0;
+    double min = HUGE_VAL;
+    double max = -HUGE_VAL;
+    std::size_t count = 0;
+
+    // a NaN stays in min and max: it fails the isfinite check in the end
+    auto flush = [&] {
+        switch (call.function) {
+            case Function::Sum:
+            case Function::Average:
+                sum += vector_kernels::Sum(block, size);
+                break;
+            case Function::Min: {
+                const double block_min = vector_kernels::Min(block, size);
+                min = std::isnan(block_min) || block_min < min ? block_min : min;
+                break;
+            }
+            case Function::Max: {
+                const double block_max = vector_kernels::Max(block, size);
+                max = std::isnan(block_max) || block_max > max ? block_max : max;
+                break;
+            }
+            case Function::Count:
+                break;
+        }
+        count += size;
+        size = 0;
+    };
 
-    // Для чисел метод возвращает значение числа.
-    double Evaluate(std::function<const CellInterface*(const Position*)> /* cell_getter */) const override {
-        return value_;
+    const std::uint32_t scalar_count = call.arg_count - call.ranges.count;
+    for (std::uint32_t i = 0; i < scalar_count; ++i) {
+        block[size++] = scalars[i];
+        if (size == BLOCK_SIZE) {
+            flush();
+        }
     }
 
-private:
-    double value_;
-};
+    for (std::uint32_t i = call.ranges.begin; i < call.ranges.begin + call.ranges.count; ++i) {
+        const Range& range = ranges[i];
+        const Position first{range.first.row + shift.row, range.first.col + shift.col};
+        const Position last{range.last.row + shift.row, range.last.col + shift.col};
+        if (!first.IsValid() || !last.IsValid()) {
+            error = FormulaError::Category::Ref;
+            return false;
+        }
 
-class ParseASTListener final : public FormulaBaseListener {
-public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+        for (int row = first.row; row <= last.row; ++row) {
+            for (int col = first.col; col <= last.col; ++col) {
+                const Position pos{row, col};
+                const CellInterface* cell = cell_getter(&pos);
+                if (!cell || cell->IsEmpty()) {
+                    continue;
+                }
 
-        return root;
+                if (!GetCellValue(cell, block[size], error)) {
+                    return false;
+                }
+                if (++size == BLOCK_SIZE) {
+                    flush();
+                }
+            }
+        }
     }
+    flush();
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    switch (call.function) {
+        case Function::Sum:
+            result = sum;
+            break;
+        case Function::Average:
+            if (count == 0) {
+                error = FormulaError::Category::Div0;
+                return false;
+            }
+            result = sum / count;
+            break;
+        case Function::Min:
+            result = count > 0 ? min : 0;
+            break;
+        case Function::Max:
+            result = count > 0 ? max : 0;
+            break;
+        case Function::Count:
+            result = static_cast<double>(count);
+            break;
     }
 
-public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+    // as for arithmetic, an overflow is reported as #DIV/0!
+    if (!std::isfinite(result)) {
+        error = FormulaError::Category::Div0;
+        return false;
+    }
+    return true;
+}
 
-        auto operand = std::move(args_.back());
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    FormulaAST Build() {
+        return builder_.Build();
+    }
 
-        UnaryOpExpr::Type type;
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+            builder_.AddUnaryOp(OpCode::Negate);
         } else {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            builder_.AddUnaryOp(OpCode::UnaryPlus);
         }
-
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -354,8 +636,7 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        builder_.AddNumber(value);
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -365,33 +646,34 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        builder_.AddCell(value);
     }
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        builder_.AddRange(ParseRange(ctx->CELL(0)->getSymbol()->getText(), ctx->CELL(1)->getSymbol()->getText()));
+    }
 
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const Function function = ParseFunctionName(ctx->NAME()->getSymbol()->getText());
 
-        auto lhs = std::move(args_.back());
+        // the arguments are the last ctx->arg().size() subtrees, in order
+        builder_.AddAggregate(function, ctx->arg().size());
+    }
 
-        BinaryOpExpr::Type type;
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        OpCode op;
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            op = OpCode::Add;
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            op = OpCode::Subtract;
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            op = OpCode::Multiply;
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            op = OpCode::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        builder_.AddBinaryOp(op);
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -399,8 +681,7 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    TreeBuilder builder_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -413,10 +694,326 @@ public:
     }
 };
 
+// Recursive-descent parser for the Formula.g4 grammar with precedence climbing
+// for binary operators. Reads tokens straight from the text and builds the same
+// tree as ParseASTListener does over the ANTLR parse tree.
+class ExprParser {
+public:
+    // every node comes from its own token, so the text length bounds their number
+    explicit ExprParser(std::string_view text)
+        : builder_(text.size())
+        , text_(text) {
+        Advance();
+    }
+
+    // main : expr EOF
+    FormulaAST ParseMain() {
+        ParseExpr(PREC_NONE);
+        if (token_.kind != TokenKind::End) {
+            Fail("unexpected");
+        }
+
+        return builder_.Build();
+    }
+
+private:
+    enum class TokenKind {
+        End,
+        Number,
+        Cell,
+        Name,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Colon,
+        Comma,
+    };
+
+    struct Token {
+        TokenKind kind = TokenKind::End;
+        std::string_view text;
+    };
+
+    // grammar alternatives from the loosest to the tightest;
+    // an operand of a unary operator cannot contain binary operators
+    enum Precedence {
+        PREC_NONE,
+        PREC_ADDITIVE,
+        PREC_MULTIPLICATIVE,
+        PREC_UNARY,
+    };
+
+    static Precedence GetBinaryPrecedence(TokenKind kind) {
+        switch (kind) {
+            case TokenKind::Add:
+            case TokenKind::Sub:
+                return PREC_ADDITIVE;
+            case TokenKind::Mul:
+            case TokenKind::Div:
+                return PREC_MULTIPLICATIVE;
+            default:
+                return PREC_NONE;
+        }
+    }
+
+    // parses operators binding tighter than min_precedence; all of them are left-associative
+    void ParseExpr(Precedence min_precedence) {
+        ParsePrimary();
+
+        for (;;) {
+            const Precedence precedence = GetBinaryPrecedence(token_.kind);
+            if (precedence <= min_precedence) {
+                return;
+            }
+
+            OpCode op;
+            switch (token_.kind) {
+                case TokenKind::Add:
+                    op = OpCode::Add;
+                    break;
+                case TokenKind::Sub:
+                    op = OpCode::Subtract;
+                    break;
+                case TokenKind::Mul:
+                    op = OpCode::Multiply;
+                    break;
+                default:
+                    assert(token_.kind == TokenKind::Div);
+                    op = OpCode::Divide;
+            }
+            Advance();
+
+            ParseExpr(precedence);
+            builder_.AddBinaryOp(op);
+        }
+    }
+
+    void ParsePrimary() {
+        const Token token = token_;
+        switch (token.kind) {
+            case TokenKind::LeftParen: {
+                Advance();
+                ParseExpr(PREC_NONE);
+                if (token_.kind != TokenKind::RightParen) {
+                    Fail("expected ')' instead of");
+                }
+                Advance();
+                return;
+            }
+            case TokenKind::Add:
+            case TokenKind::Sub: {
+                Advance();
+                ParseExpr(PREC_UNARY);
+                builder_.AddUnaryOp(token.kind == TokenKind::Add ? OpCode::UnaryPlus : OpCode::Negate);
+                return;
+            }
+            case TokenKind::Cell: {
+                auto value = Position::FromString(token.text);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(token.text));
+                }
+                Advance();
+
+                builder_.AddCell(value);
+                return;
+            }
+            case TokenKind::Name: {
+                // NAME '(' arg (',' arg)* ')'
+                const Function function = ParseFunctionName(token.text);
+                Advance();
+                if (token_.kind != TokenKind::LeftParen) {
+                    Fail("expected '(' instead of");
+                }
+
+                std::size_t arg_count = 0;
+                do {
+                    Advance();
+                    ParseArgument();
+                    ++arg_count;
+                } while (token_.kind == TokenKind::Comma);
+
+                if (token_.kind != TokenKind::RightParen) {
+                    Fail("expected ')' instead of");
+                }
+                Advance();
+                builder_.AddAggregate(function, arg_count);
+                return;
+            }
+            case TokenKind::Number: {
+                // same rules as reading a double from a stream: an overflow is an error,
+                // an underflow gives zero or a subnormal
+                const std::string value_str(token.text);
+                const double value = std::strtod(value_str.c_str(), nullptr);
+                if (std::isinf(value)) {
+                    throw FormulaException("Invalid number: " + value_str);
+                }
+                Advance();
+
+                builder_.AddNumber(value);
+                return;
+            }
+            default:
+                Fail("unexpected");
+        }
+    }
+
+    // arg : CELL ':' CELL | expr
+    void ParseArgument() {
+        if (token_.kind == TokenKind::Cell) {
+            // one token of lookahead tells a range from an expression starting with a cell
+            const Token first = token_;
+            const std::size_t first_end = pos_;
+            Advance();
+            if (token_.kind == TokenKind::Colon) {
+                Advance();
+                if (token_.kind != TokenKind::Cell) {
+                    Fail("expected a cell instead of");
+                }
+                builder_.AddRange(ParseRange(first.text, token_.text));
+                Advance();
+                return;
+            }
+
+            token_ = first;
+            pos_ = first_end;
+        }
+
+        ParseExpr(PREC_NONE);
+    }
+
+    // Reads the next token into token_. Follows the Formula.g4 lexer rules:
+    // NUMBER : UINT EXPONENT? | UINT? '.' UINT EXPONENT?, CELL : [A-Z]+[0-9]+,
+    // NAME : [A-Z]+, whitespace is skipped. Anything that cannot start or complete a token is an error
+    void Advance() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+
+        const std::size_t begin = pos_;
+        if (pos_ == text_.size()) {
+            token_ = {TokenKind::End, {}};
+            return;
+        }
+
+        TokenKind kind;
+        const char c = text_[pos_];
+        switch (c) {
+            case '+':
+                kind = TokenKind::Add;
+                ++pos_;
+                break;
+            case '-':
+                kind = TokenKind::Sub;
+                ++pos_;
+                break;
+            case '*':
+                kind = TokenKind::Mul;
+                ++pos_;
+                break;
+            case '/':
+                kind = TokenKind::Div;
+                ++pos_;
+                break;
+            case '(':
+                kind = TokenKind::LeftParen;
+                ++pos_;
+                break;
+            case ')':
+                kind = TokenKind::RightParen;
+                ++pos_;
+                break;
+            case ':':
+                kind = TokenKind::Colon;
+                ++pos_;
+                break;
+            case ',':
+                kind = TokenKind::Comma;
+                ++pos_;
+                break;
+            default:
+                if (IsUpper(c)) {
+                    // the longest match: letters with digits are a cell, letters alone a name
+                    SkipWhile(IsUpper);
+                    kind = SkipWhile(IsDigit) > 0 ? TokenKind::Cell : TokenKind::Name;
+                } else if (IsDigit(c) || c == '.') {
+                    kind = TokenKind::Number;
+                    LexNumber(begin);
+                } else {
+                    FailLexing(begin);
+                }
+        }
+
+        token_ = {kind, text_.substr(begin, pos_ - begin)};
+    }
+
+    void LexNumber(std::size_t begin) {
+        SkipWhile(IsDigit);
+        if (pos_ < text_.size() && text_[pos_] == '.') {
+            ++pos_;
+            if (SkipWhile(IsDigit) == 0) {
+                FailLexing(pos_ - 1);
+            }
+        }
+
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            // without digits the exponent letter starts no valid token
+            const std::size_t exponent = pos_++;
+            if (pos_ < text_.size() && (text_[pos_] == '+' || text_[pos_] == '-')) {
+                ++pos_;
+            }
+            if (SkipWhile(IsDigit) == 0) {
+                FailLexing(exponent);
+            }
+        }
+
+        assert(pos_ > begin);
+    }
+
+    template <typename Predicate>
+    std::size_t SkipWhile(Predicate predicate) {
+        const std::size_t begin = pos_;
+        while (pos_ < text_.size() && predicate(text_[pos_])) {
+            ++pos_;
+        }
+
+        return pos_ - begin;
+    }
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    [[noreturn]] void Fail(const char* what) const {
+        throw FormulaException("Error when parsing: "s + what + " '"
+                               + std::string(token_.kind == TokenKind::End ? "<EOF>"sv : token_.text) + "'");
+    }
+
+    [[noreturn]] void FailLexing(std::size_t pos) const {
+        throw FormulaException("Error when lexing: unexpected '"s + text_[pos] + "' at "
+                               + std::to_string(pos));
+    }
+
+    TreeBuilder builder_;
+    std::string_view text_;
+    std::size_t pos_ = 0;
+    Token token_;
+};
+
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -437,49 +1034,353 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.Build();
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str) {
     std::istringstream in(in_str);
     try {
-        return ParseFormulaAST(in);
+        return ParseFormulaASTWithAntlr(in);
     } catch (const std::exception& exc) {
         std::throw_with_nested(FormulaException(exc.what()));
     }
 }
 
+FormulaAST ParseFormulaAST(std::string_view expression) {
+    ASTImpl::ExprParser parser(expression);
+    return parser.ParseMain();
+}
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string expression(std::istreambuf_iterator<char>(in), {});
+
+    return ParseFormulaAST(std::string_view(expression));
+}
+
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
+    for (auto cell : GetCells()) {
         out << cell.ToString() << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::TreePrinter(nodes_, ranges_, out).Print(nodes_.size() - 1);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position shift) const {
+    ASTImpl::TreePrinter(nodes_, ranges_, out).PrintFormula(nodes_.size() - 1, ASTImpl::EP_ATOM, {shift, false});
 }
 
-double FormulaAST::Execute(std::function<const CellInterface*(const Position*)> cell_getter) const {
-    return root_expr_->Evaluate(cell_getter);
+void FormulaAST::PrintShape(std::ostream& out, Position anchor) const {
+    ASTImpl::TreePrinter(nodes_, ranges_, out)
+        .PrintFormula(nodes_.size() - 1, ASTImpl::EP_ATOM, {{-anchor.row, -anchor.col}, true});
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells))
+FormulaAST::Value FormulaAST::Execute(CellGetter cell_getter, Position shift) const {
+    using ASTImpl::OpCode;
+    using Category = FormulaError::Category;
+
+    // most formulas fit into the inline stack, deeper ones take a scratch one of the thread
+    // (the depth grows only with right-nested subexpressions, A1+A2+...+An needs 2 slots)
+    constexpr std::size_t INLINE_STACK_SIZE = 64;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::optional<ASTImpl::ScratchStack> scratch;
+    double* stack = inline_stack;
+    if (max_stack_depth_ > INLINE_STACK_SIZE) {
+        stack = scratch.emplace(max_stack_depth_).Get();
+    }
+
+    double* top = stack;  // the first free slot
+    Category error = Category::Value;
+    for (const ASTImpl::Node& node : nodes_) {
+        switch (node.op) {
+            case OpCode::PushNumber:
+                *top++ = node.number;
+                break;
+            case OpCode::LoadCell: {
+                const Position pos{node.cell.row + shift.row, node.cell.col + shift.col};
+                if (!pos.IsValid()) {
+                    return FormulaError(Category::Ref);
+                }
+                if (!ASTImpl::GetCellValue(cell_getter(&pos), *top++, error)) {
+                    return FormulaError(error);
+                }
+                break;
+            }
+            case OpCode::Add:
+                --top;
+                top[-1] += top[0];
+                if (!std::isfinite(top[-1])) {
+                    return FormulaError(Category::Div0);
+                }
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] -= top[0];
+                if (!std::isfinite(top[-1])) {
+                    return FormulaError(Category::Div0);
+                }
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] *= top[0];
+                if (!std::isfinite(top[-1])) {
+                    return FormulaError(Category::Div0);
+                }
+                break;
+            case OpCode::Divide:
+                --top;
+                if (std::abs(top[0] - 0) <= 1e-6) {
+                    return FormulaError(Category::Div0);
+                }
+                top[-1] /= top[0];
+                break;
+            case OpCode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::UnaryPlus:
+            case OpCode::Range:
+                break;
+            case OpCode::Aggregate:
+                top -= node.arg_count - node.ranges.count;
+                if (!ASTImpl::EvaluateAggregate(node, ranges_, top, cell_getter, shift, *top, error)) {
+                    return FormulaError(error);
+                }
+                ++top;
+                break;
+        }
+    }
+
+    assert(top == stack + 1);
+    return stack[0];
+}
+
+void FormulaAST::ExecuteBatch(CellGetter cell_getter, ColumnReader column_reader, const Position* shifts,
+                              std::size_t count, Value* results) const {
+    using ASTImpl::OpCode;
+    using Category = FormulaError::Category;
+
+    // Lanes go in blocks, so the stack of a block stays in the L1 cache.
+    // Stack slot k of all lanes is one contiguous row of BLOCK_SIZE numbers
+    constexpr std::size_t BLOCK_SIZE = 256;
+    std::vector<double> stack(std::max<std::size_t>(max_stack_depth_, 1) * BLOCK_SIZE);
+    // the first error of each lane; a lane with an error keeps computing
+    // garbage, which is thrown away, instead of leaving the batch
+    std::optional<Category> errors[BLOCK_SIZE];
+    std::uint8_t failed[BLOCK_SIZE] = {};
+    // arguments of an aggregate function for one lane
+    std::vector<double> scalars(max_stack_depth_);
+
+    auto take_failed = [&errors, &failed](std::size_t n, Category category) {
+        for (std::size_t lane = 0; lane < n; ++lane) {
+            if (failed[lane]) {
+                if (!errors[lane]) {
+                    errors[lane] = category;
+                }
+                failed[lane] = 0;
+            }
+        }
+    };
+
+    for (std::size_t begin = 0; begin < count; begin += BLOCK_SIZE) {
+        const std::size_t n = std::min(BLOCK_SIZE, count - begin);
+        std::fill(errors, errors + n, std::nullopt);
+
+        // lane i is the cell i rows below lane 0, so each reference of the
+        // block is a run of n cells down one column
+        bool column_run = true;
+        for (std::size_t lane = 1; lane < n && column_run; ++lane) {
+            const Position& shift = shifts[begin + lane];
+            column_run = shift.col == shifts[begin].col && shift.row == shifts[begin].row + static_cast<int>(lane);
+        }
+
+        double* top = stack.data();  // the first free row
+        for (const ASTImpl::Node& node : nodes_) {
+            switch (node.op) {
+                case OpCode::PushNumber:
+                    vector_kernels::Fill(top, node.number, n);
+                    top += BLOCK_SIZE;
+                    break;
+                case OpCode::LoadCell: {
+                    const Position& cell = node.cell;
+                    if (column_run) {
+                        // lanes that have already failed read the cell too; their values are thrown away
+                        const Position first{cell.row + shifts[begin].row, cell.col + shifts[begin].col};
+                        const Position last{first.row + static_cast<int>(n) - 1, first.col};
+                        if (first.IsValid() && last.IsValid() && column_reader(first, n, top)) {
+                            top += BLOCK_SIZE;
+                            break;
+                        }
+                    }
+
+                    for (std::size_t lane = 0; lane < n; ++lane) {
+                        top[lane] = 0;
+                        if (errors[lane]) {
+                            // the scalar machine has already stopped on this lane
+                            continue;
+                        }
+
+                        const Position& shift = shifts[begin + lane];
+                        const Position pos{cell.row + shift.row, cell.col + shift.col};
+                        Category error = Category::Value;
+                        if (!pos.IsValid()) {
+                            errors[lane] = Category::Ref;
+                        } else if (!ASTImpl::GetCellValue(cell_getter(&pos), top[lane], error)) {
+                            errors[lane] = error;
+                        }
+                    }
+                    top += BLOCK_SIZE;
+                    break;
+                }
+                case OpCode::Add:
+                    top -= BLOCK_SIZE;
+                    if (vector_kernels::Add(top - BLOCK_SIZE, top, failed, n)) {
+                        take_failed(n, Category::Div0);
+                    }
+                    break;
+                case OpCode::Subtract:
+                    top -= BLOCK_SIZE;
+                    if (vector_kernels::Subtract(top - BLOCK_SIZE, top, failed, n)) {
+                        take_failed(n, Category::Div0);
+                    }
+                    break;
+                case OpCode::Multiply:
+                    top -= BLOCK_SIZE;
+                    if (vector_kernels::Multiply(top - BLOCK_SIZE, top, failed, n)) {
+                        take_failed(n, Category::Div0);
+                    }
+                    break;
+                case OpCode::Divide:
+                    top -= BLOCK_SIZE;
+                    if (vector_kernels::Divide(top - BLOCK_SIZE, top, failed, n)) {
+                        take_failed(n, Category::Div0);
+                    }
+                    break;
+                case OpCode::Negate:
+                    vector_kernels::Negate(top - BLOCK_SIZE, n);
+                    break;
+                case OpCode::UnaryPlus:
+                case OpCode::Range:
+                    break;
+                case OpCode::Aggregate: {
+                    // the ranges of each lane are different cells, so the lanes go one by one
+                    const std::uint32_t scalar_count = node.arg_count - node.ranges.count;
+                    top -= scalar_count * BLOCK_SIZE;
+                    for (std::size_t lane = 0; lane < n; ++lane) {
+                        if (errors[lane]) {
+                            top[lane] = 0;
+                            continue;
+                        }
+
+                        for (std::uint32_t i = 0; i < scalar_count; ++i) {
+                            scalars[i] = top[i * BLOCK_SIZE + lane];
+                        }
+                        Category error = Category::Value;
+                        if (!ASTImpl::EvaluateAggregate(node, ranges_, scalars.data(), cell_getter,
+                                                        shifts[begin + lane], top[lane], error)) {
+                            errors[lane] = error;
+                            top[lane] = 0;
+                        }
+                    }
+                    top += BLOCK_SIZE;
+                    break;
+                }
+            }
+        }
+
+        assert(top == stack.data() + BLOCK_SIZE);
+        for (std::size_t lane = 0; lane < n; ++lane) {
+            if (errors[lane]) {
+                results[begin + lane] = FormulaError(*errors[lane]);
+            } else {
+                results[begin + lane] = stack[lane];
+            }
+        }
+    }
+}
+
+FormulaAST::FormulaAST(std::vector<ASTImpl::Node> nodes, std::vector<Range> ranges)
+    : nodes_(std::move(nodes))
+    , ranges_(std::move(ranges))
 {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+    using ASTImpl::OpCode;
+
+    std::size_t depth = 0;
+    for (const ASTImpl::Node& node : nodes_) {
+        switch (node.op) {
+            case OpCode::PushNumber:
+            case OpCode::LoadCell:
+                ++depth;
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+                --depth;
+                break;
+            case OpCode::Negate:
+            case OpCode::UnaryPlus:
+            case OpCode::Range:
+                break;
+            case OpCode::Aggregate:
+                depth = depth + 1 - (node.arg_count - node.ranges.count);
+                break;
+        }
+        max_stack_depth_ = std::max(max_stack_depth_, depth);
+    }
+    assert(depth == 1);
 }
 
-const std::forward_list<Position>& FormulaAST::GetCells() const {
-    return cells_;
+std::size_t FormulaAST::GetMemoryUsage() const {
+    return sizeof(*this) + nodes_.capacity() * sizeof(ASTImpl::Node) + ranges_.capacity() * sizeof(Range);
 }
 
-std::forward_list<Position> FormulaAST::GetCells() {
-    return cells_;
+std::vector<Position> FormulaAST::GetCells() const {
+    std::vector<Position> cells;
+    for (const ASTImpl::Node& node : nodes_) {
+        if (node.op == ASTImpl::OpCode::LoadCell) {
+            cells.push_back(node.cell);
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    return cells;
+}
+
+std::vector<Range> FormulaAST::GetRanges() const {
+    std::vector<Range> ranges = ranges_;
+    std::sort(ranges.begin(), ranges.end());
+    return ranges;
+}
+
+const ASTImpl::Node* FormulaAST::GetRangeOnlyAggregate() const {
+    // a unary plus changes nothing
+    auto root = nodes_.rbegin();
+    while (root->op == ASTImpl::OpCode::UnaryPlus) {
+        ++root;
+    }
+
+    if (root->op != ASTImpl::OpCode::Aggregate || root->arg_count != root->ranges.count) {
+        return nullptr;
+    }
+    return &*root;
+}
+
+FormulaAST::Value FormulaAST::ReadCell(const CellInterface* cell) {
+    double result = 0;
+    FormulaError::Category error = FormulaError::Category::Value;
+    if (!ASTImpl::GetCellValue(cell, result, error)) {
+        return FormulaError(error);
+    }
+    return result;
+}
+
+FormulaAST::Value FormulaAST::ReadValue(const CellInterface::Value& value) {
+    double result = 0;
+    FormulaError::Category error = FormulaError::Category::Value;
+    if (!ASTImpl::GetValueAsNumber(value, result, error)) {
+        return FormulaError(error);
+    }
+    return result;
 }
 
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
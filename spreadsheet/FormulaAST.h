@@ -2,14 +2,67 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "function_ref.h"
 
-#include <forward_list>
-#include <functional>
+#include <cstddef>
+#include <cstdint>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
 namespace ASTImpl {
-class Expr;
-}
+// What a node of the formula tree does. The nodes are stored in postfix
+// order, so the array of nodes is also the code of a small stack machine.
+enum class OpCode : std::uint8_t {
+    PushNumber,  // push number
+    LoadCell,    // push the value of the cell at cell
+    Add,         // pop rhs, pop lhs, push lhs + rhs
+    Subtract,    // pop rhs, pop lhs, push lhs - rhs
+    Multiply,    // pop rhs, pop lhs, push lhs * rhs
+    Divide,      // pop rhs, pop lhs, push lhs / rhs
+    Negate,      // replace the top with its negation
+    UnaryPlus,   // does nothing, kept for printing
+    Range,       // an argument of an aggregate call, does nothing by itself
+    Aggregate,   // pop the scalar arguments, push the result of function
+};
+
+enum class Function : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+using NodeIndex = std::uint32_t;
+
+// A node of the formula tree: 16 bytes with the operands inline. The
+// children of a node come right before it; first links a node to the
+// beginning of its subtree, so the root of the previous sibling is at first - 1
+struct Node {
+    Node()
+        : number(0) {
+    }
+
+    OpCode op = OpCode::PushNumber;
+    Function function = Function::Sum;  // Aggregate
+    std::uint16_t arg_count = 0;        // Aggregate: scalar arguments and ranges
+    NodeIndex first = 0;
+    union {
+        double number;        // PushNumber
+        Position cell;        // LoadCell, as parsed
+        std::uint32_t range;  // Range: the index in the ranges of the formula
+        // Aggregate: the ranges of the call are ranges[begin, begin + count)
+        struct {
+            std::uint32_t begin;
+            std::uint32_t count;
+        } ranges;
+    };
+};
+static_assert(sizeof(Node) == 16 && std::is_trivially_copyable_v<Node>);
+}  // namespace ASTImpl
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,25 +70,70 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    // nodes is a tree in postfix order (see ASTImpl::Node), its Range and
+    // Aggregate nodes refer to ranges
+    explicit FormulaAST(std::vector<ASTImpl::Node> nodes, std::vector<Range> ranges);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(std::function<const CellInterface*(const Position*)> cell_getter) const;
+    // Returns the cell at the position or nullptr; a non-owning reference,
+    // so passing it around never allocates
+    using CellGetter = FunctionRef<const CellInterface*(const Position*)>;
+    // Either the value or the first error met during evaluation
+    using Value = std::variant<double, FormulaError>;
+
+    // Runs the nodes as the code of a stack machine.
+    // Every cell reference is moved by shift (zero keeps them as parsed), so one
+    // tree serves formulas copied along a column. Errors are returned as values,
+    // nothing is thrown; a reference moved off the sheet gives #REF!
+    Value Execute(CellGetter cell_getter, Position shift) const;
+    // Reads count cells down a column from first into values, as numbers, the
+    // way SheetInterface::ReadColumnNumbers does; false if it cannot
+    using ColumnReader = FunctionRef<bool(Position first, std::size_t count, double* values)>;
+
+    // Evaluates the formula for count cells at once: results[i] is exactly what
+    // Execute(cell_getter, shifts[i]) returns. Every instruction runs over the
+    // whole batch of lanes (see vector_kernels.h). When the lanes are
+    // consecutive cells of a column, as for a formula copied down, a reference
+    // is read for all of them by one column_reader call; cells it cannot read
+    // go through cell_getter one by one
+    void ExecuteBatch(CellGetter cell_getter, ColumnReader column_reader, const Position* shifts,
+                      std::size_t count, Value* results) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position shift) const;
+    // Prints the formula with references as R[row]C[col] offsets from anchor:
+    // formulas copied along a column have the same shape
+    void PrintShape(std::ostream& out, Position anchor) const;
+    // The bytes taken by the formula
+    std::size_t GetMemoryUsage() const;
 
-    const std::forward_list<Position>& GetCells() const;
-    std::forward_list<Position> GetCells();
-private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // the referenced cells, sorted, with repeats
+    std::vector<Position> GetCells() const;
+    // ranges of the aggregate function arguments, sorted; their cells are not in GetCells
+    std::vector<Range> GetRanges() const;
+    // The call if the whole formula is one aggregate function of ranges only,
+    // like SUM(A1:A100,C1:C100); nullptr otherwise
+    const ASTImpl::Node* GetRangeOnlyAggregate() const;
 
-    // все встреченные индексы ячеек сохранятся в отдельный список при парсинге формулы в методе ParseFormulaAST
-    std::forward_list<Position> cells_;
+    // Reads a cell the way a reference to it is read: a missing or empty cell
+    // is zero, text must be a number as a whole, an error stays an error
+    static Value ReadCell(const CellInterface* cell);
+    // The same for a value already read from a cell
+    static Value ReadValue(const CellInterface::Value& value);
+private:
+    std::vector<ASTImpl::Node> nodes_;  // the root is the last
+    std::vector<Range> ranges_;
+    std::size_t max_stack_depth_ = 0;
 };
 
+// Parses the expression with the hand-written parser; a syntax error
+// or an invalid cell reference is reported with FormulaException
+FormulaAST ParseFormulaAST(std::string_view expression);
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+
+// The same through the ANTLR-generated parser. Much slower, it is kept as
+// the reference implementation of Formula.g4 to test ParseFormulaAST against
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
+FormulaAST ParseFormulaASTWithAntlr(const std::string& in_str);
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Замена глобальных operator new/delete вынесена в отдельную единицу трансляции,
+// чтобы компилятор не встраивал их в места вызова
+
+#ifdef COUNT_ALLOCATIONS
+
+namespace {
+// выделяют память и потоки RecalculateAll; порядок счетчику не важен
+std::atomic<std::size_t> allocation_count{0};
+}  // namespace
+
+std::size_t GetAllocationCount() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+// нужна в паре с заменой operator delete: ее вызывает, например, std::stable_sort
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+#else
+
+std::size_t GetAllocationCount() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// Глобальные operator new/delete заменяются счетчиком, только если программа
+// собрана с COUNT_ALLOCATIONS (опция CMake COUNT_ALLOCATIONS, по умолчанию
+// выключена): иначе каждое выделение памяти платило бы за атомарный инкремент
+#ifdef COUNT_ALLOCATIONS
+inline constexpr bool ALLOCATIONS_COUNTED = true;
+#else
+inline constexpr bool ALLOCATIONS_COUNTED = false;
+#endif
+
+// Число вызовов глобального operator new с начала работы программы; 0, если
+// выделения не считаются (см. ALLOCATIONS_COUNTED).
+// Используется бенчмарками, проверяющими отсутствие выделений памяти
+std::size_t GetAllocationCount();
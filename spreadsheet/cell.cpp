@@ -1,93 +1,426 @@
 #include "cell.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cmath>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <optional>
-#include <deque>
 #include <unordered_set>
+#include <utility>
 
 using namespace std::literals;
 
-Cell::Cell(SheetInterface& sheet)
-    : sheet_(sheet)
+namespace {
+CellInterface::Value ToCellValue(const FormulaInterface::Value& result) {
+    if (std::holds_alternative<double>(result)) {
+        return std::get<double>(result);
+    }
+
+    return std::get<FormulaError>(result);
+}
+
+// После стольких приращений сумма пересчитывается заново, чтобы ошибки
+// округления не накапливались
+constexpr std::uint32_t MAX_RANGE_DELTAS = 1024;
+
+// Значение SUM/COUNT/AVERAGE по сумме и числу непустых ячеек; как и при
+// вычислении формулы, AVERAGE пустых диапазонов и переполнение дают #DIV/0!
+CellInterface::Value AggregateValue(SharedFormula::RangeAggregate function, double sum, std::uint64_t count) {
+    double result = sum;
+    if (function == SharedFormula::RangeAggregate::Count) {
+        result = static_cast<double>(count);
+    } else if (function == SharedFormula::RangeAggregate::Average) {
+        result = count > 0 ? sum / count : NAN;
+    }
+
+    if (!std::isfinite(result)) {
+        return FormulaError(FormulaError::Category::Div0);
+    }
+    return result;
+}
+
+// Совпадают ли значения так, что зависимые от ячейки формулы дадут те же
+// результаты: 0 и -0 различаются, любые два NaN - нет
+bool SameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+    if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+        const double a = std::get<double>(lhs);
+        const double b = std::get<double>(rhs);
+        return (a == b && std::signbit(a) == std::signbit(b)) || (std::isnan(a) && std::isnan(b));
+    }
+    return lhs == rhs;
+}
+
+// Число, которым ссылка из формулы прочтет текст ячейки (см. GetCellValue в
+// FormulaAST.cpp: std::strtod, текст целиком, без выхода за диапазон double).
+// std::from_chars не принимает пробелов, знака "+" и шестнадцатеричной
+// записи, а для денормализованных чисел strtod может сообщить о выходе за
+// диапазон. Такой текст не разбирается заранее и читается, как раньше, через
+// GetValue: результат тот же, быстрый путь просто не используется
+std::optional<double> ParseTextNumber(std::string_view text) {
+    if (!text.empty() && text.front() == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+
+    double number = 0;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (error != std::errc() || end != text.data() + text.size() || std::fpclassify(number) == FP_SUBNORMAL) {
+        return std::nullopt;
+    }
+    return number;
+}
+}  // namespace
+
+Cell::Cell(Sheet& sheet, Position pos, bool first)
+    : node_(sheet.GetGraph().AddNode(this, pos, first))
+    , sheet_(sheet)
 {
 }
 
 Cell::~Cell() = default;
 
 void Cell::Set(std::string text) {
-    if (text.size() > 1 && *text.begin() == FORMULA_SIGN) {
-        // ParseFormula бросит FormulaException при синтаксически некорректной формуле
-        auto formula = ParseFormula(std::string(text.begin() + 1, text.end()));
+    // бросит FormulaException при синтаксически некорректной формуле
+    Content content = Parse(sheet_, sheet_.GetGraph().GetPosition(node_), std::move(text));
+
+    if (content.formula) {
+        // удаление ссылок циклов не создает, поэтому проверяем только новые ссылки;
+        // если набор ссылок не расширился, проверка не нужна вовсе
+        auto refs = content.formula->GetReferencedCells(content.shift);
+        auto old_refs = GetReferencedCells();
+        std::vector<Position> added_refs;
+        std::set_difference(refs.begin(), refs.end(), old_refs.begin(), old_refs.end(),
+                            std::back_inserter(added_refs));
+        auto ranges = content.formula->GetReferencedRanges(content.shift);
+        auto old_ranges = GetReferencedRanges();
+        std::vector<Range> added_ranges;
+        std::set_difference(ranges.begin(), ranges.end(), old_ranges.begin(), old_ranges.end(),
+                            std::back_inserter(added_ranges));
 
-        auto refs = formula->GetReferencedCells();
         // проверяем что не принесли циклов в таблицу
-        if (CheckCycles(refs)) {
-            std::string as_text = formula->GetExpression();
+        if ((!added_refs.empty() || !added_ranges.empty()) && CheckCycles(added_refs, added_ranges)) {
+            std::string as_text = content.formula->GetExpression(content.shift);
             throw CircularDependencyException("Have circular dependicies: "s + as_text);
         }
 
-        // все ячейки из фурмулы надо создать в таблице
-        for (const auto& pos : refs) {
-            if (!sheet_.GetCell(pos)) {    // если ячейка еще не существует
-                sheet_.SetCell(pos, ""s);  // создаем пустую
+        // все ячейки из фурмулы надо создать в таблице; ячейки диапазонов
+        // не создаются, диапазон хранится в графе целиком
+        for (const auto& ref : added_refs) {
+            if (!sheet_.TryGetCell(ref)) {    // если ячейка еще не существует
+                sheet_.CreateEmptyCell(ref);  // создаем пустую
             }
         }
+    }
+
+    DeleteThisFromChildren();
+    Clear();
+    SetText(std::move(content.text));
+    formula_ = std::move(content.formula);
+    formula_shift_ = content.shift;
+    AddThisToChildren();
+}
 
-        Clear();
-        formula_ = std::move(formula);
+Cell::Content Cell::Parse(Sheet& sheet, Position pos, std::string text) {
+    Content content;
+    if (text.size() > 1 && *text.begin() == FORMULA_SIGN) {
+        // одинаковые формулы и формулы одной формы разделяют один разобранный объект
+        auto [formula, shift] = sheet.GetFormulaCache().Get(std::string(text.begin() + 1, text.end()), pos);
+        content.formula = std::move(formula);
+        content.shift = shift;
     } else {
-        Clear();
-        text_ = std::move(text);
+        content.text = std::move(text);
     }
+    return content;
+}
+
+Cell::Content Cell::Exchange(Content content) {
+    Content old{std::move(text_), std::move(formula_), formula_shift_};
+    SetText(std::move(content.text));
+    formula_ = std::move(content.formula);
+    formula_shift_ = content.shift;
+    aggregate_.reset();
+    cashed_value_.reset();
+    verified_at_ = 0;  // эпоха листа еще не сдвинута, а кэша уже нет
+    return old;
 }
 
 void Cell::Clear() {
-    text_ = ""s;
-    formula_.release();
+    SetText(""s);
+    formula_.reset();
+    aggregate_.reset();
 }
 
 Cell::Value Cell::GetValue() const {
-    if (cashed_value_.has_value()) {
-        return cashed_value_.value();
+    Actualize();
+    return cashed_value_.value();
+}
+
+void Cell::Actualize() const {
+    const std::uint64_t epoch = sheet_.GetEpoch();
+    if (verified_at_ == epoch || (cashed_value_.has_value() && sheet_.IsRecalculated())) {
+        return;
+    }
+
+    if (!formula_) {
+        // ячейка без формулы ни от чего не зависит, обход не нужен
+        ActualizeSingle(epoch);
+        return;
+    }
+
+    // Собираем неподтвержденные в этой эпохе ячейки конуса зависимостей в
+    // обратном обходе (сначала ячейки, на которые ссылается формула) и
+    // актуализируем их снизу вверх. Обход итеративный, поэтому глубина стека
+    // не зависит от длины цепочки ссылок
+    const DependencyGraph& graph = sheet_.GetGraph();
+    std::vector<std::pair<const Cell*, bool>> cells_to_visit{{this, false}};
+    std::vector<const Cell*> cone;
+
+    while (!cells_to_visit.empty()) {
+        auto [cell, expanded] = cells_to_visit.back();
+        cells_to_visit.pop_back();
+
+        if (expanded) {
+            cone.push_back(cell);
+            continue;
+        }
+
+        // ячейка могла попасть в стек несколько раз; раскрываем ее один раз,
+        // и тогда она попадет в cone после всех ячеек, на которые ссылается
+        if (cell->collected_at_ == epoch) {
+            continue;
+        }
+        cell->collected_at_ = epoch;
+
+        cells_to_visit.push_back({cell, true});
+        double sum = 0;
+        std::uint64_t count = 0;
+        if (cell->aggregate_ || (!cell->cashed_value_ && cell->TrySumRanges(sum, count))) {
+            // ячейки диапазонов такой формулы - без формул: их изменения уже
+            // учтены приращениями, а значение считается по префиксным суммам
+            continue;
+        }
+        graph.ForEachPrecedent(cell->node_, [&](DependencyGraph::NodeId node) {
+            const Cell* child = graph.GetCell(node);
+            if (child->verified_at_ != epoch && child->collected_at_ != epoch) {
+                cells_to_visit.push_back({child, false});
+            }
+        });
+    }
+
+    for (const Cell* cell : cone) {
+        cell->ActualizeSingle(epoch);
+    }
+}
+
+bool Cell::ActualizeSingle(std::uint64_t epoch) const {
+    // кэш актуален, если с момента его вычисления не изменилась ни одна ячейка,
+    // от которой зависит формула; иначе значение надо пересчитать
+    const bool stale = !cashed_value_.has_value() || HasChangedChildren();
+    if (stale) {
+        StoreComputed(Compute(), epoch);
+        InitRangeAggregate();
+    }
+
+    verified_at_ = epoch;
+    return stale;
+}
+
+bool Cell::Refresh() const {
+    const std::uint64_t epoch = sheet_.GetEpoch();
+    if (verified_at_ == epoch) {
+        return false;
+    }
+    return ActualizeSingle(epoch);
+}
+
+bool Cell::ChangedSince(std::uint64_t epoch) const {
+    return changed_at_ > epoch;
+}
+
+void Cell::StoreComputed(CellInterface::Value value, std::uint64_t epoch) const {
+    // кэш формулы без значения бывает только после записи в ячейку, а запись
+    // уже сдвинула эпоху изменения
+    if (formula_ && cashed_value_.has_value() && !SameValue(*cashed_value_, value)) {
+        changed_at_ = epoch;
+    }
+    cashed_value_ = std::move(value);
+    computed_at_ = epoch;
+}
+
+void Cell::InitRangeAggregate() const {
+    aggregate_.reset();
+    const auto function = formula_ ? formula_->GetRangeAggregate() : SharedFormula::RangeAggregate::None;
+    if (function == SharedFormula::RangeAggregate::None || !std::holds_alternative<double>(*cashed_value_)) {
+        return;
+    }
+
+    // Проверяем, что в диапазонах только ячейки без формул, и считаем их;
+    // префиксные суммы столбцов дают то же без обхода диапазонов
+    RangeAggregateState state{function};
+    if (!TrySumRanges(state.sum, state.count)) {
+        const DependencyGraph& graph = sheet_.GetGraph();
+        bool tracked = true;
+        for (const Range& range : GetReferencedRanges()) {
+            graph.ForEachNodeInRange(range, [&](DependencyGraph::NodeId node) {
+                const auto input = tracked ? graph.GetCell(node)->GetAggregateInput() : std::nullopt;
+                if (!input) {
+                    tracked = false;
+                } else if (input->is_number) {
+                    state.sum += input->value;
+                    ++state.count;
+                }
+            });
+        }
+        if (!tracked) {
+            return;
+        }
+    }
+
+    if (function == SharedFormula::RangeAggregate::Sum) {
+        state.sum = std::get<double>(*cashed_value_);  // точная сумма, вычисленная формулой
+    }
+    aggregate_ = std::make_unique<RangeAggregateState>(state);
+}
+
+std::optional<Cell::AggregateInput> Cell::GetAggregateInput() const {
+    if (formula_) {
+        return std::nullopt;
+    }
+    if (IsEmpty()) {
+        return AggregateInput{};
+    }
+
+    const FormulaInterface::Value value = ReadCellAsNumber(this);
+    if (!std::holds_alternative<double>(value)) {
+        return std::nullopt;
+    }
+    return AggregateInput{true, std::get<double>(value)};
+}
+
+void Cell::ApplyRangeDelta(const std::optional<AggregateInput>& before, const std::optional<AggregateInput>& after,
+                           std::uint64_t epoch) {
+    if (!aggregate_) {
+        return;
+    }
+
+    // Изменившаяся ячейка новее кэша, поэтому без состояния формула будет
+    // пересчитана при чтении целиком. Пакет записей (Sheet::SetCells) меняет
+    // несколько ячеек в одной эпохе, и приращения от них, уже учтенные в
+    // этой эпохе, не должны делать кэш актуальным
+    auto drop = [this, epoch] {
+        aggregate_.reset();
+        computed_at_ = std::min(computed_at_, epoch - 1);
+        verified_at_ = std::min(verified_at_, epoch - 1);
+    };
+    RangeAggregateState& state = *aggregate_;
+    if (!before || !after || ++state.updates > MAX_RANGE_DELTAS) {
+        drop();
+        return;
     }
 
+    if (before->is_number) {
+        state.sum -= before->value;
+        --state.count;
+    }
+    if (after->is_number) {
+        state.sum += after->value;
+        ++state.count;
+    }
+    if (!std::isfinite(state.sum)) {
+        drop();
+        return;
+    }
+
+    StoreComputed(AggregateValue(state.function, state.sum, state.count), epoch);
+    verified_at_ = epoch;
+}
+
+void Cell::ActualizeBatch(const std::vector<const Cell*>& cells) {
+    if (cells.empty()) {
+        return;
+    }
+
+    const Cell& first = *cells.front();
+    const std::uint64_t epoch = first.sheet_.GetEpoch();
+
+    // вычисляем только ячейки с устаревшим кэшем, остальные просто подтверждаем
+    std::vector<const Cell*> stale;
+    std::vector<Position> shifts;
+    for (const Cell* cell : cells) {
+        assert(cell->formula_ == first.formula_);
+        if (cell->verified_at_ == epoch) {
+            continue;
+        }
+
+        if (!cell->cashed_value_.has_value() || cell->HasChangedChildren()) {
+            stale.push_back(cell);
+            shifts.push_back(cell->formula_shift_);
+        } else {
+            cell->verified_at_ = epoch;
+        }
+    }
+
+    std::vector<FormulaInterface::Value> results(stale.size());
+    first.formula_->EvaluateBatch(first.sheet_, shifts.data(), shifts.size(), results.data());
+    for (std::size_t i = 0; i < stale.size(); ++i) {
+        stale[i]->StoreComputed(ToCellValue(results[i]), epoch);
+        stale[i]->InitRangeAggregate();
+        stale[i]->verified_at_ = epoch;
+    }
+}
+
+bool Cell::HasChangedChildren() const {
+    if (!formula_ || aggregate_) {
+        // значение текстовой ячейки меняется только записью в нее, а
+        // изменения диапазонов SUM/COUNT/AVERAGE уже учтены приращениями
+        return false;
+    }
+
+    // ячейки, на которые ссылается формула, к этому моменту уже актуализированы
+    const DependencyGraph& graph = sheet_.GetGraph();
+    bool changed = false;
+    graph.ForEachPrecedent(node_, [&](DependencyGraph::NodeId node) {
+        changed = changed || graph.GetCell(node)->changed_at_ > computed_at_;
+    });
+
+    return changed;
+}
+
+CellInterface::Value Cell::Compute() const {
     if (IsEmpty()) {
-        cashed_value_ = VALUE_IF_EMPTY_CELL;
         return VALUE_IF_EMPTY_CELL;
     }
 
     if (text_.size() > 0) { // значит ячейка содержит текст
         if (*text_.begin() == ESCAPE_SIGN) {
-            std::string without_escape = std::string(text_.begin() + 1, text_.end());
-            cashed_value_ = without_escape;
-            return without_escape;
+            return std::string(text_.begin() + 1, text_.end());
         }
 
-        std::string as_text = GetText();
-        cashed_value_ = as_text;
-
-        return as_text;
+        return GetText();
     }
 
-    // Evaluate внутри себя перехватит любые исключения,
-    // возникшие в результате вычисления формулы
-    auto result = formula_->Evaluate(sheet_);
-    if (std::holds_alternative<double>(result)) {
-        double as_double = std::get<double>(result);
-        cashed_value_ = as_double;
-        return as_double;
+    double sum = 0;
+    std::uint64_t count = 0;
+    if (TrySumRanges(sum, count)) {
+        return AggregateValue(formula_->GetRangeAggregate(), sum, count);
     }
 
-    auto as_error = std::get<FormulaError>(result);
-    cashed_value_ = as_error;
-    return as_error;
+    // Evaluate возвращает ошибки вычисления формулы как значения
+    return ToCellValue(formula_->Evaluate(sheet_, formula_shift_));
+}
+
+bool Cell::TrySumRanges(double& sum, std::uint64_t& count) const {
+    if (!formula_ || formula_->GetRangeAggregate() == SharedFormula::RangeAggregate::None) {
+        return false;
+    }
+    return sheet_.TrySumRanges(GetReferencedRanges(), sum, count);
 }
 
 std::string Cell::GetText() const {
     if (formula_) {
-        return FORMULA_SIGN + formula_->GetExpression();
+        return FORMULA_SIGN + formula_->GetExpression(formula_shift_);
     }
 
     return text_;
@@ -95,87 +428,162 @@ std::string Cell::GetText() const {
 
 std::vector<Position> Cell::GetReferencedCells() const {
     if (formula_) {
-        return formula_->GetReferencedCells();
+        return formula_->GetReferencedCells(formula_shift_);
     }
 
     return {};
 }
 
-bool Cell::CheckCycles(const std::vector<Position>& referenced_cells) const {
-    auto add_cells = [](const std::vector<Position>& from, std::deque<const CellInterface*>& to, const SheetInterface& sheet) {
-        for (const Position& pos : from) {
-            const CellInterface* cell = sheet.GetCell(pos);
-            if (cell) { // если ячейка, кторая nullptr, не несет циклов по определению
-                to.push_back(cell);
-            }
-        }
-    };
-
-    std::deque<const CellInterface*> cells_to_visit; // дек не nullptr указателей на ячейки
-    std::unordered_set<const CellInterface*> visited{this};
+std::vector<Range> Cell::GetReferencedRanges() const {
+    if (formula_) {
+        return formula_->GetReferencedRanges(formula_shift_);
+    }
 
-    add_cells(referenced_cells, cells_to_visit, sheet_);
+    return {};
+}
 
-    while (cells_to_visit.size() > 0) {
-        // забираем ячейку из очереди к посещению
-        const CellInterface* cell = cells_to_visit.front();
-        cells_to_visit.pop_front();
+bool Cell::CheckCycles(const std::vector<Position>& added_cells, const std::vector<Range>& added_ranges) {
+    DependencyGraph& graph = sheet_.GetGraph();
+    for (const Position& pos : added_cells) {
+        const Cell* child = sheet_.FindCell(pos);
+        if (!child) {
+            // несуществующая ячейка или ячейка в слоте ни от чего не зависит и
+            // станет Cell в начале топологического порядка, циклов она не несет
+            continue;
+        }
 
-        // если 'cell' была уже посещена, имеет место цикл
-        if (visited.count(cell) == 1) {
+        if (graph.CreatesCycle(node_, child->node_)) {
             return true;
         }
-        
-        visited.insert(cell);
+    }
 
-        // помещаем ячейки, от которых зависит ячейка, от которой зависит 'cell' в деку ячеек к посещению
-        add_cells(cell->GetReferencedCells(), cells_to_visit, sheet_);
+    // ссылка на диапазон - это ссылка на каждую его существующую ячейку;
+    // ячейки, которых еще нет, появятся в начале топологического порядка
+    bool cycle = false;
+    for (const Range& range : added_ranges) {
+        graph.ForEachNodeInRange(range, [&](DependencyGraph::NodeId node) {
+            cycle = cycle || graph.CreatesCycle(node_, node);
+        });
+        if (cycle) {
+            return true;
+        }
     }
 
     // цикла нет
     return false;
 }
 
-void Cell::InvalidateCache() {
-    // идти по родителям (зависимые ячейки, обратную сторону) и ресетить кэш
+void Cell::MarkChanged(std::uint64_t epoch) {
+    changed_at_ = epoch;
     cashed_value_.reset();
-
-    for (CellInterface* icell : parents_) {
-        Cell* cell = static_cast<Cell*>(icell);
-        if (!cell->IsCacheInvalidated()) {
-            cell->InvalidateCache();
-        }
-    }
 }
 
 void Cell::AddThisToChildren() {
+    DependencyGraph& graph = sheet_.GetGraph();
     for (const Position& pos : GetReferencedCells()) {
-        Cell* cell = static_cast<Cell*>(sheet_.GetCell(pos));
-        auto& parents = cell->GetParentSet();
-        parents.insert(this);
+        const Cell* cell = sheet_.PromoteCell(pos);
+        graph.AddEdge(node_, cell->node_);
+    }
+    const bool aggregate = formula_ && formula_->GetRangeAggregate() != SharedFormula::RangeAggregate::None;
+    for (const Range& range : GetReferencedRanges()) {
+        sheet_.PromoteRange(range);
+        graph.AddRangeEdge(node_, range);
+        if (aggregate) {
+            sheet_.AddAggregateRange(range);
+        }
     }
 }
 
-std::unordered_set<Cell*>& Cell::GetParentSet() {
-    return parents_;
+DependencyGraph::NodeId Cell::GetNode() const {
+    return node_;
+}
+
+Sheet& Cell::GetSheet() const {
+    return sheet_;
+}
+
+bool Cell::HasDependents() const {
+    return sheet_.GetGraph().HasDependents(node_);
+}
+
+void Cell::SetText(std::string text) {
+    text_ = std::move(text);
+    text_number_ = ParseTextNumber(text_);
+}
+
+std::optional<double> Cell::GetTextAsNumber() const {
+    return text_number_;
+}
+
+std::optional<double> Cell::GetActualNumber() const {
+    if (text_number_) {
+        return text_number_;
+    }
+    if (!formula_) {
+        return text_.empty() ? std::optional<double>(VALUE_IF_EMPTY_CELL) : std::nullopt;
+    }
+    if (verified_at_ != sheet_.GetEpoch() || !cashed_value_ || !std::holds_alternative<double>(*cashed_value_)) {
+        return std::nullopt;
+    }
+    return std::get<double>(*cashed_value_);
 }
 
 bool Cell::IsEmpty() const {
     return text_.size() == 0 && formula_ == nullptr;
 }
 
+const SharedFormula* Cell::GetSharedFormula() const {
+    return formula_.get();
+}
+
 bool Cell::IsFormula() const {
     return formula_ != nullptr;
 }
 
 void Cell::DeleteThisFromChildren() {
-    for (const Position& pos : GetReferencedCells()) {
-        Cell* cell = static_cast<Cell*>(sheet_.GetCell(pos));
-        auto& parents = cell->GetParentSet();
-        parents.erase(this);
+    if (formula_ && formula_->GetRangeAggregate() != SharedFormula::RangeAggregate::None) {
+        for (const Range& range : GetReferencedRanges()) {
+            sheet_.RemoveAggregateRange(range);
+        }
     }
+    sheet_.GetGraph().RemovePrecedents(node_);
 }
 
 bool Cell::IsCacheInvalidated() const {
-    return !cashed_value_.has_value();
-}
\ No newline at end of file
+    // Кэш устарел, если его нет, либо если он не подтвержден в текущей эпохе и
+    // какая-то ячейка в конусе зависимостей изменилась позже, чем был вычислен
+    // кэш зависящей от нее ячейки. Обход итеративный и ничего не пересчитывает
+    const std::uint64_t epoch = sheet_.GetEpoch();
+    const DependencyGraph& graph = sheet_.GetGraph();
+    std::vector<const Cell*> cells_to_visit{this};
+    std::unordered_set<const Cell*> visited{this};
+
+    while (!cells_to_visit.empty()) {
+        const Cell* cell = cells_to_visit.back();
+        cells_to_visit.pop_back();
+
+        if (!cell->cashed_value_.has_value()) {
+            return true;
+        }
+
+        if (cell->verified_at_ == epoch || sheet_.IsRecalculated() || !cell->formula_ || cell->aggregate_) {
+            continue;
+        }
+
+        bool changed = false;
+        graph.ForEachPrecedent(cell->node_, [&](DependencyGraph::NodeId node) {
+            const Cell* child = graph.GetCell(node);
+            if (child->changed_at_ > cell->computed_at_) {
+                changed = true;
+            } else if (visited.insert(child).second) {
+                cells_to_visit.push_back(child);
+            }
+        });
+
+        if (changed) {
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -1,42 +1,155 @@
 #pragma once
 
+#include "cell_slot.h"
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
 #include "sheet.h"
 
+#include <cstdint>
+#include <memory>
 #include <optional>
-#include <unordered_set>
+
+class Sheet;
 
 class Cell : public CellInterface {
 public:
-    Cell(SheetInterface& sheet);
+    // Ячейка регистрируется в графе зависимостей листа; first - поставить ее
+    // в начало топологического порядка, а не в конец (см. DependencyGraph::AddNode).
+    // Относительно pos ищутся разделяемые формулы той же формы (см. FormulaCache)
+    Cell(Sheet& sheet, Position pos, bool first);
     ~Cell();
 
+    // Если бросает FormulaException или CircularDependencyException,
+    // содержимое ячейки и граф зависимостей не меняются
     void Set(std::string text);
     void Clear();
 
+    // Содержимое ячейки: текст или разобранная формула со сдвигом
+    struct Content {
+        std::string text;
+        std::shared_ptr<const SharedFormula> formula;
+        Position shift;
+    };
+    // Разбирает text для ячейки pos так же, как Set, ничего не меняя в листе.
+    // Бросает FormulaException
+    static Content Parse(Sheet& sheet, Position pos, std::string text);
+    // Заменяет содержимое без проверки циклов и возвращает прежнее (см.
+    // Sheet::SetCells). Ячейка должна быть отвязана от графа
+    // (DeleteThisFromChildren) и после замены привязана заново. Кэш
+    // сбрасывается, а эпоха изменения - нет: это делает MarkChanged
+    Content Exchange(Content content);
+
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // диапазоны, на которые ссылается формула, отсортированные и без повторов
+    std::vector<Range> GetReferencedRanges() const;
 
-    std::unordered_set<Cell*>& GetParentSet();
-    
-    bool CheckCycles(const std::vector<Position>& referenced_cells) const;
+    DependencyGraph::NodeId GetNode() const;
+    Sheet& GetSheet() const;
+    // есть ли формулы, которые ссылаются на эту ячейку
+    bool HasDependents() const;
+
+    // Проверяет, что новые ссылки не приносят циклов, и поддерживает
+    // топологический порядок ячеек (см. DependencyGraph::CreatesCycle)
+    bool CheckCycles(const std::vector<Position>& added_cells, const std::vector<Range>& added_ranges);
     
     void AddThisToChildren();
     void DeleteThisFromChildren();
     
-    void InvalidateCache();
+    // Отмечает, что значение ячейки изменилось в эпоху листа epoch.
+    // Зависимые ячейки не обходятся: они увидят изменение при чтении
+    void MarkChanged(std::uint64_t epoch);
     bool IsCacheInvalidated() const;
+
+    // Подтверждает или пересчитывает кэш в текущей эпохе листа, при
+    // необходимости актуализируя ячейки, от которых зависит формула.
+    // Использует постоянную глубину стека при любой длине цепочки ссылок
+    void Actualize() const;
+    // Актуализирует ячейки с одной и той же разделяемой формулой одним
+    // пакетным вычислением (см. SharedFormula::EvaluateBatch). Ячейки, на
+    // которые ссылаются их формулы, должны быть уже актуальны в текущей эпохе
+    static void ActualizeBatch(const std::vector<const Cell*>& cells);
+    // Актуализирует только эту ячейку, когда ячейки, на которые она
+    // ссылается, уже актуальны (см. Sheet::RecalculateChanged). Возвращает,
+    // пришлось ли ее пересчитать
+    bool Refresh() const;
+    // менялось ли значение ячейки после эпохи epoch
+    bool ChangedSince(std::uint64_t epoch) const;
+    // nullptr, если в ячейке нет формулы
+    const SharedFormula* GetSharedFormula() const;
     
     bool IsFormula() const;
-    bool IsEmpty() const;
+    bool IsEmpty() const override;
+    std::optional<double> GetTextAsNumber() const override;
+    // Число, которым ячейку читает ссылка из формулы, если его не нужно
+    // вычислять: пустая ячейка, текст-число или числовое значение формулы,
+    // подтвержденное в текущей эпохе листа. Иначе nullopt
+    std::optional<double> GetActualNumber() const;
+
+    using AggregateInput = CellSlot::AggregateInput;
+    // nullopt, если вклад нельзя учесть приращением: в ячейке формула,
+    // ошибка или текст, который не читается как число
+    std::optional<AggregateInput> GetAggregateInput() const;
+    // Ячейка одного из диапазонов формулы изменилась с before на after в
+    // эпоху epoch; вызывается по разу на каждый диапазон, накрывающий ячейку.
+    // Формула, которая ведет сумму своих диапазонов, обновляет значение за
+    // O(1); остальные увидят изменение при чтении, как обычно
+    void ApplyRangeDelta(const std::optional<AggregateInput>& before, const std::optional<AggregateInput>& after,
+                         std::uint64_t epoch);
 private:
+    // Сумма и число непустых ячеек диапазонов формулы вида SUM(A1:A1000)
+    // (см. SharedFormula::GetRangeAggregate), пока в диапазонах нет ни формул,
+    // ни ошибок. Пока состояние есть, кэш ячейки актуален без обхода
+    // диапазонов: каждая запись в них обновляет его приращением
+    struct RangeAggregateState {
+        SharedFormula::RangeAggregate function;
+        double sum = 0;
+        std::uint64_t count = 0;
+        std::uint32_t updates = 0;  // приращений с последнего точного пересчета
+    };
+
+    // Текст, разобранный как число при записи (см. GetTextAsNumber). Стоит
+    // первым вместе с formula_: ссылки формул читают ячейку по этим полям (см.
+    // GetActualNumber), и им хватает первой кэш-линии объекта
+    std::optional<double> text_number_;
+    std::shared_ptr<const SharedFormula> formula_;  // см. FormulaCache
     std::string text_;
-    std::unique_ptr<FormulaInterface> formula_;
+    Position formula_shift_;
 
-    std::unordered_set<Cell*> parents_;
+    // ссылки в обе стороны хранятся в графе зависимостей листа
+    DependencyGraph::NodeId node_;
 
     mutable std::optional<CellInterface::Value> cashed_value_;
-    SheetInterface& sheet_;
+    mutable std::unique_ptr<RangeAggregateState> aggregate_;
+
+    // Эпохи листа: когда значение ячейки последний раз менялось, когда было
+    // вычислено закэшированное значение и когда кэш последний раз был
+    // подтвержден актуальным. Кэш валиден без проверок, если verified_at_
+    // совпадает с текущей эпохой листа
+    mutable std::uint64_t changed_at_ = 0;
+    mutable std::uint64_t computed_at_ = 0;
+    mutable std::uint64_t verified_at_ = 0;
+    // эпоха, в которой ячейка попала в обход Actualize
+    mutable std::uint64_t collected_at_ = 0;
+
+    Sheet& sheet_;
+
+    // актуализирует ячейку, когда ячейки, на которые она ссылается, уже
+    // актуальны; возвращает, пришлось ли ее пересчитать
+    bool ActualizeSingle(std::uint64_t epoch) const;
+    // Запоминает вычисленное значение. Эпоха изменения формулы сдвигается,
+    // только если значение отличается от прежнего: тогда зависимые от нее
+    // ячейки не пересчитываются (отсечение)
+    void StoreComputed(CellInterface::Value value, std::uint64_t epoch) const;
+    // заводит RangeAggregateState по только что вычисленному значению, если формула это позволяет
+    void InitRangeAggregate() const;
+    bool HasChangedChildren() const;
+    CellInterface::Value Compute() const;
+    // Сумма и число непустых ячеек диапазонов формулы SUM/COUNT/AVERAGE по
+    // префиксным суммам листа (см. Sheet::TrySumRanges)
+    bool TrySumRanges(double& sum, std::uint64_t& count) const;
+    // задает текст ячейки без формулы
+    void SetText(std::string text);
 };
\ No newline at end of file
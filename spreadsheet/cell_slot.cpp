@@ -0,0 +1,167 @@
+#include "cell_slot.h"
+
+#include "cell.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <charconv>
+#include <cstring>
+#include <utility>
+
+namespace {
+// Каноническая запись числа - кратчайшая, из которой оно читается обратно
+std::string_view FormatNumber(double value, char (&buffer)[32]) {
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return std::string_view(buffer, result.ptr - buffer);
+}
+
+template <typename T>
+T Load(const char* data) {
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+template <typename T>
+void Store(char* data, T value) {
+    std::memcpy(data, &value, sizeof(value));
+}
+}  // namespace
+
+void CellDeleter::operator()(Cell* cell) const {
+    Sheet& sheet = cell->GetSheet();
+    cell->~Cell();
+    sheet.FreeCell(cell);
+}
+
+CellSlot::CellSlot(CellPtr cell)
+    : tag_(cell ? Tag::Cell : Tag::Empty)
+{
+    Store(data_, cell.release());
+}
+
+CellSlot::CellSlot(CellSlot&& other) noexcept
+    : size_(other.size_)
+    , tag_(other.tag_)
+{
+    std::memcpy(data_, other.data_, sizeof(data_));
+    other.tag_ = Tag::Empty;
+}
+
+CellSlot& CellSlot::operator=(CellSlot&& other) noexcept {
+    if (this != &other) {
+        Reset();
+        std::memcpy(data_, other.data_, sizeof(data_));
+        size_ = other.size_;
+        tag_ = other.tag_;
+        other.tag_ = Tag::Empty;
+    }
+    return *this;
+}
+
+CellSlot::~CellSlot() {
+    Reset();
+}
+
+void CellSlot::Reset() {
+    if (tag_ == Tag::LongText) {
+        delete Load<std::string*>(data_);
+    } else if (tag_ == Tag::Cell) {
+        CellDeleter()(Load<Cell*>(data_));
+    }
+    tag_ = Tag::Empty;
+}
+
+CellSlot CellSlot::FromText(std::string_view text) {
+    CellSlot slot;
+    if (text.empty() || (text.size() > 1 && text.front() == FORMULA_SIGN)) {
+        return slot;
+    }
+
+    double number = 0;
+    const auto parsed = std::from_chars(text.data(), text.data() + text.size(), number);
+    char buffer[32];
+    if (parsed.ec == std::errc() && parsed.ptr == text.data() + text.size() && FormatNumber(number, buffer) == text) {
+        // текст восстанавливается по числу без потерь
+        Store(slot.data_, number);
+        slot.tag_ = Tag::Number;
+    } else if (text.size() <= SHORT_TEXT_CAPACITY) {
+        std::memcpy(slot.data_, text.data(), text.size());
+        slot.size_ = static_cast<std::uint8_t>(text.size());
+        slot.tag_ = Tag::ShortText;
+    } else {
+        Store(slot.data_, new std::string(text));
+        slot.tag_ = Tag::LongText;
+    }
+    return slot;
+}
+
+Cell* CellSlot::GetCell() const {
+    return tag_ == Tag::Cell ? Load<Cell*>(data_) : nullptr;
+}
+
+CellInterface::Value CellSlot::GetValue() const {
+    if (tag_ == Tag::Cell) {
+        return GetCell()->GetValue();
+    }
+
+    std::string text = GetText();
+    if (!text.empty() && text.front() == ESCAPE_SIGN) {
+        text.erase(0, 1);
+    }
+    return text;
+}
+
+std::string CellSlot::GetText() const {
+    switch (tag_) {
+    case Tag::Number: {
+        char buffer[32];
+        return std::string(FormatNumber(Load<double>(data_), buffer));
+    }
+    case Tag::ShortText:
+        return std::string(data_, size_);
+    case Tag::LongText:
+        return *Load<std::string*>(data_);
+    case Tag::Cell:
+        return GetCell()->GetText();
+    default:
+        return {};
+    }
+}
+
+bool CellSlot::IsEmpty() const {
+    if (tag_ == Tag::Cell) {
+        return GetCell()->IsEmpty();
+    }
+    return tag_ == Tag::Empty;
+}
+
+std::optional<CellSlot::AggregateInput> CellSlot::GetAggregateInput() const {
+    switch (tag_) {
+    case Tag::Empty:
+        return AggregateInput{};
+    case Tag::Number:
+        return AggregateInput{true, Load<double>(data_)};
+    case Tag::Cell:
+        return GetCell()->GetAggregateInput();
+    default:
+        break;
+    }
+
+    const FormulaInterface::Value value = ReadValueAsNumber(GetValue());
+    if (!std::holds_alternative<double>(value)) {
+        return std::nullopt;
+    }
+    return AggregateInput{true, std::get<double>(value)};
+}
+
+std::size_t CellSlot::GetHeapUsage() const {
+    if (tag_ == Tag::LongText) {
+        const std::string& text = *Load<std::string*>(data_);
+        return sizeof(text) + text.capacity() + 1;
+    }
+    if (tag_ == Tag::Cell) {
+        return sizeof(Cell);
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+class Cell;
+
+// Освобождает ячейку в памяти листа, которому она принадлежит (см. Sheet::NewCell)
+struct CellDeleter {
+    void operator()(Cell* cell) const;
+};
+using CellPtr = std::unique_ptr<Cell, CellDeleter>;
+
+// Слот хранилища листа (см. TiledStorage): 16 байт на ячейку.
+// Ячейка без формулы, на которую не ссылается ни одна формула, хранится прямо
+// в слоте: число, короткий текст или указатель на длинный текст. Объект Cell с
+// кэшем значения и узлом графа зависимостей заводится только для формул и
+// ячеек, на которые ссылаются формулы, - тогда слот хранит указатель на него.
+// Лист переводит ячейку из слота в Cell, когда она становится нужна формуле;
+// через CellInterface ячейка в слоте читается без этого (см. Sheet::TryGetCell)
+class CellSlot {
+public:
+    enum class Tag : std::uint8_t {
+        Empty,
+        Number,     // текст ячейки - каноническая запись числа
+        ShortText,  // до SHORT_TEXT_CAPACITY символов прямо в слоте
+        LongText,
+        Cell,
+    };
+    static constexpr std::size_t SHORT_TEXT_CAPACITY = 14;
+
+    CellSlot() = default;
+    explicit CellSlot(CellPtr cell);
+    CellSlot(CellSlot&& other) noexcept;
+    CellSlot& operator=(CellSlot&& other) noexcept;
+    ~CellSlot();
+
+    // Слот для текста ячейки без объекта Cell; пустой слот, если так хранить
+    // текст нельзя: это формула или пустая строка
+    static CellSlot FromText(std::string_view text);
+
+    explicit operator bool() const {
+        return tag_ != Tag::Empty;
+    }
+
+    Tag GetTag() const {
+        return tag_;
+    }
+
+    // nullptr, если ячейка хранится прямо в слоте
+    Cell* GetCell() const;
+
+    // То же, что у CellInterface; для ячейки в слоте значение - ее текст без
+    // экранирующего апострофа
+    CellInterface::Value GetValue() const;
+    std::string GetText() const;
+    bool IsEmpty() const;
+
+    // Как ячейка без формулы входит в SUM/COUNT/AVERAGE от диапазона:
+    // пустая не входит вовсе (is_number = false), остальные - числом
+    struct AggregateInput {
+        bool is_number = false;
+        double value = 0;
+    };
+    // см. Cell::GetAggregateInput
+    std::optional<AggregateInput> GetAggregateInput() const;
+
+    // память вне слота: объект Cell или длинный текст
+    std::size_t GetHeapUsage() const;
+
+private:
+    void Reset();
+
+    // число, указатель на длинный текст или на Cell в первых 8 байтах,
+    // короткий текст - во всех SHORT_TEXT_CAPACITY
+    alignas(8) char data_[SHORT_TEXT_CAPACITY] = {};
+    std::uint8_t size_ = 0;  // длина короткого текста
+    Tag tag_ = Tag::Empty;
+};
+
+static_assert(sizeof(CellSlot) == 16);
@@ -0,0 +1,86 @@
+#include "column_sums.h"
+
+#include "common.h"
+
+#include <cassert>
+
+namespace {
+void Accumulate(ColumnSums::Totals& acc, const ColumnSums::Totals& value, int sign) {
+    acc.sum += sign * value.sum;
+    acc.count += sign * value.count;
+    acc.others += sign * value.others;
+}
+}  // namespace
+
+ColumnSums::Column::Column()
+    : values_(Position::MAX_ROWS)
+    , tree_(Position::MAX_ROWS + 1)
+{
+}
+
+void ColumnSums::Column::Set(int row, const Totals& value) {
+    Totals delta = value;
+    Accumulate(delta, values_[row], -1);
+    values_[row] = value;
+
+    if (++updates_ > Position::MAX_ROWS) {
+        Rebuild();
+        return;
+    }
+
+    for (std::size_t i = row + 1; i < tree_.size(); i += i & (~i + 1)) {
+        Accumulate(tree_[i], delta, 1);
+    }
+}
+
+ColumnSums::Totals ColumnSums::Column::Prefix(int rows) const {
+    Totals result;
+    for (std::size_t i = rows; i > 0; i -= i & (~i + 1)) {
+        Accumulate(result, tree_[i], 1);
+    }
+    return result;
+}
+
+void ColumnSums::Column::Rebuild() {
+    // построение за O(n): каждый узел передает накопленное родителю
+    for (std::size_t i = 1; i < tree_.size(); ++i) {
+        tree_[i] = values_[i - 1];
+    }
+    for (std::size_t i = 1; i < tree_.size(); ++i) {
+        const std::size_t parent = i + (i & (~i + 1));
+        if (parent < tree_.size()) {
+            Accumulate(tree_[parent], tree_[i], 1);
+        }
+    }
+    updates_ = 0;
+}
+
+bool ColumnSums::HasColumn(int col) const {
+    return columns_.count(col) > 0;
+}
+
+void ColumnSums::AddColumn(int col) {
+    columns_.emplace(col, std::make_unique<Column>());
+}
+
+void ColumnSums::RemoveColumn(int col) {
+    columns_.erase(col);
+}
+
+void ColumnSums::Set(int col, int row, const Totals& value) {
+    columns_.at(col)->Set(row, value);
+}
+
+ColumnSums::Totals ColumnSums::Query(int col, int first_row, int last_row) const {
+    assert(first_row <= last_row);
+    const Column& column = *columns_.at(col);
+    Totals result = column.Prefix(last_row + 1);
+    Accumulate(result, column.Prefix(first_row), -1);
+    return result;
+}
+
+std::size_t ColumnSums::GetMemoryUsage() const {
+    // размер столбца не зависит от числа занятых ячеек
+    constexpr std::size_t COLUMN_BYTES = sizeof(Column) + (2 * Position::MAX_ROWS + 1) * sizeof(Totals);
+    return columns_.size() * (COLUMN_BYTES + sizeof(std::pair<const int, std::unique_ptr<Column>>));
+}
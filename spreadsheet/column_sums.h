@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Префиксные суммы по отдельным столбцам листа (дерево Фенвика на столбец).
+// Каждая ячейка столбца вносит в индекс свой вклад: число и единицу в count,
+// если ячейка читается как число, единицу в others, если в ней формула, текст
+// или ошибка, и ничего, если она пуста. Сумма, count и others любого отрезка
+// строк считаются за O(log MAX_ROWS), обновление ячейки - тоже.
+// Исходные вклады хранятся рядом с деревом, и после MAX_ROWS обновлений дерево
+// столбца перестраивается из них заново, чтобы ошибки округления в узлах не
+// накапливались.
+class ColumnSums {
+public:
+    struct Totals {
+        double sum = 0;
+        std::int32_t count = 0;
+        std::int32_t others = 0;
+    };
+
+    bool HasColumn(int col) const;
+    // заводит индекс столбца, в котором все ячейки пусты
+    void AddColumn(int col);
+    void RemoveColumn(int col);
+
+    // Задает вклад ячейки (row, col); столбец должен быть в индексе
+    void Set(int col, int row, const Totals& value);
+    // вклады строк first_row..last_row включительно; столбец должен быть в индексе
+    Totals Query(int col, int first_row, int last_row) const;
+
+    std::size_t GetMemoryUsage() const;
+
+private:
+    class Column {
+    public:
+        Column();
+
+        void Set(int row, const Totals& value);
+        Totals Prefix(int rows) const;  // вклады строк 0..rows-1
+
+    private:
+        void Rebuild();
+
+        std::vector<Totals> values_;
+        std::vector<Totals> tree_;  // 1-индексированное дерево Фенвика
+        std::uint32_t updates_ = 0;
+    };
+
+    std::unordered_map<int, std::unique_ptr<Column>> columns_;
+};
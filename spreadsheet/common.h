@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -39,6 +41,24 @@ struct Position {
 //     std::hash<int> hasher_{};
 // };
 
+// Прямоугольный диапазон ячеек first:last, включая обе угловые ячейки
+struct Range {
+    Position first;  // левый верхний угол
+    Position last;   // правый нижний угол
+
+    bool operator==(const Range& rhs) const;
+    bool operator<(const Range& rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    // "A1:B2"; пустая строка для некорректного диапазона
+    std::string ToString() const;
+
+    // Углы могут быть записаны в любом порядке: "B2:A1" - то же, что "A1:B2".
+    // Для некорректной записи возвращает диапазон, для которого IsValid() ложно
+    static Range FromString(std::string_view str);
+};
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -140,6 +160,18 @@ public:
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ячейка без текста и без формулы. Агрегатные функции формул (SUM, COUNT,
+    // ...) пропускают такие ячейки диапазона, а не считают их нулями
+    virtual bool IsEmpty() const {
+        return GetText().empty();
+    }
+
+    // Число, которым ссылка из формулы читает текст ячейки без формулы, если
+    // ячейка разобрала его заранее. Иначе nullopt, и формула читает GetValue()
+    virtual std::optional<double> GetTextAsNumber() const {
+        return std::nullopt;
+    }
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -164,11 +196,28 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
-    // Возвращает значение ячейки.
+    // Возвращает указатель на ячейку.
     // Если ячейка пуста, может вернуть nullptr.
+    // Указатель принадлежит таблице и действителен, пока ячейку не очистят
+    // (ClearCell) или не удалят таблицу; последующие записи в ячейку через
+    // него видны.
     virtual const CellInterface* GetCell(Position pos) const = 0;
     virtual CellInterface* GetCell(Position pos) = 0;
 
+    // Возвращает указатель на ячейку, как GetCell(), но не бросая исключений.
+    // Для пустой ячейки и для некорректной позиции возвращает nullptr.
+    virtual const CellInterface* TryGetCell(Position pos) const = 0;
+    virtual CellInterface* TryGetCell(Position pos) = 0;
+
+    // Читает в values числа count ячеек столбца подряд, от first вниз, так
+    // же, как их читает ссылка из формулы, но без вычислений и без объектов
+    // CellInterface: для пакетного вычисления формул. Возвращает false, если
+    // хоть одну ячейку так не прочитать (текст, ошибка, неактуальное значение
+    // формулы); тогда values не определены, и ячейки читаются по одной
+    virtual bool ReadColumnNumbers(Position first, std::size_t count, double* values) const {
+        return false;
+    }
+
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
@@ -0,0 +1,466 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <utility>
+
+DependencyGraph::EdgeList::EdgeList(EdgeList&& other) noexcept
+    : size_(other.size_)
+{
+    if (size_ <= INLINE_CAPACITY) {
+        std::copy(other.inline_, other.inline_ + size_, inline_);
+    } else {
+        overflow_ = other.overflow_;
+    }
+    other.size_ = 0;
+}
+
+DependencyGraph::EdgeList& DependencyGraph::EdgeList::operator=(EdgeList&& other) noexcept {
+    if (this != &other) {
+        this->~EdgeList();
+        new (this) EdgeList(std::move(other));
+    }
+    return *this;
+}
+
+DependencyGraph::EdgeList::~EdgeList() {
+    if (size_ > INLINE_CAPACITY) {
+        delete overflow_;
+    }
+}
+
+void DependencyGraph::EdgeList::PushBack(EdgeRef edge) {
+    if (size_ < INLINE_CAPACITY) {
+        inline_[size_++] = edge;
+        return;
+    }
+
+    if (size_ == INLINE_CAPACITY) {
+        // переезд из узла в первый блок
+        auto overflow = new Overflow;
+        overflow->capacity = 2 * INLINE_CAPACITY;
+        overflow->chunks.push_back(std::make_unique<EdgeRef[]>(overflow->capacity));
+        std::copy(inline_, inline_ + size_, overflow->chunks.front().get());
+        overflow_ = overflow;
+    } else if (size_ == overflow_->capacity) {
+        if (overflow_->capacity < CHUNK_SIZE) {
+            auto chunk = std::make_unique<EdgeRef[]>(2 * overflow_->capacity);
+            std::copy(overflow_->chunks.front().get(), overflow_->chunks.front().get() + size_, chunk.get());
+            overflow_->chunks.front() = std::move(chunk);
+            overflow_->capacity *= 2;
+        } else {
+            overflow_->chunks.push_back(std::make_unique<EdgeRef[]>(CHUNK_SIZE));
+            overflow_->capacity += CHUNK_SIZE;
+        }
+    }
+
+    ++size_;
+    (*this)[size_ - 1] = edge;
+}
+
+void DependencyGraph::EdgeList::PopBack() {
+    assert(size_ > 0);
+    if (size_ <= INLINE_CAPACITY) {
+        --size_;
+        return;
+    }
+
+    --size_;
+    if (size_ == INLINE_CAPACITY) {
+        // возвращаемся в узел
+        Overflow* overflow = overflow_;
+        std::copy(overflow->chunks.front().get(), overflow->chunks.front().get() + size_, inline_);
+        delete overflow;
+    } else if (overflow_->chunks.size() > 1 && size_ == overflow_->capacity - CHUNK_SIZE) {
+        overflow_->chunks.pop_back();
+        overflow_->capacity -= CHUNK_SIZE;
+    }
+}
+
+std::size_t DependencyGraph::EdgeList::GetHeapUsage() const {
+    if (size_ <= INLINE_CAPACITY) {
+        return 0;
+    }
+
+    return sizeof(Overflow)
+         + overflow_->chunks.capacity() * sizeof(std::unique_ptr<EdgeRef[]>)
+         + overflow_->capacity * sizeof(EdgeRef);
+}
+
+DependencyGraph::DependencyGraph(NodesInRange nodes_in_range)
+    : nodes_in_range_(std::move(nodes_in_range))
+{
+}
+
+DependencyGraph::NodeId DependencyGraph::AddNode(Cell* cell, Position pos, bool first) {
+    NodeId id;
+    if (!free_nodes_.empty()) {
+        id = free_nodes_.back();
+        free_nodes_.pop_back();
+    } else {
+        id = static_cast<NodeId>(nodes_.size());
+        nodes_.emplace_back();
+    }
+
+    Node& node = nodes_[id];
+    node.cell = cell;
+    node.pos = pos;
+    node.order = first ? --first_order_ : ++last_order_;
+
+    return id;
+}
+
+void DependencyGraph::RemoveNode(NodeId node) {
+    assert(nodes_[node].precedents.Size() == 0 && nodes_[node].dependents.Size() == 0);
+    assert(!nodes_[node].has_ranges);
+    nodes_[node].cell = nullptr;
+    free_nodes_.push_back(node);
+}
+
+Cell* DependencyGraph::GetCell(NodeId node) const {
+    return nodes_[node].cell;
+}
+
+Position DependencyGraph::GetPosition(NodeId node) const {
+    return nodes_[node].pos;
+}
+
+std::int64_t DependencyGraph::GetOrder(NodeId node) const {
+    return nodes_[node].order;
+}
+
+std::size_t DependencyGraph::GetNodeIdBound() const {
+    return nodes_.size();
+}
+
+bool DependencyGraph::CreatesCycle(NodeId dependent, NodeId precedent) {
+    if (dependent == precedent) {
+        return true;
+    }
+
+    const std::int64_t lower_bound = nodes_[dependent].order;
+    const std::int64_t upper_bound = nodes_[precedent].order;
+    if (upper_bound < lower_bound) {
+        // ребро согласовано с порядком
+        return false;
+    }
+
+    // Ищем от dependent по зависимым узлам в области порядка [lower_bound, upper_bound].
+    // Если дошли до precedent, то precedent зависит от dependent - имеет место цикл
+    std::vector<NodeId> forward{dependent};
+    nodes_[dependent].mark = ++mark_;
+    bool cycle = false;
+    for (std::size_t i = 0; i < forward.size() && !cycle; ++i) {
+        ForEachDependent(forward[i], [&](NodeId id) {
+            Node& node = nodes_[id];
+            if (id == precedent) {
+                cycle = true;
+            } else if (node.order < upper_bound && node.mark != mark_) {
+                node.mark = mark_;
+                forward.push_back(id);
+            }
+        });
+    }
+    if (cycle) {
+        return true;
+    }
+
+    // узлы, от которых зависит precedent, в той же области порядка
+    std::vector<NodeId> backward{precedent};
+    nodes_[precedent].mark = ++mark_;
+    for (std::size_t i = 0; i < backward.size(); ++i) {
+        ForEachPrecedent(backward[i], [&](NodeId id) {
+            Node& node = nodes_[id];
+            if (node.order > lower_bound && node.mark != mark_) {
+                node.mark = mark_;
+                backward.push_back(id);
+            }
+        });
+    }
+
+    // backward занимает младшие из освободившихся мест порядка, forward - старшие,
+    // внутри каждой группы относительный порядок сохраняется
+    auto by_order = [this](NodeId lhs, NodeId rhs) {
+        return nodes_[lhs].order < nodes_[rhs].order;
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    std::vector<std::int64_t> orders;
+    orders.reserve(forward.size() + backward.size());
+    for (NodeId node : backward) {
+        orders.push_back(nodes_[node].order);
+    }
+    for (NodeId node : forward) {
+        orders.push_back(nodes_[node].order);
+    }
+    std::sort(orders.begin(), orders.end());
+
+    auto order = orders.begin();
+    for (NodeId node : backward) {
+        nodes_[node].order = *order++;
+    }
+    for (NodeId node : forward) {
+        nodes_[node].order = *order++;
+    }
+
+    return false;
+}
+
+std::vector<DependencyGraph::NodeId> DependencyGraph::SortComponents(const std::vector<NodeId>& roots,
+                                                                    FunctionRef<bool(NodeId)> in_scope,
+                                                                    std::vector<NodeId>& sorted) const {
+    constexpr std::uint32_t UNVISITED = std::numeric_limits<std::uint32_t>::max();
+    std::vector<std::uint32_t> index(nodes_.size(), UNVISITED);
+    std::vector<std::uint32_t> low_link(nodes_.size());
+    std::vector<bool> on_stack(nodes_.size());
+    std::vector<NodeId> stack;
+    std::uint32_t next_index = 0;
+
+    // Обход в глубину по предшественникам без рекурсии: предшественники
+    // раскрытых узлов лежат подряд в successors, кадр помнит свой отрезок
+    struct Frame {
+        NodeId node;
+        std::size_t begin;
+        std::size_t next;
+        std::size_t end;
+        bool self_loop;
+    };
+    std::vector<Frame> frames;
+    std::vector<NodeId> successors;
+
+    auto enter = [&](NodeId node) {
+        index[node] = low_link[node] = next_index++;
+        on_stack[node] = true;
+        stack.push_back(node);
+
+        Frame frame{node, successors.size(), successors.size(), 0, false};
+        ForEachPrecedent(node, [&](NodeId precedent) {
+            frame.self_loop = frame.self_loop || precedent == node;
+            if (in_scope(precedent)) {
+                successors.push_back(precedent);
+            }
+        });
+        frame.end = successors.size();
+        frames.push_back(frame);
+    };
+
+    // Компонента выходит из обхода, когда выведены все компоненты, от которых
+    // она зависит, поэтому порядок выхода и есть топологический
+    std::vector<NodeId> cyclic;
+    sorted.clear();
+    sorted.reserve(roots.size());
+    for (NodeId root : roots) {
+        if (index[root] != UNVISITED) {
+            continue;
+        }
+
+        enter(root);
+        while (!frames.empty()) {
+            Frame& frame = frames.back();
+            if (frame.next < frame.end) {
+                const NodeId next = successors[frame.next++];
+                if (index[next] == UNVISITED) {
+                    enter(next);  // frame больше не действителен
+                } else if (on_stack[next]) {
+                    low_link[frame.node] = std::min(low_link[frame.node], index[next]);
+                }
+                continue;
+            }
+
+            const NodeId node = frame.node;
+            const bool self_loop = frame.self_loop;
+            successors.resize(frame.begin);
+            frames.pop_back();
+            if (!frames.empty()) {
+                low_link[frames.back().node] = std::min(low_link[frames.back().node], low_link[node]);
+            }
+            if (low_link[node] != index[node]) {
+                continue;
+            }
+
+            // узел лежит в стеке под всей своей компонентой
+            const std::size_t component_begin = std::find(stack.rbegin(), stack.rend(), node).base() - 1 - stack.begin();
+            const bool cycle = stack.size() - component_begin > 1 || self_loop;
+            for (std::size_t i = component_begin; i < stack.size(); ++i) {
+                on_stack[stack[i]] = false;
+                sorted.push_back(stack[i]);
+                if (cycle) {
+                    cyclic.push_back(stack[i]);
+                }
+            }
+            stack.resize(component_begin);
+        }
+    }
+
+    return cyclic;
+}
+
+std::vector<DependencyGraph::NodeId> DependencyGraph::RebuildOrder() {
+    std::vector<NodeId> roots;
+    for (NodeId node = 0; node < nodes_.size(); ++node) {
+        if (nodes_[node].cell) {
+            roots.push_back(node);
+        }
+    }
+
+    std::vector<NodeId> sorted;
+    std::vector<NodeId> cyclic = SortComponents(roots, [](NodeId) { return true; }, sorted);
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        nodes_[sorted[i]].order = static_cast<std::int64_t>(i);
+    }
+
+    first_order_ = 0;
+    last_order_ = static_cast<std::int64_t>(sorted.size()) - 1;
+    return cyclic;
+}
+
+std::vector<DependencyGraph::NodeId> DependencyGraph::RestoreOrder(const std::vector<NodeId>& dependents) {
+    // Окно порядка, которое нарушают новые ребра: от самого раннего зависимого
+    // до самого позднего предшественника среди ребер, идущих против порядка.
+    // Ребро, у которого хоть один конец вне окна, старое и согласовано с
+    // порядком; переставляя узлы только внутри окна, его не нарушить. Цикл
+    // проходит хотя бы по одному новому ребру и целиком лежит в окне
+    std::int64_t lower_bound = std::numeric_limits<std::int64_t>::max();
+    std::int64_t upper_bound = std::numeric_limits<std::int64_t>::min();
+    for (NodeId dependent : dependents) {
+        const std::int64_t order = nodes_[dependent].order;
+        ForEachPrecedent(dependent, [&](NodeId precedent) {
+            if (nodes_[precedent].order >= order) {
+                lower_bound = std::min(lower_bound, order);
+                upper_bound = std::max(upper_bound, nodes_[precedent].order);
+            }
+        });
+    }
+    if (lower_bound > upper_bound) {
+        return {};
+    }
+
+    std::vector<NodeId> window;
+    const std::uint32_t mark = ++mark_;
+    for (NodeId node = 0; node < nodes_.size(); ++node) {
+        Node& n = nodes_[node];
+        if (n.cell && n.order >= lower_bound && n.order <= upper_bound) {
+            n.mark = mark;
+            window.push_back(node);
+        }
+    }
+
+    std::vector<NodeId> sorted;
+    std::vector<NodeId> cyclic = SortComponents(window, [this, mark](NodeId node) {
+        return nodes_[node].mark == mark;
+    }, sorted);
+    if (!cyclic.empty()) {
+        return cyclic;
+    }
+
+    // узлы окна занимают прежние места окна в новом порядке
+    std::vector<std::int64_t> orders;
+    orders.reserve(window.size());
+    for (NodeId node : window) {
+        orders.push_back(nodes_[node].order);
+    }
+    std::sort(orders.begin(), orders.end());
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        nodes_[sorted[i]].order = orders[i];
+    }
+
+    return {};
+}
+
+void DependencyGraph::AddEdge(NodeId dependent, NodeId precedent) {
+    EdgeList& precedents = nodes_[dependent].precedents;
+    EdgeList& dependents = nodes_[precedent].dependents;
+    const std::uint32_t precedent_index = precedents.Size();
+    const std::uint32_t dependent_index = dependents.Size();
+
+    precedents.PushBack({precedent, dependent_index});
+    dependents.PushBack({dependent, precedent_index});
+    ++edge_count_;
+}
+
+void DependencyGraph::AddRangeEdge(NodeId dependent, const Range& range) {
+    ranges_[dependent].push_back(range);
+    nodes_[dependent].has_ranges = true;
+    range_index_.Insert(range, dependent);
+}
+
+void DependencyGraph::RemovePrecedents(NodeId dependent) {
+    // удаляем с конца, чтобы в списке dependent ничего не переставлялось
+    while (nodes_[dependent].precedents.Size() > 0) {
+        RemoveEdge(dependent, nodes_[dependent].precedents.Size() - 1);
+    }
+
+    if (nodes_[dependent].has_ranges) {
+        for (const Range& range : ranges_.at(dependent)) {
+            range_index_.Erase(range, dependent);
+        }
+        ranges_.erase(dependent);
+        nodes_[dependent].has_ranges = false;
+    }
+}
+
+void DependencyGraph::RemoveEdge(NodeId dependent, std::uint32_t index) {
+    EdgeList& precedents = nodes_[dependent].precedents;
+    const EdgeRef edge = precedents[index];
+    EdgeList& dependents = nodes_[edge.node].dependents;
+
+    // на место удаляемой записи ставим последнюю и исправляем ссылку на нее из парной
+    const EdgeRef last_dependent = dependents[dependents.Size() - 1];
+    dependents[edge.twin] = last_dependent;
+    nodes_[last_dependent.node].precedents[last_dependent.twin].twin = edge.twin;
+    dependents.PopBack();
+
+    // парная запись удаляемого ребра уже удалена, поэтому последнюю запись
+    // переносим, только если удаляется не она
+    if (index + 1 < precedents.Size()) {
+        const EdgeRef last_precedent = precedents[precedents.Size() - 1];
+        precedents[index] = last_precedent;
+        nodes_[last_precedent.node].dependents[last_precedent.twin].twin = index;
+    }
+    precedents.PopBack();
+
+    --edge_count_;
+}
+
+std::size_t DependencyGraph::GetPrecedentCount(NodeId node) const {
+    return nodes_[node].precedents.Size();
+}
+
+std::size_t DependencyGraph::GetDependentCount(NodeId node) const {
+    return nodes_[node].dependents.Size();
+}
+
+bool DependencyGraph::HasDependents(NodeId node) const {
+    return nodes_[node].dependents.Size() > 0 || HasRangeDependents(nodes_[node].pos);
+}
+
+bool DependencyGraph::HasRangeDependents(Position pos) const {
+    return range_index_.AnyContaining(pos);
+}
+
+void DependencyGraph::ForEachNodeInRange(const Range& range, FunctionRef<void(NodeId)> f) const {
+    nodes_in_range_(range, f);
+}
+
+DependencyGraph::MemoryStats DependencyGraph::GetMemoryStats() const {
+    MemoryStats stats;
+    stats.nodes = nodes_.size() - free_nodes_.size();
+    stats.edges = edge_count_ + range_index_.Size();
+    stats.node_bytes = nodes_.capacity() * sizeof(Node) + free_nodes_.capacity() * sizeof(NodeId);
+    for (const Node& node : nodes_) {
+        stats.edge_bytes += node.precedents.GetHeapUsage() + node.dependents.GetHeapUsage();
+    }
+    // ссылка на диапазон - одна запись в индексе и одна в ranges_
+    stats.edge_bytes += range_index_.GetMemoryUsage();
+    for (const auto& [node, ranges] : ranges_) {
+        stats.edge_bytes += sizeof(node) + sizeof(ranges) + ranges.capacity() * sizeof(Range);
+    }
+
+    if (stats.edges > 0) {
+        stats.bytes_per_edge = static_cast<double>(stats.node_bytes + stats.edge_bytes) / stats.edges;
+    }
+
+    return stats;
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "common.h"
+#include "function_ref.h"
+#include "range_index.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Граф зависимостей между ячейками листа.
+// Ребро dependent -> precedent означает, что формула ячейки dependent ссылается
+// на ячейку precedent. Ребро хранится дважды: в списке предшественников
+// dependent и в списке зависимых precedent, и каждая из двух записей знает
+// индекс парной, поэтому ребро удаляется за O(1) даже у ячейки с сотнями тысяч
+// зависимых. Короткие списки хранятся прямо в узле, длинные - в блоках.
+// Ссылка формулы на диапазон хранится одной записью, а не ребром к каждой
+// ячейке диапазона: ячейки диапазона граф находит через NodesInRange, а
+// формулы, диапазоны которых накрывают ячейку, - в пространственном индексе
+// по позиции ячейки. Память на ссылки растет с числом ссылок, а не с
+// площадью диапазонов.
+// Граф также поддерживает топологический порядок узлов: предшественник всегда
+// стоит раньше зависимой от него ячейки.
+class DependencyGraph {
+public:
+    using NodeId = std::uint32_t;
+    // вызывает f(NodeId) для каждой существующей ячейки диапазона
+    using NodesInRange = std::function<void(const Range& range, FunctionRef<void(NodeId)> f)>;
+
+    struct MemoryStats {
+        std::size_t nodes = 0;
+        std::size_t edges = 0;       // ссылка на диапазон считается одним ребром
+        std::size_t node_bytes = 0;  // узлы вместе со встроенными списками ребер
+        std::size_t edge_bytes = 0;  // блоки ребер, не поместившихся в узел, и диапазоны
+        double bytes_per_edge = 0;   // вся память графа в расчете на одно ребро
+    };
+
+    explicit DependencyGraph(NodesInRange nodes_in_range);
+
+    // Новый узел не связан ни с чем, поэтому его можно поставить как в начало
+    // топологического порядка (first = true), так и в конец. Узел, который
+    // попадает в чей-то диапазон, должен стоять в начале
+    NodeId AddNode(Cell* cell, Position pos, bool first);
+    // Узел не должен иметь ребер
+    void RemoveNode(NodeId node);
+
+    Cell* GetCell(NodeId node) const;
+    Position GetPosition(NodeId node) const;
+    // место узла в топологическом порядке: у предшественника оно меньше
+    std::int64_t GetOrder(NodeId node) const;
+    // все NodeId меньше этого числа; удобно для массивов, индексируемых узлами
+    std::size_t GetNodeIdBound() const;
+
+    // Проверяет, создаст ли ребро dependent -> precedent цикл (алгоритм
+    // Пирса-Келли). Если нет, переупорядочивает узлы так, чтобы ребро не
+    // нарушало топологический порядок; само ребро не добавляется. Ребро,
+    // согласованное с порядком, проверяется за O(1), иначе обходится только
+    // область порядка между двумя узлами
+    bool CreatesCycle(NodeId dependent, NodeId precedent);
+
+    // Заново строит топологический порядок всех узлов за один проход по
+    // графу (поиск компонент сильной связности алгоритмом Тарьяна): для
+    // ребер, добавленных без CreatesCycle, например при загрузке листа.
+    // Возвращает узлы, лежащие на циклах; если они есть, порядок с ребрами
+    // не согласован
+    std::vector<NodeId> RebuildOrder();
+    // То же после добавления без CreatesCycle ссылок узлов dependents (см.
+    // Sheet::SetCells), но заново упорядочиваются только узлы между самым
+    // ранним из dependents, чья ссылка идет против порядка, и самым поздним
+    // из узлов, на которые такие ссылки ведут; остальные не двигаются.
+    // Возвращает узлы, лежащие на циклах; если они есть, порядок не меняется
+    std::vector<NodeId> RestoreOrder(const std::vector<NodeId>& dependents);
+
+    void AddEdge(NodeId dependent, NodeId precedent);
+    // Ссылка dependent на диапазон. Как и для AddEdge, циклы проверяются
+    // заранее: CreatesCycle(dependent, node) для каждого узла диапазона
+    void AddRangeEdge(NodeId dependent, const Range& range);
+    // удаляет все ссылки dependent, и на ячейки, и на диапазоны
+    void RemovePrecedents(NodeId dependent);
+
+    // без учета диапазонов
+    std::size_t GetPrecedentCount(NodeId node) const;
+    std::size_t GetDependentCount(NodeId node) const;
+    // ссылается ли на node хоть одна формула, в том числе через диапазон
+    bool HasDependents(NodeId node) const;
+    // накрывает ли pos диапазон хоть одной формулы
+    bool HasRangeDependents(Position pos) const;
+
+    // f(NodeId) для каждого узла, на который ссылается node, в том числе для
+    // каждой существующей ячейки его диапазонов. Узел, на который node
+    // ссылается несколько раз, передается столько же раз, сколько node
+    // встречается для него в ForEachDependent
+    template <typename F>
+    void ForEachPrecedent(NodeId node, F&& f) const {
+        const Node& n = nodes_[node];
+        for (std::uint32_t i = 0; i < n.precedents.Size(); ++i) {
+            f(n.precedents[i].node);
+        }
+
+        if (n.has_ranges) {
+            for (const Range& range : ranges_.at(node)) {
+                nodes_in_range_(range, f);
+            }
+        }
+    }
+
+    // f(NodeId) для каждого узла, который ссылается на node, в том числе через диапазон
+    template <typename F>
+    void ForEachDependent(NodeId node, F&& f) const {
+        const Node& n = nodes_[node];
+        for (std::uint32_t i = 0; i < n.dependents.Size(); ++i) {
+            f(n.dependents[i].node);
+        }
+
+        ForEachRangeDependent(n.pos, f);
+    }
+
+    // f(NodeId) для каждой формулы, диапазон которой накрывает pos
+    template <typename F>
+    void ForEachRangeDependent(Position pos, F&& f) const {
+        range_index_.ForEachContaining(pos, f);
+    }
+
+    void ForEachNodeInRange(const Range& range, FunctionRef<void(NodeId)> f) const;
+
+    MemoryStats GetMemoryStats() const;
+
+private:
+    struct EdgeRef {
+        NodeId node;
+        std::uint32_t twin;  // индекс парной записи в списке узла node
+    };
+
+    // Список ребер: до INLINE_CAPACITY записей хранятся в самом списке,
+    // больше - в блоках; первый блок растет удвоением до CHUNK_SIZE записей,
+    // дальше добавляются блоки по CHUNK_SIZE, без перекладывания старых
+    class EdgeList {
+    public:
+        static constexpr std::uint32_t INLINE_CAPACITY = 2;
+        static constexpr std::uint32_t CHUNK_SIZE = 256;
+
+        EdgeList() = default;
+        EdgeList(EdgeList&& other) noexcept;
+        EdgeList& operator=(EdgeList&& other) noexcept;
+        ~EdgeList();
+
+        std::uint32_t Size() const {
+            return size_;
+        }
+
+        const EdgeRef& operator[](std::uint32_t index) const {
+            if (size_ <= INLINE_CAPACITY) {
+                return inline_[index];
+            }
+            return overflow_->chunks[index / CHUNK_SIZE][index % CHUNK_SIZE];
+        }
+
+        EdgeRef& operator[](std::uint32_t index) {
+            return const_cast<EdgeRef&>(static_cast<const EdgeList&>(*this)[index]);
+        }
+
+        void PushBack(EdgeRef edge);
+        void PopBack();
+
+        // память вне самого списка
+        std::size_t GetHeapUsage() const;
+
+    private:
+        struct Overflow {
+            std::vector<std::unique_ptr<EdgeRef[]>> chunks;
+            std::uint32_t capacity = 0;
+        };
+
+        std::uint32_t size_ = 0;
+        union {
+            EdgeRef inline_[INLINE_CAPACITY];
+            Overflow* overflow_;  // при size_ > INLINE_CAPACITY
+        };
+    };
+
+    struct Node {
+        Cell* cell = nullptr;
+        Position pos;
+        std::int64_t order = 0;
+        std::uint32_t mark = 0;  // отметка обхода в CreatesCycle и окна в RestoreOrder
+        bool has_ranges = false;  // есть ли у узла запись в ranges_
+        EdgeList precedents;
+        EdgeList dependents;
+    };
+
+    // Обход Тарьяна, начиная с roots, по ребрам к предшественникам, которые
+    // отбирает in_scope. Пишет пройденные узлы в sorted в топологическом
+    // порядке и возвращает те из них, что лежат на циклах
+    std::vector<NodeId> SortComponents(const std::vector<NodeId>& roots, FunctionRef<bool(NodeId)> in_scope,
+                                       std::vector<NodeId>& sorted) const;
+    // удаляет ребро, записанное в списке предшественников dependent под индексом index
+    void RemoveEdge(NodeId dependent, std::uint32_t index);
+
+    std::vector<Node> nodes_;
+    std::vector<NodeId> free_nodes_;
+    std::size_t edge_count_ = 0;
+
+    NodesInRange nodes_in_range_;
+    // диапазоны каждой формулы, которая на них ссылается
+    std::unordered_map<NodeId, std::vector<Range>> ranges_;
+    // все ссылки на диапазоны, с формулой dependent в качестве Id
+    RangeIndex range_index_;
+
+    std::int64_t first_order_ = 0;
+    std::int64_t last_order_ = 0;
+    std::uint32_t mark_ = 0;
+};
@@ -14,68 +14,167 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
 }
 
 namespace {
-class Formula : public FormulaInterface {
+// Формула неизменяема: дерево и список ячеек строятся один раз при разборе,
+// поэтому один объект могут разделять несколько ячеек
+class Formula : public FormulaInterface, public SharedFormula {
 public:
+    using Value = FormulaInterface::Value;
+
     explicit Formula(std::string expression);
 
     Value Evaluate(const SheetInterface& sheet) const override;
-
     std::string GetExpression() const override;
-
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const override;
+
+    Value Evaluate(const SheetInterface& sheet, Position shift) const override;
+    void EvaluateBatch(const SheetInterface& sheet, const Position* shifts, std::size_t count,
+                       Value* results) const override;
+    std::string GetExpression(Position shift) const override;
+    std::vector<Position> GetReferencedCells(Position shift) const override;
+    std::vector<Range> GetReferencedRanges(Position shift) const override;
+    RangeAggregate GetRangeAggregate() const override;
+    std::string GetShape(Position anchor) const override;
+    std::size_t GetMemoryUsage() const override;
 private:
     FormulaAST ast_;
+    std::vector<Position> referenced_cells_;  // без сдвига
+    std::vector<Range> referenced_ranges_;    // без сдвига
+    RangeAggregate range_aggregate_ = RangeAggregate::None;
 };
 
 Formula::Formula(std::string expression)
     : ast_(ParseFormulaAST(expression))
 {
+    referenced_cells_ = ast_.GetCells();  // уже отсортированы
+    auto last_unique = std::unique(referenced_cells_.begin(), referenced_cells_.end());
+    referenced_cells_.erase(last_unique, referenced_cells_.end());
+    referenced_cells_.shrink_to_fit();
+
+    referenced_ranges_ = ast_.GetRanges();  // тоже отсортированы
+    referenced_ranges_.erase(std::unique(referenced_ranges_.begin(), referenced_ranges_.end()),
+                             referenced_ranges_.end());
+    referenced_ranges_.shrink_to_fit();
+
+    // повторяющийся диапазон учитывается функцией дважды, а в графе хранится
+    // один раз, поэтому приращения для таких формул не считаем
+    const ASTImpl::Node* aggregate = ast_.GetRangeOnlyAggregate();
+    if (aggregate && aggregate->ranges.count == referenced_ranges_.size()) {
+        switch (aggregate->function) {
+            case ASTImpl::Function::Sum:
+                range_aggregate_ = RangeAggregate::Sum;
+                break;
+            case ASTImpl::Function::Count:
+                range_aggregate_ = RangeAggregate::Count;
+                break;
+            case ASTImpl::Function::Average:
+                range_aggregate_ = RangeAggregate::Average;
+                break;
+            default:
+                break;
+        }
+    }
 }
 
 FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const {
-    try {
-        auto cell_getter = [&sheet](const Position* pos) { // может вернуть nullptr
-            try {
-                return sheet.GetCell(*pos);
-            } catch (const InvalidPositionException& ex) {
-                // если брошено исключение, то это из-за того, что
-                // IsValid() сказал, что ячейка некорректная,
-                // в этом месте некорректоной она может быть по причине
-                // выхода за пределы листа
-                auto category = FormulaError::Category::Ref;
-                throw FormulaError(category);
-            }
-        };
-        return ast_.Execute(cell_getter);
-    } catch (const FormulaError& err) {
-        return err;
-    }
+    return Evaluate(sheet, Position{0, 0});
 }
 
 std::string Formula::GetExpression() const {
+    return GetExpression(Position{0, 0});
+}
+
+std::vector<Position> Formula::GetReferencedCells() const {
+    return referenced_cells_;
+}
+
+std::vector<Range> Formula::GetReferencedRanges() const {
+    return referenced_ranges_;
+}
+
+FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet, Position shift) const {
+    // ошибки вычисления (в том числе #REF! для ссылок за пределы листа)
+    // возвращаются как значения, без исключений
+    auto cell_getter = [&sheet](const Position* pos) { // может вернуть nullptr
+        return sheet.TryGetCell(*pos);
+    };
+
+    return ast_.Execute(cell_getter, shift);
+}
+
+void Formula::EvaluateBatch(const SheetInterface& sheet, const Position* shifts, std::size_t count,
+                            Value* results) const {
+    auto cell_getter = [&sheet](const Position* pos) {
+        return sheet.TryGetCell(*pos);
+    };
+    auto column_reader = [&sheet](Position first, std::size_t count, double* values) {
+        return sheet.ReadColumnNumbers(first, count, values);
+    };
+
+    ast_.ExecuteBatch(cell_getter, column_reader, shifts, count, results);
+}
+
+std::string Formula::GetExpression(Position shift) const {
     std::ostringstream out;
-    ast_.PrintFormula(out);
+    ast_.PrintFormula(out, shift);
 
     return out.str();
 }
 
-std::vector<Position> Formula::GetReferencedCells() const {
-    const std::forward_list<Position>& referenced_cells = ast_.GetCells();
+std::vector<Position> Formula::GetReferencedCells(Position shift) const {
+    // сдвиг не меняет порядок ячеек
+    std::vector<Position> cells = referenced_cells_;
+    for (Position& pos : cells) {
+        pos.row += shift.row;
+        pos.col += shift.col;
+    }
 
-    std::vector<Position> cells;
-    for (const auto pos : referenced_cells) {
-        cells.push_back(std::move(pos));
+    return cells;
+}
+
+std::vector<Range> Formula::GetReferencedRanges(Position shift) const {
+    std::vector<Range> ranges = referenced_ranges_;
+    for (Range& range : ranges) {
+        for (Position* corner : {&range.first, &range.last}) {
+            corner->row += shift.row;
+            corner->col += shift.col;
+        }
     }
 
-    std::sort(cells.begin(), cells.end());
-    auto last_unique = std::unique(cells.begin(), cells.end());
-    cells.erase(last_unique, cells.end());
+    return ranges;
+}
 
-    return cells;
+SharedFormula::RangeAggregate Formula::GetRangeAggregate() const {
+    return range_aggregate_;
+}
+
+std::string Formula::GetShape(Position anchor) const {
+    std::ostringstream out;
+    ast_.PrintShape(out, anchor);
+
+    return out.str();
+}
+
+std::size_t Formula::GetMemoryUsage() const {
+    return sizeof(*this) - sizeof(ast_) + ast_.GetMemoryUsage()
+         + referenced_cells_.capacity() * sizeof(Position)
+         + referenced_ranges_.capacity() * sizeof(Range);
 }
 
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+std::shared_ptr<const SharedFormula> ParseSharedFormula(std::string expression) {
+    return std::make_shared<const Formula>(std::move(expression));
+}
+
+FormulaInterface::Value ReadCellAsNumber(const CellInterface* cell) {
+    return FormulaAST::ReadCell(cell);
+}
+
+FormulaInterface::Value ReadValueAsNumber(const CellInterface::Value& value) {
+    return FormulaAST::ReadValue(value);
 }
\ No newline at end of file
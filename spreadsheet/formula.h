@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include <cstddef>
 #include <memory>
 #include <vector>
 
@@ -9,9 +10,13 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции SUM, AVERAGE, MIN, MAX и COUNT от чисел, выражений и диапазонов:
+//   SUM(A1:A100), MAX(A1:C3,D1*2,0)
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
-// ячейка или ячейка с пустым текстом трактуется как число ноль.
+// ячейка или ячейка с пустым текстом трактуется как число ноль. Исключение -
+// диапазоны: пустые ячейки диапазона функции пропускают (COUNT их не считает,
+// AVERAGE не делит на них), остальные трактуются как ссылка на ячейку.
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -32,8 +37,60 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны аргументов функций, отсортированные и без повторов.
+    // Ячейки диапазонов не входят в GetReferencedCells: диапазон A1:A10000
+    // хранится одной записью, а не десятью тысячами ссылок.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+};
+
+// Разобранная формула, которую могут разделять несколько ячеек листа.
+// Ячейка использует ее со сдвигом shift: все ссылки формулы сдвигаются на
+// shift. Так формулы, скопированные вдоль столбца (C2=A2*B2, C3=A3*B3, ...),
+// хранят одно дерево и отличаются только сдвигом. Со сдвигом {0, 0} ссылки
+// остаются такими, как были записаны при разборе.
+class SharedFormula {
+public:
+    using Value = FormulaInterface::Value;
+
+    virtual ~SharedFormula() = default;
+
+    virtual Value Evaluate(const SheetInterface& sheet, Position shift) const = 0;
+    // Вычисляет формулу сразу для count сдвигов: results[i] совпадает с
+    // Evaluate(sheet, shifts[i]), но каждая операция выполняется над всеми
+    // сдвигами подряд, в том числе векторными инструкциями
+    virtual void EvaluateBatch(const SheetInterface& sheet, const Position* shifts, std::size_t count,
+                               Value* results) const = 0;
+    virtual std::string GetExpression(Position shift) const = 0;
+    virtual std::vector<Position> GetReferencedCells(Position shift) const = 0;
+    virtual std::vector<Range> GetReferencedRanges(Position shift) const = 0;
+
+    // Формула целиком - SUM, COUNT или AVERAGE от диапазонов без повторов,
+    // например SUM(A1:A1000). Ее значение определяется суммой и числом
+    // непустых ячеек диапазонов, поэтому его можно обновлять приращениями
+    enum class RangeAggregate {
+        None,
+        Sum,
+        Count,
+        Average,
+    };
+    virtual RangeAggregate GetRangeAggregate() const = 0;
+
+    // Форма формулы для ячейки anchor: выражение, в котором ссылки записаны
+    // смещениями от anchor. Формулы одной формы отличаются только сдвигом
+    virtual std::string GetShape(Position anchor) const = 0;
+
+    // Оценка памяти, занятой разобранной формулой
+    virtual std::size_t GetMemoryUsage() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+std::shared_ptr<const SharedFormula> ParseSharedFormula(std::string expression);
+
+// Читает ячейку так же, как ссылка на нее в формуле: пустая - ноль, текст
+// должен целиком быть числом, ошибка остается ошибкой
+FormulaInterface::Value ReadCellAsNumber(const CellInterface* cell);
+// то же для уже прочитанного значения ячейки
+FormulaInterface::Value ReadValueAsNumber(const CellInterface::Value& value);
\ No newline at end of file
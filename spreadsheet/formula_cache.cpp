@@ -0,0 +1,137 @@
+#include "formula_cache.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+bool IsUpper(char c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+}  // namespace
+
+FormulaCache::Handle FormulaCache::Get(const std::string& expression, Position pos) {
+    ++lookups_;
+
+    if (auto it = by_text_.find(expression); it != by_text_.end()) {
+        if (auto formula = it->second.lock()) {
+            ++hits_;
+            return {std::move(formula), Position{0, 0}};
+        }
+    }
+
+    // ParseSharedFormula бросит FormulaException при синтаксически некорректной формуле
+    auto formula = ParseSharedFormula(expression);
+
+    ShapeEntry& shared = by_shape_[formula->GetShape(pos)];
+    if (auto existing = shared.formula.lock()) {
+        // та же форма: новый объект не нужен, ссылки получаются сдвигом
+        ++hits_;
+        return {std::move(existing), Position{pos.row - shared.anchor.row, pos.col - shared.anchor.col}};
+    }
+
+    Entry& same_expression = by_expression_[formula->GetExpression(Position{0, 0})];
+    if (auto existing = same_expression.lock()) {
+        // та же формула другим текстом; ее ссылки совпадают с только что
+        // разобранными, поэтому ее можно найти и по форме для pos
+        ++hits_;
+        shared = {existing, pos};
+        by_text_[expression] = existing;
+        return {std::move(existing), Position{0, 0}};
+    }
+
+    shared = {formula, pos};
+    same_expression = formula;
+    by_text_[expression] = formula;
+
+    if (by_text_.size() + by_shape_.size() + by_expression_.size() >= prune_threshold_) {
+        Prune();
+    }
+
+    return {std::move(formula), Position{0, 0}};
+}
+
+void FormulaCache::Prune() {
+    for (auto it = by_text_.begin(); it != by_text_.end();) {
+        it = it->second.expired() ? by_text_.erase(it) : std::next(it);
+    }
+    for (auto it = by_shape_.begin(); it != by_shape_.end();) {
+        it = it->second.formula.expired() ? by_shape_.erase(it) : std::next(it);
+    }
+    for (auto it = by_expression_.begin(); it != by_expression_.end();) {
+        it = it->second.expired() ? by_expression_.erase(it) : std::next(it);
+    }
+
+    // порог растет вместе с числом живых записей, чтобы очистка стоила O(1) в среднем на запрос
+    prune_threshold_ = std::max(prune_threshold_, 2 * (by_text_.size() + by_shape_.size() + by_expression_.size()));
+}
+
+std::optional<std::string> FormulaCache::GetTextShape(std::string_view expression, Position pos) {
+    std::string shape;
+    shape.reserve(expression.size() + 16);
+
+    for (std::size_t i = 0; i < expression.size();) {
+        // ссылка - [A-Z]+[0-9]+, не приклеенная ни к числу (1E5), ни к
+        // другому слову: такой кусок лексер читает как ячейку при любых буквах
+        // и цифрах, если все вокруг него одинаково
+        const bool glued = i > 0 && (IsUpper(expression[i - 1]) || IsDigit(expression[i - 1]) || expression[i - 1] == '.');
+        if (!IsUpper(expression[i]) || glued) {
+            shape += expression[i++];
+            continue;
+        }
+
+        std::size_t end = i;
+        while (end < expression.size() && IsUpper(expression[end])) {
+            ++end;
+        }
+        const std::size_t letters_end = end;
+        while (end < expression.size() && IsDigit(expression[end])) {
+            ++end;
+        }
+        if (end == letters_end || (end < expression.size() && (IsUpper(expression[end]) || expression[end] == '.'))) {
+            shape.append(expression.substr(i, end - i));
+            i = end;
+            continue;
+        }
+
+        const Position ref = Position::FromString(expression.substr(i, end - i));
+        if (!ref.IsValid()) {
+            return std::nullopt;
+        }
+        // скобок [] в формулах не бывает, поэтому сдвиг не спутать с текстом
+        shape += '[';
+        shape += std::to_string(ref.row - pos.row);
+        shape += ',';
+        shape += std::to_string(ref.col - pos.col);
+        shape += ']';
+        i = end;
+    }
+
+    return shape;
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+    Stats stats;
+    stats.lookups = lookups_;
+    stats.hits = hits_;
+    if (lookups_ > 0) {
+        stats.hit_rate = static_cast<double>(hits_) / lookups_;
+    }
+
+    // каждая созданная формула записана в by_expression_ ровно один раз
+    for (const auto& [expression, entry] : by_expression_) {
+        if (auto formula = entry.lock()) {
+            ++stats.formulas;
+            // use_count учитывает и только что полученную копию formula
+            const auto users = static_cast<std::size_t>(formula.use_count() - 1);
+            if (users > 1) {
+                stats.bytes_saved += (users - 1) * formula->GetMemoryUsage();
+            }
+        }
+    }
+
+    return stats;
+}
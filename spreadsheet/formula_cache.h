@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Кэш разобранных формул листа.
+// Ячейка получает разделяемую неизменяемую формулу вместе с ее деревом
+// и списком ячеек и сдвиг, с которым ее использует (см. SharedFormula).
+// Формулы разделяются в двух случаях:
+// * одна и та же формула ("=A1*B1", вставленная много раз, или "= (A1) * B1")
+//   - со сдвигом {0, 0};
+// * формулы одной формы ("=A2*B2" в C2, "=A3*B3" в C3, ...) - со сдвигом
+//   от ячейки, для которой формула была разобрана.
+// Кэш не владеет формулами: объект живет, пока его использует хотя бы одна ячейка.
+class FormulaCache {
+public:
+    struct Handle {
+        std::shared_ptr<const SharedFormula> formula;
+        Position shift;
+    };
+
+    struct Stats {
+        std::size_t lookups = 0;
+        std::size_t hits = 0;         // сколько раз формула нашлась без создания нового объекта
+        double hit_rate = 0;
+        std::size_t formulas = 0;     // живые разделяемые формулы
+        std::size_t bytes_saved = 0;  // память, которую заняли бы копии разделяемых формул
+    };
+
+    // Возвращает формулу для выражения без знака '=', записанного в ячейку pos.
+    // Бросает FormulaException, если формула синтаксически некорректна
+    Handle Get(const std::string& expression, Position pos);
+
+    Stats GetStats() const;
+
+    // Форма формулы по тексту, без разбора: ссылки на ячейки заменены
+    // сдвигами от pos. Если у двух формул, записанных в разные ячейки, эта
+    // форма совпадает, их тексты отличаются только ссылками, сдвинутыми
+    // вместе с ячейкой, и разобранная формула у них общая. nullopt, если
+    // в тексте есть ссылка за пределы листа
+    static std::optional<std::string> GetTextShape(std::string_view expression, Position pos);
+
+private:
+    using Entry = std::weak_ptr<const SharedFormula>;
+
+    struct ShapeEntry {
+        Entry formula;
+        Position anchor;  // ячейка, для которой формула была разобрана
+    };
+
+    // удаляет записи формул, которые больше никто не использует
+    void Prune();
+
+    // исходный текст -> формула со сдвигом {0, 0}; повторный текст не разбирается вовсе
+    std::unordered_map<std::string, Entry> by_text_;
+    // форма формулы (GetShape) -> формула. Константы в форме и в выражении
+    // печатаются без потерь, поэтому ключи совпадают только у формул с
+    // одинаковыми деревьями
+    std::unordered_map<std::string, ShapeEntry> by_shape_;
+    // каноническое выражение (GetExpression) -> формула со сдвигом {0, 0}
+    std::unordered_map<std::string, Entry> by_expression_;
+    std::size_t prune_threshold_ = 1024;
+
+    std::size_t lookups_ = 0;
+    std::size_t hits_ = 0;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// Невладеющая ссылка на вызываемый объект.
+// В отличие от std::function ничего не копирует и не выделяет память,
+// поэтому ее дешево передавать по значению. Вызываемый объект должен
+// жить дольше ссылки на него.
+template <typename Signature>
+class FunctionRef;
+
+template <typename Result, typename... Args>
+class FunctionRef<Result(Args...)> {
+public:
+    template <typename Callable,
+              typename = std::enable_if_t<!std::is_same_v<std::decay_t<Callable>, FunctionRef>>>
+    FunctionRef(Callable&& callable) noexcept
+        : object_(const_cast<void*>(static_cast<const void*>(std::addressof(callable))))
+        , invoker_([](void* object, Args... args) -> Result {
+            return (*static_cast<std::add_pointer_t<Callable>>(object))(std::forward<Args>(args)...);
+        })
+    {
+    }
+
+    Result operator()(Args... args) const {
+        return invoker_(object_, std::forward<Args>(args)...);
+    }
+
+private:
+    void* object_;
+    Result (*invoker_)(void*, Args...);
+};
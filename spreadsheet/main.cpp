@@ -1,8 +1,22 @@
+#include "FormulaAST.h"
+#include "allocation_counter.h"
 #include "common.h"
 #include "formula.h"
+#include "range_index.h"
 #include "test_runner_p.h"
+#include "vector_kernels.h"
+#include "work_stealing_pool.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <limits>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <utility>
 
 #include "cell.h"
 
@@ -16,6 +30,10 @@ inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
 
+inline std::ostream& operator<<(std::ostream& output, const Range& range) {
+    return output << range.ToString();
+}
+
 inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
@@ -111,6 +129,21 @@ void TestInvalidPosition() {
     }
 }
 
+void TestTryGetCell() {
+    auto sheet = CreateSheet();
+    const SheetInterface& const_sheet = *sheet;
+
+    ASSERT(sheet->TryGetCell(Position{-1, 0}) == nullptr);
+    ASSERT(sheet->TryGetCell(Position{0, Position::MAX_COLS}) == nullptr);
+    ASSERT(const_sheet.TryGetCell(Position::NONE) == nullptr);
+    ASSERT(sheet->TryGetCell("A1"_pos) == nullptr);
+
+    sheet->SetCell("B2"_pos, "text");
+    ASSERT(sheet->TryGetCell("A1"_pos) == nullptr);
+    ASSERT(sheet->TryGetCell("B2"_pos) == sheet->GetCell("B2"_pos));
+    ASSERT_EQUAL(const_sheet.TryGetCell("B2"_pos)->GetText(), "text");
+}
+
 void TestSetCellPlainText() {
     auto sheet = CreateSheet();
 
@@ -162,6 +195,24 @@ void TestFormulaArithmetic() {
     ASSERT_EQUAL(evaluate("(12+13) * (14+(13-24/(1+1))*55-46)"), 575);
 }
 
+void TestFormulaDeepExpression() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+
+    // правоассоциативная запись требует глубокого стека вычислений
+    std::string expr = "A1";
+    for (int i = 0; i < 100; ++i) {
+        expr = "1-(" + expr + ")";
+    }
+    ASSERT_EQUAL(std::get<double>(ParseFormula(expr)->Evaluate(*sheet)), 2.0);
+
+    expr = "A1";
+    for (int i = 0; i < 100; ++i) {
+        expr = "-(1+" + expr + ")";
+    }
+    ASSERT_EQUAL(std::get<double>(ParseFormula(expr)->Evaluate(*sheet)), 2.0);
+}
+
 void TestFormulaReferences() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -192,6 +243,8 @@ void TestFormulaExpressionFormatting() {
     ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
     ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
     ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+    ASSERT_EQUAL(reformat("1e10+0.25"), "1e+10+0.25");
+    ASSERT_EQUAL(reformat("1.0000001*3.14159265358979"), "1.0000001*3.14159265358979");
 }
 
 void TestFormulaReferencedCells() {
@@ -220,6 +273,24 @@ void TestErrorValue() {
                  CellInterface::Value(FormulaError::Category::Value));
 }
 
+void TestTextToNumberConversion() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "=A1*2");
+
+    auto check = [&](std::string text, CellInterface::Value expected) {
+        sheet->SetCell("A1"_pos, std::move(text));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), expected);
+    };
+
+    check("21", 42.0);
+    check("  21", 42.0);
+    check("2.5e1", 50.0);
+    check("21 ", FormulaError::Category::Value);
+    check("1e999", FormulaError::Category::Value);
+    check("'21", 42.0);
+    check("=1/0", FormulaError::Category::Div0);
+}
+
 void TestErrorDiv0() {
     auto sheet = CreateSheet();
 
@@ -304,6 +375,41 @@ void TestPrint() {
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintSparse() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "a");
+    sheet->SetCell("C1"_pos, "c");
+    sheet->SetCell("B3"_pos, "=1+1");
+
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 3}));
+
+    std::ostringstream texts;
+    sheet->PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "a\t\tc\n\t\t\n\t=1+1\t\n");
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "a\t\tc\n\t\t\n\t2\t\n");
+}
+
+void TestFarCell() {
+    auto sheet = CreateSheet();
+    const Position far{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+    sheet->SetCell(far, "far away");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT_EQUAL(sheet->GetCell(far)->GetText(), "far away");
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+    ASSERT(sheet->GetCell(Position{Position::MAX_ROWS - 2, Position::MAX_COLS - 1}) == nullptr);
+
+    sheet->SetCell("A1"_pos, "=XFD16384");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->ClearCell("A1"_pos);
+    sheet->ClearCell(far);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
 void TestCellReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "1");
@@ -363,6 +469,1404 @@ void TestCellCircularReferences() {
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
 
+void TestRandomEditsConsistency() {
+    // случайные правки маленького листа сверяются с наивной моделью:
+    // поиском циклов обходом в глубину и вычислением значений рекурсией
+    const int side = 6;
+    std::mt19937 generator(42);
+    auto random_int = [&generator](int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(generator);
+    };
+
+    auto sheet = CreateSheet();
+    std::map<Position, std::vector<Position>> refs;  // модель: ссылки формул
+    std::map<Position, double> numbers;              // модель: числа и константы формул
+
+    auto reaches = [&refs](Position from, Position target) {
+        std::vector<Position> stack{from};
+        std::set<Position> visited;
+        while (!stack.empty()) {
+            Position pos = stack.back();
+            stack.pop_back();
+            if (pos == target) {
+                return true;
+            }
+            if (visited.insert(pos).second && refs.count(pos)) {
+                stack.insert(stack.end(), refs.at(pos).begin(), refs.at(pos).end());
+            }
+        }
+        return false;
+    };
+
+    std::function<double(Position)> expected_value = [&](Position pos) {
+        double result = numbers.count(pos) ? numbers.at(pos) : 0.0;
+        if (refs.count(pos)) {
+            for (Position ref : refs.at(pos)) {
+                result += expected_value(ref);
+            }
+        }
+        return result;
+    };
+
+    for (int step = 0; step < 3000; ++step) {
+        const Position pos{random_int(0, side - 1), random_int(0, side - 1)};
+        const int number = random_int(0, 9);
+
+        if (random_int(0, 3) == 0) {
+            sheet->SetCell(pos, std::to_string(number));
+            refs.erase(pos);
+            numbers[pos] = number;
+        } else {
+            std::vector<Position> new_refs;
+            std::string formula = "=" + std::to_string(number);
+            for (int i = random_int(1, 3); i > 0; --i) {
+                Position ref{random_int(0, side - 1), random_int(0, side - 1)};
+                new_refs.push_back(ref);
+                formula += "+" + ref.ToString();
+            }
+
+            bool has_cycle = false;
+            for (Position ref : new_refs) {
+                has_cycle = has_cycle || reaches(ref, pos);
+            }
+
+            bool caught = false;
+            try {
+                sheet->SetCell(pos, formula);
+            } catch (const CircularDependencyException&) {
+                caught = true;
+            }
+            ASSERT_EQUAL(caught, has_cycle);
+
+            if (!has_cycle) {
+                refs[pos] = new_refs;
+                numbers[pos] = number;
+            }
+        }
+
+        const Position probe{random_int(0, side - 1), random_int(0, side - 1)};
+        if (const CellInterface* cell = sheet->GetCell(probe)) {
+            const auto value = cell->GetValue();
+            const double actual = std::holds_alternative<std::string>(value)
+                                      ? std::stod(std::get<std::string>(value))
+                                      : std::get<double>(value);
+            ASSERT_EQUAL(actual, expected_value(probe));
+        }
+    }
+}
+
+void TestHubCellInvalidation() {
+    auto sheet = CreateSheet();
+    const int dependents = 5000;
+
+    auto is_inv = [&sheet](Position pos) {
+        return static_cast<Cell*>(sheet->GetCell(pos))->IsCacheInvalidated();
+    };
+
+    sheet->SetCell("A1"_pos, "1");
+    for (int row = 0; row < dependents; ++row) {
+        sheet->SetCell(Position{row, 1}, "=A1+" + std::to_string(row));
+    }
+    // цепочка C1 = A1, C2 = C1 + 1, ...
+    sheet->SetCell("C1"_pos, "=A1");
+    for (int row = 1; row < 500; ++row) {
+        sheet->SetCell(Position{row, 2}, "=" + Position{row - 1, 2}.ToString() + "+1");
+    }
+
+    for (int value = 2; value < 5; ++value) {
+        sheet->SetCell("A1"_pos, std::to_string(value));
+        ASSERT(is_inv(Position{dependents - 1, 1}));
+        ASSERT(is_inv(Position{499, 2}));
+
+        for (int row = 0; row < dependents; ++row) {
+            ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{row, 1})->GetValue()), value + row);
+        }
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{499, 2})->GetValue()), value + 499);
+        ASSERT(!is_inv(Position{0, 1}));
+        ASSERT(!is_inv(Position{499, 2}));
+
+        // запись в ячейку вне конуса зависимостей не сбрасывает кэш
+        sheet->SetCell("D1"_pos, "unrelated");
+        ASSERT(!is_inv(Position{499, 2}));
+    }
+}
+
+void TestDependencyGraphStats() {
+    Sheet sheet;
+    const int dependents = 1000;
+
+    // A1 - хаб, от которого зависят B1:B1000, каждая B зависит еще и от C1
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("C1"_pos, "10");
+    for (int row = 0; row < dependents; ++row) {
+        sheet.SetCell(Position{row, 1}, "=A1+C1");
+    }
+    ASSERT_EQUAL(sheet.GetStats().graph.edges, 2u * dependents);
+    ASSERT_EQUAL(sheet.GetGraph().GetDependentCount(static_cast<Cell*>(sheet.GetCell("A1"_pos))->GetNode()),
+                 static_cast<std::size_t>(dependents));
+
+    // переписываем каждую вторую формулу: ребра удаляются из середины списка хаба
+    for (int row = 0; row < dependents; row += 2) {
+        sheet.SetCell(Position{row, 1}, "=C1*2");
+    }
+    sheet.SetCell("A1"_pos, "2");
+    for (int row = 0; row < dependents; ++row) {
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{row, 1})->GetValue()), row % 2 == 0 ? 20.0 : 12.0);
+    }
+
+    const auto stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.cells, static_cast<std::size_t>(dependents + 2));
+    ASSERT_EQUAL(stats.graph.edges, dependents + dependents / 2u);
+    ASSERT(stats.graph.bytes_per_edge < 64.0);
+
+    for (int row = 0; row < dependents; ++row) {
+        sheet.ClearCell(Position{row, 1});
+    }
+    ASSERT_EQUAL(sheet.GetStats().graph.edges, 0u);
+    ASSERT_EQUAL(sheet.GetStats().graph.nodes, 2u);
+}
+
+void TestRecalculateAll() {
+    auto make_sheet = [] {
+        auto sheet = std::make_unique<Sheet>();
+        // столбец A - входные данные, B и C - формулы над соседними строками,
+        // D - цепочка по строкам, E - ошибки
+        for (int row = 0; row < 300; ++row) {
+            const std::string r = std::to_string(row + 1);
+            const std::string prev = std::to_string(std::max(row, 1));
+            sheet->SetCell(Position{row, 0}, row % 7 == 0 ? "text"s : std::to_string(row));
+            sheet->SetCell(Position{row, 1}, "=A" + r + "*2");
+            sheet->SetCell(Position{row, 2}, "=B" + r + "+B" + prev);
+            sheet->SetCell(Position{row, 3}, row == 0 ? "=C1"s : "=D" + prev + "+C" + r);
+            sheet->SetCell(Position{row, 4}, "=1/(A" + r + "-5)");
+        }
+        return sheet;
+    };
+
+    auto expected = make_sheet();
+    for (std::size_t threads : {1u, 4u}) {
+        auto sheet = make_sheet();
+        sheet->RecalculateAll(threads);
+        for (int row = 0; row < 300; ++row) {
+            for (int col = 0; col < 5; ++col) {
+                const auto* cell = static_cast<const Cell*>(sheet->GetCell(Position{row, col}));
+                ASSERT(!cell->IsCacheInvalidated());
+                ASSERT_EQUAL(cell->GetValue(), expected->GetCell(Position{row, col})->GetValue());
+            }
+        }
+
+        // после изменения пересчитывается только затронутое
+        sheet->SetCell("A2"_pos, "100");
+        ASSERT(static_cast<const Cell*>(sheet->GetCell("D300"_pos))->IsCacheInvalidated());
+        ASSERT(!static_cast<const Cell*>(sheet->GetCell("B3"_pos))->IsCacheInvalidated());
+        sheet->RecalculateAll(threads);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B2"_pos)->GetValue()), 200.0);
+    }
+}
+
+void TestRecalculateChanged() {
+    Sheet sheet;
+    // B1 ограничивает A1 снизу, от B1 идет цепочка из 100 формул
+    sheet.SetCell("A1"_pos, "5");
+    sheet.SetCell("B1"_pos, "=MAX(A1,10)");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    for (int row = 1; row < 100; ++row) {
+        sheet.SetCell(Position{row, 2}, "=C" + std::to_string(row) + "+1");
+    }
+
+    RecalcStats stats = sheet.RecalculateChanged();
+    ASSERT_EQUAL(stats.recomputed, 101u);
+    ASSERT(sheet.IsRecalculated());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C100"_pos)->GetValue()), 119.0);
+
+    // MAX остался прежним: пересчет останавливается на B1
+    sheet.SetCell("A1"_pos, "7");
+    ASSERT(!sheet.IsRecalculated());
+    stats = sheet.RecalculateChanged();
+    ASSERT_EQUAL(stats.recomputed, 1u);
+    ASSERT_EQUAL(stats.cut_off, 1u);
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("C100"_pos))->IsCacheInvalidated());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C100"_pos)->GetValue()), 119.0);
+
+    sheet.SetCell("A1"_pos, "20");
+    stats = sheet.RecalculateChanged();
+    ASSERT_EQUAL(stats.recomputed, 101u);
+    ASSERT_EQUAL(stats.cut_off, 0u);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C100"_pos)->GetValue()), 139.0);
+
+    // отсечение работает и при чтении: E1 не устаревает, пока COUNT прежний
+    sheet.SetCell("F1"_pos, "1");
+    sheet.SetCell("F2"_pos, "2");
+    sheet.SetCell("D1"_pos, "=COUNT(F1:F2)+0");
+    sheet.SetCell("E1"_pos, "=D1*10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("E1"_pos)->GetValue()), 20.0);
+    sheet.SetCell("F2"_pos, "3");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 2.0);
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("E1"_pos))->IsCacheInvalidated());
+
+    // слишком много записей - пересчет всего листа
+    for (std::size_t i = 0; i <= Sheet::MAX_CHANGED_CELLS; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i % 30));
+    }
+    stats = sheet.RecalculateChanged(1);
+    ASSERT_EQUAL(stats.full_recalculations, 1u);
+    ASSERT(sheet.IsRecalculated());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C100"_pos)->GetValue()), 131.0);
+    const SheetStats sheet_stats = sheet.GetStats();
+    ASSERT_EQUAL(sheet_stats.recalc.full_recalculations, 1u);
+    ASSERT_EQUAL(sheet_stats.recalc.recomputed, 203u);
+
+    // случайные правки с MIN/MAX, между которыми лист то пересчитывается по
+    // изменениям, то читается лениво; значения сверяются с листом, заполненным заново
+    const int side = 8;
+    std::mt19937 generator(7);
+    auto random_int = [&generator](int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(generator);
+    };
+    auto random_sheet = CreateSheet();
+    for (int step = 0; step < 2000; ++step) {
+        // формула ссылается только на строки выше, поэтому циклов нет
+        const Position pos{random_int(0, side - 1), random_int(0, side - 1)};
+        if (random_int(0, 9) == 0) {
+            random_sheet->ClearCell(pos);
+        } else if (pos.row == 0 || random_int(0, 2) == 0) {
+            random_sheet->SetCell(pos, std::to_string(random_int(0, 9)));
+        } else {
+            const Position ref{random_int(0, pos.row - 1), random_int(0, side - 1)};
+            const Position other{random_int(0, pos.row - 1), random_int(0, side - 1)};
+            const char* function = random_int(0, 1) == 0 ? "MIN" : "MAX";
+            random_sheet->SetCell(pos, "="s + function + "(" + ref.ToString() + "," + other.ToString() + ",5)+"
+                                           + std::to_string(random_int(0, 1)));
+        }
+
+        if (step % 5 == 0) {
+            static_cast<Sheet&>(*random_sheet).RecalculateChanged();
+        } else if (step % 5 == 2) {
+            if (const CellInterface* cell = random_sheet->GetCell(Position{random_int(0, side - 1), random_int(0, side - 1)})) {
+                cell->GetValue();
+            }
+        }
+        if (step % 50 != 49) {
+            continue;
+        }
+
+        auto expected = CreateSheet();
+        for (int row = 0; row < side; ++row) {
+            for (int col = 0; col < side; ++col) {
+                if (const CellInterface* cell = random_sheet->GetCell(Position{row, col})) {
+                    expected->SetCell(Position{row, col}, cell->GetText());
+                }
+            }
+        }
+        std::ostringstream actual_values;
+        std::ostringstream expected_values;
+        random_sheet->PrintValues(actual_values);
+        expected->PrintValues(expected_values);
+        ASSERT_EQUAL(actual_values.str(), expected_values.str());
+    }
+}
+
+void TestSetCells() {
+    // одинаковая форма по тексту - только у ссылок, сдвинутых вместе с ячейкой
+    ASSERT(FormulaCache::GetTextShape("A1*2", "B1"_pos) == FormulaCache::GetTextShape("A7*2", "B7"_pos));
+    ASSERT(FormulaCache::GetTextShape("SUM(A1:A3)", "B1"_pos) == FormulaCache::GetTextShape("SUM(C2:C4)", "D2"_pos));
+    ASSERT(FormulaCache::GetTextShape("A1*2", "B1"_pos) != FormulaCache::GetTextShape("A1*2", "B7"_pos));
+    ASSERT(FormulaCache::GetTextShape("1E5+A1", "B1"_pos) != FormulaCache::GetTextShape("1E6+A2", "B2"_pos));
+    ASSERT(FormulaCache::GetTextShape("A1B2", "C1"_pos) != FormulaCache::GetTextShape("A2B3", "C2"_pos));
+    ASSERT(!FormulaCache::GetTextShape("ZZZZ1+1", "A1"_pos));
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+1");
+    sheet.SetCell("B1"_pos, "2");
+
+    // по одной записи B1=A1 дала бы цикл, но в итоговом листе его нет
+    const std::uint64_t epoch = sheet.GetEpoch();
+    sheet.SetCells({{"B1"_pos, "=A1"}, {"A1"_pos, "7"}, {"C1"_pos, "=SUM(A1:B1)"}, {"A1"_pos, "8"},
+                    {"B2"_pos, "=A2"}, {"B3"_pos, "=A3"}, {"A3"_pos, "3"}});
+    ASSERT_EQUAL(sheet.GetEpoch(), epoch + 1);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "8"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 8.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 16.0);
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B3"_pos)->GetValue()), 3.0);
+
+    std::ostringstream before;
+    sheet.PrintTexts(before);
+    auto ASSERT_UNCHANGED = [&sheet, &before] {
+        std::ostringstream after;
+        sheet.PrintTexts(after);
+        ASSERT_EQUAL(after.str(), before.str());
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 16.0);
+        ASSERT(sheet.TryGetCell("E1"_pos) == nullptr);
+        ASSERT(sheet.TryGetCell("F1"_pos) == nullptr);
+    };
+
+    // цикл на итоговом графе откатывает весь пакет, в том числе созданные ячейки
+    bool caught = false;
+    try {
+        sheet.SetCells({{"A1"_pos, "100"}, {"D1"_pos, "=E1+A1"}, {"E1"_pos, "=F1"}, {"F1"_pos, "=D1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet.TryGetCell("D1"_pos) == nullptr);
+    ASSERT_UNCHANGED();
+
+    caught = false;
+    try {
+        sheet.SetCells({{"A1"_pos, "100"}, {"B1"_pos, "=1+"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_UNCHANGED();
+
+    caught = false;
+    try {
+        sheet.SetCells({{"A1"_pos, "100"}, {Position{-1, 0}, "1"}});
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_UNCHANGED();
+
+    // Случайные пакеты: формулы столбцов A-D ссылаются на ячейки тех же
+    // столбцов и могут давать циклы, E-G считают SUM/COUNT/AVERAGE по A-B.
+    // Лист сверяется с моделью: пакет с циклом или ошибкой не меняет ничего
+    const int rows = 8;
+    const int cols = 4;
+    std::mt19937 generator(20);
+    auto random_int = [&generator](int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(generator);
+    };
+    auto random_sheet = std::make_unique<Sheet>();
+    std::map<Position, std::string> texts;
+
+    auto has_cycle = [](const std::map<Position, std::string>& model) {
+        std::map<Position, std::vector<Position>> refs;
+        for (const auto& [pos, text] : model) {
+            if (pos.col < cols && text.size() > 1 && text[0] == '=') {
+                refs[pos] = ParseFormula(text.substr(1))->GetReferencedCells();
+            }
+        }
+        std::map<Position, int> state;  // 1 - в обходе, 2 - пройдена
+        std::function<bool(Position)> visit = [&](Position pos) {
+            if (state[pos] != 0) {
+                return state[pos] == 1;
+            }
+            state[pos] = 1;
+            for (Position ref : refs[pos]) {
+                if (visit(ref)) {
+                    return true;
+                }
+            }
+            state[pos] = 2;
+            return false;
+        };
+        for (const auto& [pos, _] : refs) {
+            if (visit(pos)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (int step = 0; step < 400; ++step) {
+        std::vector<std::pair<Position, std::string>> batch;
+        for (int i = random_int(1, 6); i > 0; --i) {
+            const Position pos{random_int(0, rows - 1), random_int(0, cols + 2)};
+            std::string text;
+            if (pos.col >= cols) {
+                const char* functions[] = {"SUM", "COUNT", "AVERAGE"};
+                const int first = random_int(1, rows);
+                text = "="s + functions[pos.col - cols] + "(A" + std::to_string(first) + ":B"
+                     + std::to_string(random_int(first, rows)) + ")";
+            } else if (random_int(0, 2) == 0) {
+                text = random_int(0, 4) == 0 ? ""s : std::to_string(random_int(0, 9));
+            } else if (random_int(0, 30) == 0) {
+                text = "=1+";
+            } else {
+                const Position ref{random_int(0, rows - 1), random_int(0, cols - 1)};
+                text = "=" + ref.ToString() + "+" + std::to_string(random_int(0, 9));
+            }
+            batch.emplace_back(pos, text);
+        }
+
+        std::map<Position, std::string> next = texts;
+        for (const auto& [pos, text] : batch) {
+            next[pos] = text;
+        }
+        // из нескольких записей в ячейку действует последняя
+        bool malformed = false;
+        for (const auto& [pos, text] : batch) {
+            malformed = malformed || next[pos] == "=1+";
+        }
+        const bool cycle = !malformed && has_cycle(next);
+
+        bool failed = false;
+        try {
+            random_sheet->SetCells(batch);
+        } catch (const FormulaException&) {
+            ASSERT(malformed);
+            failed = true;
+        } catch (const CircularDependencyException&) {
+            ASSERT(cycle);
+            failed = true;
+        }
+        ASSERT_EQUAL(failed, malformed || cycle);
+        if (!failed) {
+            texts = std::move(next);
+        }
+
+        auto expected = CreateSheet();
+        for (const auto& [pos, text] : texts) {
+            expected->SetCell(pos, text);
+        }
+        std::ostringstream actual_texts;
+        std::ostringstream expected_texts;
+        random_sheet->PrintTexts(actual_texts);
+        expected->PrintTexts(expected_texts);
+        ASSERT_EQUAL(actual_texts.str(), expected_texts.str());
+
+        // топологический порядок согласован с каждой ссылкой формул
+        const DependencyGraph& graph = random_sheet->GetGraph();
+        for (const auto& [pos, text] : texts) {
+            if (text.size() > 1 && text[0] == '=') {
+                const DependencyGraph::NodeId node = static_cast<const Cell*>(random_sheet->GetCell(pos))->GetNode();
+                graph.ForEachPrecedent(node, [&graph, node](DependencyGraph::NodeId precedent) {
+                    ASSERT(graph.GetOrder(precedent) < graph.GetOrder(node));
+                });
+            }
+        }
+
+        // пустые ячейки, созданные для ссылок, в листе остаются, поэтому
+        // значения сверяются только для записанных ячеек
+        for (const auto& [pos, text] : texts) {
+            ASSERT_EQUAL(random_sheet->GetCell(pos)->GetValue(), expected->GetCell(pos)->GetValue());
+        }
+    }
+}
+
+void TestLoad() {
+    // лист, загруженный целиком, совпадает с листом, заполненным по ячейке
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 500; ++row) {
+        const std::string r = std::to_string(row + 1);
+        cells.emplace_back(Position{row, 0}, row % 7 == 0 ? "text"s : std::to_string(row));
+        // ссылка вниз по столбцу: ячейка загружается раньше той, на которую ссылается
+        cells.emplace_back(Position{row, 1}, row + 1 < 500 ? "=B" + std::to_string(row + 2) + "+A" + r : "=C1"s);
+        cells.emplace_back(Position{row, 3}, "=SUM(A1:A" + r + ")+E" + r);
+    }
+    Sheet loaded;
+    loaded.Load(cells);
+    auto expected = CreateSheet();
+    for (auto it = cells.rbegin(); it != cells.rend(); ++it) {
+        expected->SetCell(it->first, it->second);
+    }
+    // чтение значения вычисляет и ячейки, на которые оно ссылается, поэтому
+    // сначала проверяются все кэши
+    for (const auto& [pos, text] : cells) {
+        ASSERT(static_cast<const Cell*>(loaded.GetCell(pos))->IsCacheInvalidated());
+    }
+    for (int row = 0; row < 500; ++row) {
+        for (int col = 0; col < 5; ++col) {
+            const Position pos{row, col};
+            const CellInterface* cell = loaded.TryGetCell(pos);
+            ASSERT_EQUAL(cell == nullptr, expected->TryGetCell(pos) == nullptr);
+            if (cell) {
+                ASSERT_EQUAL(cell->GetValue(), expected->GetCell(pos)->GetValue());
+            }
+        }
+    }
+    ASSERT_EQUAL(loaded.RecalculateChanged().full_recalculations, 1u);
+
+    // порядок узлов построен заново: правки проверяются на циклы как обычно
+    bool caught = false;
+    try {
+        loaded.SetCell("C1"_pos, "=B1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    loaded.SetCell("C1"_pos, "=A2*2");
+    ASSERT_EQUAL(std::get<double>(loaded.GetCell("B500"_pos)->GetValue()), 2.0);
+
+    caught = false;
+    try {
+        loaded.Load({});
+    } catch (const std::logic_error&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // все ячейки на циклах перечисляются; ячейка, которая только зависит
+    // от цикла, и ячейка, которая ссылается на себя через диапазон, тоже
+    Sheet cyclic;
+    std::string message;
+    try {
+        cyclic.Load({{"A1"_pos, "=B1"}, {"B1"_pos, "=C1+1"}, {"C1"_pos, "=A1"}, {"D1"_pos, "=A1"},
+                     {"A3"_pos, "=SUM(A2:B4)"}, {"E5"_pos, "=E6"}, {"E6"_pos, "=E5"}, {"F1"_pos, "5"}});
+    } catch (const CircularDependencyException& e) {
+        message = e.what();
+    }
+    ASSERT_EQUAL(message, "Have circular dependicies: A1 B1 C1 A3 E5 E6"s);
+    ASSERT(cyclic.TryGetCell("F1"_pos) == nullptr);
+    ASSERT_EQUAL(cyclic.GetStats().cells, 0u);
+    ASSERT_EQUAL(cyclic.GetStats().graph.edges, 0u);
+
+    caught = false;
+    try {
+        cyclic.Load({{"A1"_pos, "1"}, {"B1"_pos, "=A1+"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(cyclic.GetStats().cells, 0u);
+    cyclic.Load({{"A1"_pos, "1"}, {"B1"_pos, "=A1+1"}});
+    ASSERT_EQUAL(std::get<double>(cyclic.GetCell("B1"_pos)->GetValue()), 2.0);
+}
+
+void TestCompactCells() {
+    // ячейки без формул, на которые ничего не ссылается, хранятся прямо в слотах
+    Sheet sheet;
+    const std::pair<std::string, CellSlot::Tag> texts[] = {
+        {"5", CellSlot::Tag::Number},
+        {"-0", CellSlot::Tag::Number},
+        {"0.1", CellSlot::Tag::Number},
+        {"05", CellSlot::Tag::ShortText},
+        {"1e10", CellSlot::Tag::ShortText},
+        {"'=A1", CellSlot::Tag::ShortText},
+        {"=", CellSlot::Tag::ShortText},
+        {"a rather long text", CellSlot::Tag::LongText},
+        {"", CellSlot::Tag::Empty},
+        {"=1+2", CellSlot::Tag::Empty},
+    };
+    for (const auto& [text, tag] : texts) {
+        ASSERT_EQUAL(static_cast<int>(CellSlot::FromText(text).GetTag()), static_cast<int>(tag));
+        if (tag != CellSlot::Tag::Empty) {
+            ASSERT_EQUAL(CellSlot::FromText(text).GetText(), text);
+        }
+    }
+
+    for (int row = 0; row < 4; ++row) {
+        sheet.SetCell(Position{row, 0}, std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "'=text");
+    sheet.SetCell("B2"_pos, "a rather long text");
+    ASSERT_EQUAL(sheet.GetStats().compact_cells, 6u);
+    ASSERT_EQUAL(sheet.GetStats().graph.nodes, 0u);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "1\t=text\n2\ta rather long text\n3\t\n4\t\n"s);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{4, 2}));
+
+    // ячейки, на которые ссылается формула, в том числе через диапазон,
+    // получают объекты Cell и узлы графа; значения и тексты прежние
+    sheet.SetCell("C1"_pos, "=A1+SUM(A2:A3)");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 6.0);
+    ASSERT_EQUAL(sheet.GetStats().compact_cells, 3u);
+    sheet.SetCell("A3"_pos, "10");
+    sheet.SetCell("A1"_pos, "20");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 32.0);
+    ASSERT_EQUAL(sheet.GetStats().compact_cells, 3u);
+
+    // запрос через CellInterface читает слот и ничего не заводит
+    const Sheet& const_sheet = sheet;
+    ASSERT_EQUAL(std::get<std::string>(const_sheet.GetCell("B1"_pos)->GetValue()), "=text"s);
+    ASSERT_EQUAL(const_sheet.GetCell("B2"_pos)->GetText(), "a rather long text"s);
+    ASSERT(const_sheet.GetCell("B2"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet.GetStats().compact_cells, 3u);
+    sheet.ClearCell("A4"_pos);
+    ASSERT(sheet.GetCell("A4"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetStats().compact_cells, 2u);
+
+    // константный лист читают несколько потоков сразу, и ни один его не меняет
+    Sheet numbers;
+    for (int row = 0; row < 1000; ++row) {
+        numbers.SetCell(Position{row, 0}, std::to_string(row));
+    }
+    std::vector<std::thread> readers;
+    std::vector<double> totals(4);
+    for (std::size_t i = 0; i < totals.size(); ++i) {
+        readers.emplace_back([&numbers = std::as_const(numbers), &total = totals[i]] {
+            for (int row = 0; row < 1000; ++row) {
+                total += std::stod(std::get<std::string>(numbers.GetCell(Position{row, 0})->GetValue()));
+            }
+        });
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(totals, std::vector<double>(4, 999.0 * 1000 / 2));
+    ASSERT_EQUAL(numbers.GetStats().compact_cells, 1000u);
+
+    // указатель на ячейку в слоте - тот же объект при каждом запросе, он
+    // остается ячейкой своей позиции после сколько угодно других запросов и
+    // годится в другом потоке
+    std::vector<const CellInterface*> cells;
+    for (int row = 0; row < 1000; ++row) {
+        cells.push_back(std::as_const(numbers).GetCell(Position{row, 0}));
+    }
+    for (int row = 0; row < 1000; row += 37) {
+        ASSERT(numbers.GetCell(Position{row, 0}) == cells[row]);
+        ASSERT_EQUAL(cells[row]->GetText(), std::to_string(row));
+    }
+    std::string from_thread;
+    std::thread([&cells, &from_thread] {
+        from_thread = cells[100]->GetText();
+    }).join();
+    ASSERT_EQUAL(from_thread, "100"s);
+    numbers.SetCell("A1"_pos, "text");
+    numbers.SetCell("B1"_pos, "=A2");
+    ASSERT_EQUAL(cells[0]->GetText(), "text"s);
+    ASSERT_EQUAL(cells[1]->GetText(), "1"s);
+    ASSERT_EQUAL(cells[1]->GetValue(), CellInterface::Value("1"s));
+
+    // запись через представление - это SetCell, и представление видит ее
+    CellInterface* view = sheet.GetCell("B1"_pos);
+    view->Set("=C1*2");
+    ASSERT_EQUAL(view->GetText(), "=C1*2"s);
+    ASSERT_EQUAL(view->GetValue(), CellInterface::Value(64.0));
+    ASSERT_EQUAL(view->GetReferencedCells(), std::vector<Position>{"C1"_pos});
+    ASSERT_EQUAL(sheet.GetStats().compact_cells, 1u);
+
+    // пакет пишет в слоты так же, как SetCell, а ячейки, на которые ссылаются
+    // его формулы, заводит как Cell
+    Sheet batch;
+    batch.SetCells({{"A1"_pos, "1"}, {"A2"_pos, "text"}, {"A3"_pos, "3"}, {"B1"_pos, "=A1+A3"}});
+    ASSERT_EQUAL(batch.GetStats().compact_cells, 1u);
+    batch.SetCells({{"A2"_pos, "2"}, {"A4"_pos, "4"}, {"B1"_pos, "=A1"}});
+    ASSERT_EQUAL(batch.GetStats().compact_cells, 2u);
+    ASSERT_EQUAL(batch.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+    bool caught = false;
+    try {
+        batch.SetCells({{"A4"_pos, "5"}, {"C1"_pos, "=A4+C2"}, {"C2"_pos, "=C1"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(batch.GetCell("A4"_pos)->GetText(), "4"s);
+    ASSERT(batch.TryGetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(batch.GetStats().compact_cells, 2u);
+
+    // префиксные суммы столбца учитывают ячейки в слотах, и запись в слот их обновляет
+    Sheet sums;
+    for (int row = 0; row < 100; ++row) {
+        sums.SetCell(Position{row, 0}, std::to_string(row));
+    }
+    sums.SetCell("A101"_pos, "text");
+    for (int i = 0; i < static_cast<int>(Sheet::COLUMN_SUMS_MIN_RANGES); ++i) {
+        sums.SetCell(Position{i, 1}, "=SUM(A1:A" + std::to_string(50 + i) + ")");
+    }
+    ASSERT_EQUAL(sums.GetStats().indexed_columns, 1u);
+    sums.SetCell("A200"_pos, "7");
+    sums.SetCell("B200"_pos, "=SUM(A150:A200)");
+    ASSERT_EQUAL(std::get<double>(sums.GetCell("B200"_pos)->GetValue()), 7.0);
+    sums.SetCell("A10"_pos, "1000");
+    ASSERT_EQUAL(std::get<double>(sums.GetCell("B1"_pos)->GetValue()), 49.0 * 50 / 2 + 1000 - 9);
+}
+
+void TestScratchSheet() {
+    // лист, память ячеек которого возвращается только вместе с ним
+    Sheet sheet(Sheet::Memory::Scratch);
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell(Position{row, 0}, std::to_string(row));
+        sheet.SetCell(Position{row, 1}, row == 0 ? "=A1"s : "=A" + std::to_string(row + 1) + "+B" + std::to_string(row));
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B100"_pos)->GetValue()), 99.0 * 100 / 2);
+
+    // удаленные и снова созданные ячейки работают как обычно
+    for (int row = 0; row < 100; row += 2) {
+        sheet.ClearCell(Position{row, 1});
+    }
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B2"_pos)->GetValue()), 1.0);
+    sheet.SetCell("B1"_pos, "=SUM(A1:A100)");
+    sheet.SetCell("C1"_pos, "=B1+B100");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 99.0 * 100 / 2 + 99);
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=C1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestTextAsNumber() {
+    // Текст, который ссылки читают как число, разбирается при записи; текст,
+    // который from_chars не разбирает, читается как раньше, через strtod
+    struct Case {
+        std::string text;
+        std::optional<double> parsed;  // GetTextAsNumber
+        CellInterface::Value read;     // значение формулы =A1
+    };
+    const FormulaError value_error(FormulaError::Category::Value);
+    const Case cases[] = {
+        {"42", 42.0, 42.0},
+        {"-0.5", -0.5, -0.5},
+        {"1.5e3", 1500.0, 1500.0},
+        {"'7", 7.0, 7.0},
+        {"+5", std::nullopt, 5.0},
+        {" 5", std::nullopt, 5.0},
+        {"0x10", std::nullopt, 16.0},
+        {"1e400", std::nullopt, value_error},
+        {"5 apples", std::nullopt, value_error},
+        {"text", std::nullopt, value_error},
+    };
+    for (const Case& c : cases) {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, c.text);
+        sheet.SetCell("B1"_pos, "=A1");
+        const CellInterface* cell = sheet.GetCell("A1"_pos);
+        ASSERT_EQUAL(cell->GetTextAsNumber().has_value(), c.parsed.has_value());
+        if (c.parsed) {
+            ASSERT_EQUAL(*cell->GetTextAsNumber(), *c.parsed);
+        }
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), c.read);
+        ASSERT_EQUAL(cell->GetText(), c.text);
+    }
+
+    // значение и текст остаются текстом ячейки, разбор меняется вместе с ним
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "'0010");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A1"_pos)->GetValue()), "0010"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 20.0);
+    sheet.SetCell("A1"_pos, "abc");
+    ASSERT(!sheet.GetCell("A1"_pos)->GetTextAsNumber());
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(value_error));
+    sheet.SetCell("A1"_pos, "=3");
+    ASSERT(!sheet.GetCell("A1"_pos)->GetTextAsNumber());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 6.0);
+}
+
+void TestLongChainEvaluation() {
+    auto sheet = CreateSheet();
+    const int length = 100'000;
+    const int rows = 10'000;
+
+    // нарастающий итог длиной 100000 ячеек, столбец за столбцом
+    auto position = [rows](int i) {
+        return Position{i % rows, i / rows};
+    };
+    sheet->SetCell(position(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet->SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+    }
+
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(position(length - 1))->GetValue()), double(length));
+    sheet->SetCell(position(0), "10");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(position(length / 2))->GetValue()), length / 2 + 10.0);
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell(position(length - 1))->GetValue()), length + 9.0);
+}
+
+void TestParserMatchesAntlr() {
+    // разбор дает либо FormulaException, либо дерево, формулу и список ячеек
+    auto describe = [](auto parse, const std::string& text) {
+        try {
+            FormulaAST ast = parse(text);
+            std::ostringstream out;
+            ast.Print(out);
+            out << '|';
+            ast.PrintFormula(out, Position{0, 0});
+            out << '|';
+            ast.PrintCells(out);
+            for (const Range& range : ast.GetRanges()) {
+                out << ' ' << range.ToString();
+            }
+            return out.str();
+        } catch (const FormulaException&) {
+            return "error"s;
+        }
+    };
+
+    auto check = [&describe](const std::string& text) {
+        const std::string expected = describe([](const std::string& s) { return ParseFormulaASTWithAntlr(s); }, text);
+        const std::string actual = describe([](const std::string& s) { return ParseFormulaAST(s); }, text);
+        AssertEqual(actual, expected, "formula: "s + text);
+    };
+
+    for (const char* text : {"1", "-1+2", "-A1*B2", "--1", "+-+(1)", "1-2-3", "1/2/3", "1-(2-3)", "(1+2)*3",
+                             " 1 +\t2\n", ".5", "1.25e-3", "2E+3", "1e-400", "1e400", "1.", ".", "1e", "1E+",
+                             "A1B2", "3X", "A0", "XFD16384", "XFE1", "a1", "", "()", "(1", "1)", "1 2", "2+", "*2",
+                             "ZZZZZZZZZZ1", "A99999999999", "SUM(A1:B2)", "SUM(B2:A1)+1", "SUM (A1 : A3)",
+                             "MAX(A1:A3,-B1,2)", "COUNT(C1,D1:D2)*AVERAGE(1)", "MIN(SUM(A1:A2))", "sum(A1:A2)",
+                             "FOO(1)", "SUM()", "SUM(1,)", "SUM(A1:)", "SUM(:A1)", "SUM(A1:B2:C3)", "SUM((A1:A2))",
+                             "A1:A2", "SUM(A1:XFE1)", "SUM(A0:A1)", "SUM", "SUM(1", "SUM 1", "SUM(1)(2)"}) {
+        check(text);
+    }
+
+    // случайные формулы из грамматики, часть из них испорчена вставкой или удалением лексемы
+    const std::vector<std::string> tokens{"A1", "B12", "XFD16384", "XFE1", "A0", "0", "7", "2.5", ".5", "1e3",
+                                          "1E-2", "1e", "1.", "(", ")", "+", "-", "*", "/", " ", "e", "$",
+                                          "SUM", ":", ",", "A1:B2"};
+    std::mt19937 generator(11);
+    auto random_index = [&generator](std::size_t size) {
+        return std::uniform_int_distribution<std::size_t>(0, size - 1)(generator);
+    };
+
+    std::function<std::string(int)> generate = [&](int depth) -> std::string {
+        switch (depth > 0 ? random_index(7) : random_index(2)) {
+            case 6: {
+                const char* names[] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
+                return names[random_index(5)] + "("s + (random_index(2) ? "B2:A7,"s : ""s) + generate(depth - 1)
+                     + ")";
+            }
+            case 0:
+                return std::vector<std::string>{"A1", "C3", "AB27", "0", "42", "1.5", ".25", "3e2"}[random_index(8)];
+            case 1:
+                return "("s + generate(depth - 1) + ")";
+            case 2:
+                return "-"s + generate(depth - 1);
+            default:
+                return generate(depth - 1) + " +-*/"[1 + random_index(4)] + generate(depth - 1);
+        }
+    };
+
+    for (int i = 0; i < 3000; ++i) {
+        std::string text = generate(4);
+        if (i % 3 == 0) {
+            const std::size_t pos = random_index(text.size() + 1);
+            text.insert(pos, tokens[random_index(tokens.size())]);
+        } else if (i % 3 == 1 && !text.empty()) {
+            text.erase(random_index(text.size()), 1);
+        }
+        check(text);
+    }
+}
+
+void TestFormulaCache() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "4");
+
+    for (int row = 1; row < 1000; ++row) {
+        // разный текст одной и той же формулы
+        const char* text = row % 3 == 0 ? "=A1*B1" : row % 3 == 1 ? "= A1 * B1" : "=(A1)*(B1)";
+        sheet.SetCell(Position{row, 2}, text);
+    }
+    sheet.SetCell("D1"_pos, "=A1+B1");
+
+    auto stats = sheet.GetStats().formulas;
+    ASSERT_EQUAL(stats.lookups, 1000u);
+    ASSERT_EQUAL(stats.hits, 998u);
+    ASSERT_EQUAL(stats.formulas, 2u);
+    ASSERT(stats.bytes_saved > 998 * sizeof(Position));
+
+    ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), "=A1*B1"s);
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C999"_pos)->GetValue()), 20.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 9.0);
+
+    // некорректные формулы не кэшируются и бросают исключение при каждом запросе
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        try {
+            sheet.SetCell("E1"_pos, "=A1+");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    for (int row = 1; row < 1000; ++row) {
+        sheet.ClearCell(Position{row, 2});
+    }
+    stats = sheet.GetStats().formulas;
+    ASSERT_EQUAL(stats.formulas, 1u);
+    ASSERT_EQUAL(stats.bytes_saved, 0u);
+
+    // константы, которые различаются только после 6-й значащей цифры, - разные формулы
+    sheet.SetCell("C1"_pos, "=1.0000001");
+    sheet.SetCell("D5"_pos, "=1.0000003");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=1.0000001"s);
+    ASSERT_EQUAL(sheet.GetCell("D5"_pos)->GetText(), "=1.0000003"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.0000001);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D5"_pos)->GetValue()), 1.0000003);
+    ASSERT_EQUAL(sheet.GetStats().formulas.formulas, 3u);
+}
+
+void TestSharedRelativeFormulas() {
+    Sheet sheet;
+    const int rows = 1000;
+
+    // столбец C скопирован вниз: C{n} = A{n}*B{n}+1
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, std::to_string(row));
+        sheet.SetCell(Position{row, 1}, "2");
+        sheet.SetCell(Position{row, 2}, "=A" + r + "*B" + r + "+1");
+    }
+    // та же форма в другом месте листа и две формулы, которые ни с чем не разделяются
+    sheet.SetCell("F5"_pos, "=D5*E5+1");
+    sheet.SetCell("D2"_pos, "=A1");
+    sheet.SetCell("D1"_pos, "=XFC1");
+
+    const auto stats = sheet.GetStats().formulas;
+    ASSERT_EQUAL(stats.formulas, 3u);
+    ASSERT_EQUAL(stats.hits, static_cast<std::size_t>(rows));
+
+    for (int row = 0; row < rows; row += 97) {
+        const std::string r = std::to_string(row + 1);
+        const auto* cell = sheet.GetCell(Position{row, 2});
+        ASSERT_EQUAL(cell->GetText(), "=A" + r + "*B" + r + "+1");
+        ASSERT_EQUAL(std::get<double>(cell->GetValue()), row * 2 + 1.0);
+        ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector<Position>{Position{row, 0}, Position{row, 1}}));
+    }
+    ASSERT_EQUAL(sheet.GetCell("F5"_pos)->GetText(), "=D5*E5+1"s);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("F5"_pos)->GetValue()), 1.0);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=XFC1"s);
+
+    // изменение одной из разделяющих формулу ячеек не задевает остальные
+    sheet.SetCell("C10"_pos, "=A10-B10");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C10"_pos)->GetValue()), 7.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C11"_pos)->GetValue()), 21.0);
+
+    // формула скопирована вниз, но константы различаются только после 6-й
+    // значащей цифры: форма у каждой своя, и по одной, и пакетом
+    const std::vector<std::string> constants = {"1.0000001", "1.0000002", "1.0000003", "1.0000001"};
+    for (bool batch : {false, true}) {
+        Sheet copied;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < static_cast<int>(constants.size()); ++row) {
+            const std::string text = "=A" + std::to_string(row + 1) + "+" + constants[row];
+            if (batch) {
+                cells.emplace_back(Position{row, 1}, text);
+            } else {
+                copied.SetCell(Position{row, 1}, text);
+            }
+        }
+        if (batch) {
+            copied.SetCells(std::move(cells));
+        }
+        for (int row = 0; row < static_cast<int>(constants.size()); ++row) {
+            const auto* cell = copied.GetCell(Position{row, 1});
+            ASSERT_EQUAL(cell->GetText(), "=A" + std::to_string(row + 1) + "+" + constants[row]);
+            ASSERT_EQUAL(std::get<double>(cell->GetValue()), std::stod(constants[row]));
+        }
+        ASSERT_EQUAL(copied.GetStats().formulas.formulas, 3u);
+    }
+}
+
+void TestBatchEvaluation() {
+    using Isa = vector_kernels::Isa;
+    const Isa default_isa = vector_kernels::GetIsa();
+    const int rows = 1003;  // не кратно ни ширине вектора, ни размеру блока
+
+    // входные данные на все случаи: числа, текст, числа в тексте, пустые
+    // ячейки, ошибки, переполнение, деление на почти ноль, nan и inf
+    auto fill_inputs = [rows](Sheet& sheet) {
+        const std::vector<std::string> a_values{"1", "text", "", "'5", "1e300", "nan", "=1/0", "-inf", "2.5", "=A1"};
+        const std::vector<std::string> b_values{"1", "0", "1e-7", "-2", "1e300", "3", ""};
+        for (int row = 0; row < rows; ++row) {
+            const std::string& a = a_values[row % a_values.size()];
+            const std::string& b = b_values[row % b_values.size()];
+            if (!a.empty()) {
+                sheet.SetCell(Position{row, 0}, a == "1" ? std::to_string(row) : a);
+            }
+            if (!b.empty()) {
+                sheet.SetCell(Position{row, 1}, b);
+            }
+        }
+    };
+
+    auto describe = [](const FormulaInterface::Value& value) {
+        std::ostringstream out;
+        out.precision(17);
+        std::visit([&out](const auto& x) { out << x; }, value);
+        return out.str();
+    };
+
+    // Пакет совпадает с поячеечным вычислением, в том числе для сдвигов за
+    // лист. Сдвиги подряд по столбцу читают ссылки столбцами из тайлов: и из
+    // слотов, и из объектов Cell, которые заводит диапазон в E1
+    for (bool promoted : {false, true}) {
+        Sheet sheet;
+        fill_inputs(sheet);
+        if (promoted) {
+            sheet.SetCell("E1"_pos, "=COUNT(A1:B" + std::to_string(rows) + ")");
+        }
+        auto formula = ParseSharedFormula("A4*B4+A4/B4-(-B5)");
+        std::vector<Position> scattered;
+        std::vector<Position> column;
+        for (int row = -5; row < rows; ++row) {
+            scattered.push_back(Position{row, row % 3 == 0 ? 0 : 1});
+            column.push_back(Position{row + 3, 0});
+        }
+
+        for (Isa isa : {Isa::Scalar, Isa::Avx2}) {
+            vector_kernels::SetIsa(isa);
+            for (const std::vector<Position>& shifts : {scattered, column}) {
+                std::vector<FormulaInterface::Value> results(shifts.size());
+                formula->EvaluateBatch(sheet, shifts.data(), shifts.size(), results.data());
+                for (std::size_t i = 0; i < shifts.size(); ++i) {
+                    AssertEqual(describe(results[i]), describe(formula->Evaluate(sheet, shifts[i])),
+                                "shift: "s + std::to_string(shifts[i].row) + ", " + std::to_string(shifts[i].col));
+                }
+            }
+        }
+    }
+
+    // RecalculateAll вычисляет столбец C пакетами, а D - по ячейке после них
+    for (Isa isa : {Isa::Scalar, Isa::Avx2}) {
+        vector_kernels::SetIsa(isa);
+        Sheet sheet;
+        Sheet expected;
+        for (Sheet* s : {&sheet, &expected}) {
+            fill_inputs(*s);
+            for (int row = 0; row < rows; ++row) {
+                const std::string r = std::to_string(row + 1);
+                s->SetCell(Position{row, 2}, "=A" + r + "*B" + r + "-A" + r + "/B" + r);
+                s->SetCell(Position{row, 3}, "=C" + r + "+1");
+            }
+        }
+
+        sheet.RecalculateAll(1);
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 2; col < 4; ++col) {
+                const auto* cell = static_cast<const Cell*>(sheet.GetCell(Position{row, col}));
+                ASSERT(!cell->IsCacheInvalidated());
+                ASSERT_EQUAL(cell->GetValue(), expected.GetCell(Position{row, col})->GetValue());
+            }
+        }
+
+        // после изменения пакет пересчитывает только устаревшие ячейки
+        sheet.SetCell("B2"_pos, "4");
+        expected.SetCell("B2"_pos, "4");
+        sheet.RecalculateAll(4);
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), expected.GetCell("D2"_pos)->GetValue());
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), expected.GetCell("D3"_pos)->GetValue());
+    }
+
+    vector_kernels::SetIsa(default_isa);
+}
+
+void TestRangeFunctions() {
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+
+    Sheet sheet;
+    for (int row = 0; row < 10; ++row) {
+        sheet.SetCell(Position{row, 0}, std::to_string(row + 1));  // A1:A10 = 1..10
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A10)");
+    sheet.SetCell("B2"_pos, "=AVERAGE(A1:A4)");
+    sheet.SetCell("B3"_pos, "=MIN(A3:A10,5)*MAX(A10:A1)");
+    sheet.SetCell("B4"_pos, "=COUNT(A1:A20,C1:C20)");  // пустые ячейки диапазона не считаются
+    sheet.SetCell("B5"_pos, "= SUM ( A1 : A2 )");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(55.0));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(2.5));
+    ASSERT_EQUAL(value(sheet, "B3"), CellInterface::Value(30.0));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=MIN(A3:A10,5)*MAX(A1:A10)"s);
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=SUM(A1:A2)"s);
+
+    // диапазон хранится одной записью, его ячейки не попадают в список ссылок
+    ASSERT(sheet.GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(static_cast<const Cell*>(sheet.GetCell("B1"_pos))->GetReferencedRanges(),
+                 (std::vector{Range::FromString("A1:A10")}));
+    ASSERT(sheet.GetCell("C20"_pos) == nullptr);
+
+    // изменение, создание и удаление ячеек внутри диапазона сбрасывает кэш
+    sheet.SetCell("A1"_pos, "101");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(155.0));
+    sheet.SetCell("A11"_pos, "1000");
+    sheet.SetCell("C5"_pos, "7");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(155.0));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(12.0));
+    sheet.ClearCell("A1"_pos);
+    sheet.ClearCell("C5"_pos);
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(54.0));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(10.0));
+
+    // непустые ячейки диапазона приводятся к числу как обычные ссылки
+    sheet.SetCell("A2"_pos, "text");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    sheet.SetCell("A2"_pos, "=1/0");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    sheet.SetCell("A2"_pos, "'2");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(54.0));
+
+    // пустой диапазон
+    sheet.SetCell("D1"_pos, "=SUM(E1:E5)+MAX(E1:E5)+COUNT(E1:E5)");
+    sheet.SetCell("D2"_pos, "=AVERAGE(E1:E5)");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value(sheet, "D2"), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+
+    // циклы через диапазон: и сама формула в своем диапазоне, и ячейка
+    // диапазона, ссылающаяся на формулу
+    auto throws_cycle = [&sheet](std::string_view pos, const std::string& text) {
+        try {
+            sheet.SetCell(Position::FromString(pos), text);
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(throws_cycle("A5", "=SUM(A1:A10)"));
+    ASSERT(throws_cycle("A3", "=B1+1"));
+    ASSERT(throws_cycle("C1", "=D1+SUM(C1:C3)"));
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "3"s);
+    // ячейки, которых еще нет, цикла не несут, а новая формула в диапазоне его замыкает
+    sheet.SetCell("F1"_pos, "=SUM(G1:G3)");
+    ASSERT(throws_cycle("G2", "=F1"));
+    ASSERT(sheet.GetCell("G2"_pos) == nullptr);
+    sheet.SetCell("G2"_pos, "=A10");
+    ASSERT_EQUAL(value(sheet, "F1"), CellInterface::Value(10.0));
+
+    // диапазоны копируются вниз вместе с формулой и вычисляются пакетом
+    Sheet copied;
+    const int rows = 100;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        copied.SetCell(Position{row, 0}, std::to_string(row));
+        copied.SetCell(Position{row, 1}, row % 4 == 0 ? ""s : "1");
+        copied.SetCell(Position{row, 2}, "=SUM(A" + r + ":B" + r + ")+COUNT(B" + r + ":B" + r + ",1)");
+    }
+    ASSERT_EQUAL(copied.GetStats().formulas.formulas, 1u);
+    ASSERT_EQUAL(copied.GetCell("C5"_pos)->GetText(), "=SUM(A5:B5)+COUNT(B5:B5,1)"s);
+    copied.RecalculateAll(2);
+    for (int row = 0; row < rows; ++row) {
+        const double ones = row % 4 == 0 ? 0 : 1;
+        ASSERT_EQUAL(copied.GetCell(Position{row, 2})->GetValue(), CellInterface::Value(row + 2 * ones + 1));
+    }
+}
+
+void TestRangeIndex() {
+    // индекс сверяется с перебором при случайных вставках и удалениях,
+    // в том числе повторяющихся записей и диапазонов во весь лист
+    std::mt19937 generator(16);
+    auto random_int = [&generator](int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(generator);
+    };
+    auto random_range = [&] {
+        if (random_int(0, 50) == 0) {
+            return Range{Position{0, 0}, Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+        }
+        const Position first{random_int(0, 200), random_int(0, 50)};
+        return Range{first, Position{first.row + random_int(0, 40), first.col + random_int(0, 5)}};
+    };
+
+    RangeIndex index;
+    std::vector<std::pair<Range, RangeIndex::Id>> expected;
+    for (int step = 0; step < 20000; ++step) {
+        if (expected.empty() || random_int(0, 9) < 6) {
+            const auto entry = random_int(0, 3) == 0 && !expected.empty()
+                ? expected[random_int(0, static_cast<int>(expected.size()) - 1)]
+                : std::pair{random_range(), static_cast<RangeIndex::Id>(random_int(0, 1000))};
+            index.Insert(entry.first, entry.second);
+            expected.push_back(entry);
+        } else {
+            const std::size_t i = random_int(0, static_cast<int>(expected.size()) - 1);
+            index.Erase(expected[i].first, expected[i].second);
+            expected[i] = expected.back();
+            expected.pop_back();
+        }
+        ASSERT_EQUAL(index.Size(), expected.size());
+
+        if (step % 50 == 0) {
+            const Position pos{random_int(0, 250), random_int(0, 60)};
+            std::vector<RangeIndex::Id> found;
+            index.ForEachContaining(pos, [&found](RangeIndex::Id id) {
+                found.push_back(id);
+            });
+            std::vector<RangeIndex::Id> brute_force;
+            for (const auto& [range, id] : expected) {
+                if (range.Contains(pos)) {
+                    brute_force.push_back(id);
+                }
+            }
+            std::sort(found.begin(), found.end());
+            std::sort(brute_force.begin(), brute_force.end());
+            AssertEqual(found, brute_force, "step "s + std::to_string(step));
+            ASSERT_EQUAL(index.AnyContaining(pos), !brute_force.empty());
+        }
+    }
+
+    // ссылка на диапазон в графе - одна запись, какой бы большой он ни был
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=SUM(A1:A16384)");
+    sheet.SetCell("B2"_pos, "=SUM(C1:XFD16384)");
+    const auto stats = sheet.GetStats().graph;
+    ASSERT_EQUAL(stats.edges, 2u);
+    ASSERT(stats.edge_bytes < 1024);
+    ASSERT(sheet.GetGraph().HasRangeDependents("A16384"_pos));
+    ASSERT(!sheet.GetGraph().HasRangeDependents("B16384"_pos));
+    // значение B2 не читается: сумма по всему листу перебирает все его ячейки
+    sheet.SetCell("B3"_pos, "=SUM(XFA1:XFD16384)");
+    sheet.SetCell("A16384"_pos, "5");
+    sheet.SetCell("XFD1"_pos, "=A16384*2");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.ClearCell("B1"_pos);
+    sheet.ClearCell("B2"_pos);
+    sheet.ClearCell("B3"_pos);
+    ASSERT_EQUAL(sheet.GetStats().graph.edges, 1u);
+    ASSERT(!sheet.GetGraph().HasRangeDependents("A1"_pos));
+}
+
+void TestRangeAggregateDeltas() {
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto is_actual = [](const Sheet& sheet, std::string_view pos) {
+        return !static_cast<const Cell*>(sheet.GetCell(Position::FromString(pos)))->IsCacheInvalidated();
+    };
+
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        if (row % 10 != 9) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row));
+        }
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A1000)");
+    sheet.SetCell("B2"_pos, "=COUNT(A1:A1000,C1:C3)");
+    sheet.SetCell("B3"_pos, "=AVERAGE(A1:A4,A3:A5)");  // A3 и A4 входят дважды
+    sheet.SetCell("B4"_pos, "=MAX(A1:A1000)");
+    sheet.SetCell("B5"_pos, "=B1+1");
+    for (const char* pos : {"B1", "B2", "B3", "B4", "B5"}) {
+        value(sheet, pos);
+    }
+
+    // SUM/COUNT/AVERAGE обновлены сразу при записи, MAX и зависящие от
+    // SUM формулы ждут чтения
+    sheet.SetCell("A3"_pos, "1002");
+    ASSERT(is_actual(sheet, "B1") && is_actual(sheet, "B2") && is_actual(sheet, "B3"));
+    ASSERT(!is_actual(sheet, "B4") && !is_actual(sheet, "B5"));
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(449'100.0 - 2 + 1002));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(900.0));
+    ASSERT_EQUAL(value(sheet, "B3"), CellInterface::Value((0 + 1 + 1002 + 3 + 1002 + 3 + 4) / 7.0));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(1002.0));
+    ASSERT_EQUAL(value(sheet, "B5"), CellInterface::Value(449'100.0 + 1001));
+
+    // пустые ячейки: созданные, очищенные и с пустым текстом
+    sheet.SetCell("A10"_pos, "5");
+    sheet.SetCell("C2"_pos, "'7");
+    sheet.ClearCell("A1"_pos);
+    sheet.SetCell("A2"_pos, "");
+    ASSERT(is_actual(sheet, "B1") && is_actual(sheet, "B2"));
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(449'100.0 + 1000 + 5 - 1));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(900.0 + 2 - 2));
+    ASSERT_EQUAL(value(sheet, "B3"), CellInterface::Value((1002 + 3 + 1002 + 3 + 4) / 5.0));
+
+    // текст, ошибки и формулы в диапазоне выключают приращения, пока
+    // формула не будет пересчитана заново
+    sheet.SetCell("A5"_pos, "text");
+    ASSERT(!is_actual(sheet, "B1"));
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    sheet.SetCell("A5"_pos, "=A6*2");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(449'100.0 + 1000 + 5 - 1 - 4 + 10));
+    sheet.SetCell("A6"_pos, "6");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(449'100.0 + 1000 + 5 - 1 - 4 + 12 + 1));
+    sheet.SetCell("A5"_pos, "4");
+    sheet.SetCell("A6"_pos, "5");
+    ASSERT(!is_actual(sheet, "B1"));
+    value(sheet, "B1");
+    sheet.SetCell("A6"_pos, "6");
+    ASSERT(is_actual(sheet, "B1"));
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(449'100.0 + 1000 + 5 - 1 + 1));
+
+    // AVERAGE пустого диапазона и переполнение дают #DIV/0!
+    sheet.SetCell("D1"_pos, "=AVERAGE(E1:E2)");
+    sheet.SetCell("E1"_pos, "3");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(3.0));
+    sheet.ClearCell("E1"_pos);
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    sheet.SetCell("E1"_pos, "1e308");
+    sheet.SetCell("E2"_pos, "1e308");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    sheet.SetCell("E2"_pos, "-1e308");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(0.0));
+
+    // после многих приращений сумма пересчитывается точно
+    Sheet drift;
+    std::mt19937 generator(17);
+    std::uniform_real_distribution<double> random_value(-1e6, 1e6);
+    for (int row = 0; row < 100; ++row) {
+        drift.SetCell(Position{row, 0}, std::to_string(random_value(generator)));
+    }
+    drift.SetCell("B1"_pos, "=SUM(A1:A100)");
+    auto formula = ParseFormula("SUM(A1:A100)");
+    for (int edit = 0; edit < 5000; ++edit) {
+        drift.SetCell(Position{edit % 100, 0}, std::to_string(random_value(generator)));
+        const double actual = std::get<double>(value(drift, "B1"));
+        const double exact = std::get<double>(formula->Evaluate(drift));
+        ASSERT(std::abs(actual - exact) < 1e-6);
+    }
+}
+
+void TestColumnSums() {
+    const int rows = 2000;
+    const int window = 30;
+
+    // скользящие окна по столбцу A: B{n} = SUM(A{n-29}:A{n}), C{n} = AVERAGE(...)
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row) {
+        if (row % 7 != 3) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 100));
+        }
+    }
+    for (int row = window - 1; row < rows; ++row) {
+        const std::string range = "(A" + std::to_string(row - window + 2) + ":A" + std::to_string(row + 1) + ")";
+        sheet.SetCell(Position{row, 1}, "=SUM" + range);
+        sheet.SetCell(Position{row, 2}, "=AVERAGE" + range);
+    }
+    ASSERT_EQUAL(sheet.GetStats().indexed_columns, 1u);
+    ASSERT(sheet.GetStats().column_sums_bytes > 0);
+
+    // сверяем с вычислением формулы по ячейкам
+    auto check = [&sheet](int step) {
+        for (int row = window - 1; row < rows; ++row) {
+            for (int col = 1; col <= 2; ++col) {
+                const std::string text = sheet.GetCell(Position{row, col})->GetText();
+                const auto expected = ParseFormula(text.substr(1))->Evaluate(sheet);
+                const auto actual = sheet.GetCell(Position{row, col})->GetValue();
+                std::ostringstream expected_text;
+                std::ostringstream actual_text;
+                std::visit([&expected_text](const auto& x) { expected_text << x; }, expected);
+                std::visit([&actual_text](const auto& x) { actual_text << x; }, actual);
+                AssertEqual(actual_text.str(), expected_text.str(), text + " at step "s + std::to_string(step));
+            }
+        }
+    };
+    check(0);
+
+    // записи в столбец: числа, пустые ячейки, текст и формулы
+    std::mt19937 generator(18);
+    auto random_int = [&generator](int from, int to) {
+        return std::uniform_int_distribution<int>(from, to)(generator);
+    };
+    for (int step = 1; step <= 600; ++step) {
+        const Position pos{random_int(0, rows - 1), 0};
+        switch (random_int(0, 9)) {
+            case 0:
+                sheet.ClearCell(pos);
+                break;
+            case 1:
+                sheet.SetCell(pos, random_int(0, 1) ? "text"s : "'12"s);
+                break;
+            case 2:
+                sheet.SetCell(pos, "=" + std::to_string(random_int(1, 9)) + "*2");
+                break;
+            default:
+                sheet.SetCell(pos, std::to_string(random_int(-1000, 1000)));
+                break;
+        }
+        if (step % 100 == 0) {
+            check(step);
+        }
+    }
+
+    // столбец выходит из индекса вместе с последней формулой
+    for (int row = window - 1; row < rows; ++row) {
+        sheet.ClearCell(Position{row, 1});
+        sheet.ClearCell(Position{row, 2});
+    }
+    ASSERT_EQUAL(sheet.GetStats().indexed_columns, 0u);
+    ASSERT_EQUAL(sheet.GetStats().column_sums_bytes, 0u);
+}
+
 void MyFinalTest1() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "5");
@@ -509,32 +2013,701 @@ void MyFinalTest2() {
     ASSERT(caught);
     ASSERT_EQUAL(get_ans("X2"s), 25.0);
 }
+
+void BenchmarkDeepFormulaEvaluation() {
+    auto sheet = CreateSheet();
+
+    // длинная цепочка A1+A2+...+A500 (глубокое дерево) и глубоко вложенная формула
+    std::string long_sum = "A1";
+    for (int row = 0; row < 500; ++row) {
+        sheet->SetCell(Position{row, 0}, "=" + std::to_string(row));
+        if (row > 0) {
+            long_sum += "+" + Position{row, 0}.ToString();
+        }
+    }
+    // вложенность 60 умещается во встроенный стек вычисления, 150 - нет
+    auto make_nested = [](int depth) {
+        std::string nested = "A1";
+        for (int i = 0; i < depth; ++i) {
+            nested = "A2*(" + nested + ")";
+        }
+        return nested;
+    };
+    sheet->SetCell("B1"_pos, "=" + long_sum);
+    sheet->SetCell("B2"_pos, "=" + make_nested(60));
+
+    auto sum = ParseFormula(long_sum);
+    auto deep = ParseFormula(make_nested(60));
+    auto deeper = ParseFormula(make_nested(150));
+    ASSERT_EQUAL(std::get<double>(sum->Evaluate(*sheet)), 499.0 * 500 / 2);
+    ASSERT_EQUAL(std::get<double>(deep->Evaluate(*sheet)), 0.0);
+    ASSERT_EQUAL(std::get<double>(deeper->Evaluate(*sheet)), 0.0);
+
+    const int iterations = 2000;
+    double total = 0;
+    const std::size_t allocations_before = GetAllocationCount();
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        total += std::get<double>(sum->Evaluate(*sheet));
+        total += std::get<double>(deep->Evaluate(*sheet));
+        total += std::get<double>(deeper->Evaluate(*sheet));
+    }
+    const auto duration = std::chrono::steady_clock::now() - start;
+    const std::size_t allocations = GetAllocationCount() - allocations_before;
+
+    std::cerr << "BenchmarkDeepFormulaEvaluation: "sv << 3 * iterations << " evaluations in "sv
+              << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us, "sv
+              << allocations << " allocations"sv << std::endl;
+    ASSERT_EQUAL(total, iterations * 499.0 * 500 / 2);
+    if (ALLOCATIONS_COUNTED) {
+        ASSERT_EQUAL(allocations, 0u);
+    }
+}
+
+void BenchmarkNumericTextReads() {
+    const int rows = 1'000;
+
+    // формулы читают ячейки с числами, записанными текстом
+    Sheet sheet;
+    std::string long_sum = "A1";
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell(Position{row, 0}, std::to_string(row) + ".25");
+        if (row > 0) {
+            long_sum += "+" + Position{row, 0}.ToString();
+        }
+    }
+    sheet.SetCell("B1"_pos, "=" + long_sum);
+    sheet.SetCell("B2"_pos, "=SUM(A1:A" + std::to_string(rows) + ")");
+
+    auto sum = ParseFormula(long_sum);
+    auto range_sum = ParseFormula("SUM(A1:A" + std::to_string(rows) + ")");
+    const double expected = (rows - 1.0) * rows / 2 + 0.25 * rows;
+    ASSERT_EQUAL(std::get<double>(sum->Evaluate(sheet)), expected);
+
+    const int iterations = 2000;
+    double total = 0;
+    const std::size_t allocations_before = GetAllocationCount();
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        total += std::get<double>(sum->Evaluate(sheet));
+        total += std::get<double>(range_sum->Evaluate(sheet));
+    }
+    const auto duration = std::chrono::steady_clock::now() - start;
+    const std::size_t allocations = GetAllocationCount() - allocations_before;
+
+    std::cerr << "BenchmarkNumericTextReads: "sv << 2 * iterations << " evaluations of "sv << rows
+              << " numeric text cells in "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count()
+              << " us, "sv << allocations << " allocations"sv << std::endl;
+    ASSERT_EQUAL(total, 2 * iterations * expected);
+    if (ALLOCATIONS_COUNTED) {
+        ASSERT_EQUAL(allocations, 0u);
+    }
+}
+
+void BenchmarkErrorHeavyRecalculation() {
+    const int rows = 10'000;
+    const int column_pairs = 5;
+    const int formulas = rows * column_pairs;
+
+    // 100k ячеек: пары столбцов из входных данных и формул над ними
+    auto recalculate = [=](bool half_text) {
+        auto sheet = CreateSheet();
+        for (int col = 0; col < 2 * column_pairs; col += 2) {
+            for (int row = 0; row < rows; ++row) {
+                std::string input = half_text && row % 2 == 1 ? "label"s : std::to_string(row);
+                sheet->SetCell(Position{row, col}, std::move(input));
+                sheet->SetCell(Position{row, col + 1}, "=" + Position{row, col}.ToString() + "*2+1");
+            }
+        }
+
+        int errors = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (int col = 1; col < 2 * column_pairs; col += 2) {
+            for (int row = 0; row < rows; ++row) {
+                const auto value = sheet->GetCell(Position{row, col})->GetValue();
+                errors += std::holds_alternative<FormulaError>(value) ? 1 : 0;
+            }
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+
+        std::cerr << "BenchmarkErrorHeavyRecalculation: "sv << (half_text ? "half text"sv : "numeric"sv)
+                  << " inputs, "sv << formulas << " formulas in "sv
+                  << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us"sv << std::endl;
+        return errors;
+    };
+
+    ASSERT_EQUAL(recalculate(false), 0);
+    ASSERT_EQUAL(recalculate(true), formulas / 2);
+}
+void BenchmarkParallelRecalculation() {
+    const int rows = 10'000;
+    const int cols = 20;
+
+    // каждая формула ссылается на две формулы предыдущей строки, поэтому
+    // строка вычисляется только после предыдущей, а внутри строки - параллельно
+    auto make_sheet = [=] {
+        auto sheet = std::make_unique<Sheet>();
+        for (int col = 0; col < cols; ++col) {
+            sheet->SetCell(Position{0, col}, std::to_string(col));
+        }
+        for (int row = 1; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet->SetCell(Position{row, col}, "=(" + Position{row - 1, col}.ToString() + "+"
+                                                       + Position{row - 1, (col + 1) % cols}.ToString() + ")/2");
+            }
+        }
+        return sheet;
+    };
+
+    double reference = 0;
+    for (std::size_t threads : {1u, 4u, 0u}) {
+        auto sheet = make_sheet();
+        const auto start = std::chrono::steady_clock::now();
+        sheet->RecalculateAll(threads);
+        const auto duration = std::chrono::steady_clock::now() - start;
+
+        std::cerr << "BenchmarkParallelRecalculation: "sv << (rows - 1) * cols << " formulas, "sv
+                  << WorkStealingPool(threads).GetThreadCount() << " threads in "sv
+                  << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us"sv << std::endl;
+
+        const double value = std::get<double>(sheet->GetCell(Position{rows / 2, 0})->GetValue());
+        if (threads == 1) {
+            reference = value;
+        }
+        ASSERT_EQUAL(value, reference);
+    }
+}
+
+void BenchmarkBatchRecalculation() {
+    const int rows = 16'000;
+
+    // столбец D скопирован вниз: D{n} = A{n}*B{n}+C{n}
+    auto make_sheet = [] {
+        auto sheet = std::make_unique<Sheet>();
+        for (int row = 0; row < rows; ++row) {
+            const std::string r = std::to_string(row + 1);
+            sheet->SetCell(Position{row, 0}, std::to_string(row));
+            sheet->SetCell(Position{row, 1}, std::to_string(row % 10) + ".5");
+            sheet->SetCell(Position{row, 2}, std::to_string(-row));
+            sheet->SetCell(Position{row, 3}, "=A" + r + "*B" + r + "+C" + r);
+        }
+        return sheet;
+    };
+
+    auto report = [](std::string_view name, int count, auto duration) {
+        std::cerr << "BenchmarkBatchRecalculation: "sv << name << ' ' << count << " formulas in "sv
+                  << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us"sv << std::endl;
+    };
+
+    // поячеечно, как при чтении значений
+    auto sheet = make_sheet();
+    auto start = std::chrono::steady_clock::now();
+    double expected = 0;
+    for (int row = 0; row < rows; ++row) {
+        expected += std::get<double>(sheet->GetCell(Position{row, 3})->GetValue());
+    }
+    report("per cell"sv, rows, std::chrono::steady_clock::now() - start);
+
+    const vector_kernels::Isa default_isa = vector_kernels::GetIsa();
+    for (vector_kernels::Isa isa : {vector_kernels::Isa::Scalar, vector_kernels::Isa::Avx2}) {
+        vector_kernels::SetIsa(isa);
+        sheet = make_sheet();
+        start = std::chrono::steady_clock::now();
+        sheet->RecalculateAll(1);
+        report(vector_kernels::GetIsa() == vector_kernels::Isa::Avx2 ? "batch AVX2"sv : "batch scalar"sv, rows,
+               std::chrono::steady_clock::now() - start);
+
+        double sum = 0;
+        for (int row = 0; row < rows; ++row) {
+            sum += std::get<double>(sheet->GetCell(Position{row, 3})->GetValue());
+        }
+        ASSERT_EQUAL(sum, expected);
+    }
+
+    // Одна формула без пересчета листа вокруг: по сдвигу за раз, как
+    // Evaluate, и пакетом, который читает столбцы ссылок из тайлов подряд.
+    // Сравниваем лучшие из нескольких проходов, чтобы не мерить чужую нагрузку
+    const int repeats = 50;
+    auto formula = ParseSharedFormula("A1*B1+C1");
+    std::vector<Position> shifts;
+    for (int row = 0; row < rows; ++row) {
+        shifts.push_back(Position{row, 0});
+    }
+    std::vector<FormulaInterface::Value> results(shifts.size());
+
+    // проходы чередуются, чтобы все три способа попадали под одну и ту же нагрузку машины
+    const vector_kernels::Isa isas[] = {vector_kernels::Isa::Scalar, vector_kernels::Isa::Avx2};
+    auto one_by_one = std::chrono::steady_clock::duration::max();
+    std::chrono::steady_clock::duration batch[2] = {one_by_one, one_by_one};
+    for (int i = 0; i < repeats; ++i) {
+        start = std::chrono::steady_clock::now();
+        double sum = 0;
+        for (const Position& shift : shifts) {
+            sum += std::get<double>(formula->Evaluate(*sheet, shift));
+        }
+        one_by_one = std::min(one_by_one, std::chrono::steady_clock::now() - start);
+        ASSERT_EQUAL(sum, expected);
+
+        for (int j = 0; j < 2; ++j) {
+            vector_kernels::SetIsa(isas[j]);
+            start = std::chrono::steady_clock::now();
+            formula->EvaluateBatch(*sheet, shifts.data(), shifts.size(), results.data());
+            sum = 0;
+            for (const FormulaInterface::Value& result : results) {
+                sum += std::get<double>(result);
+            }
+            batch[j] = std::min(batch[j], std::chrono::steady_clock::now() - start);
+            ASSERT_EQUAL(sum, expected);
+        }
+    }
+    report("best pass, evaluated one by one"sv, rows, one_by_one);
+    report("best pass, evaluated in batches, scalar"sv, rows, batch[0]);
+    report(vector_kernels::GetIsa() == vector_kernels::Isa::Avx2 ? "best pass, evaluated in batches, AVX2"sv
+                                                                  : "best pass, evaluated in batches, scalar"sv,
+           rows, batch[1]);
+    // ссылки читаются без виртуальных вызовов и поиска ячейки по позиции
+    ASSERT(batch[0] * 3 < one_by_one * 2);
+    ASSERT(batch[1] * 3 < one_by_one * 2);
+
+    // Выше обе реализации ядер упираются в чтение ячеек из памяти; на блоке
+    // стека, который лежит в L1, AVX2 должен обгонять скалярные ядра. Берём
+    // лучший из нескольких заходов, чтобы не мерить чужую нагрузку
+    const std::size_t lanes = 256;
+    const int blocks = 20'000;
+    const int rounds = 5;
+    std::vector<double> lhs(lanes);
+    std::vector<double> rhs(lanes, 1.000001);
+    std::vector<std::uint8_t> failed(lanes);
+    std::chrono::steady_clock::duration kernels[2] = {std::chrono::steady_clock::duration::max(),
+                                                      std::chrono::steady_clock::duration::max()};
+    double sums[2];
+    for (vector_kernels::Isa isa : {vector_kernels::Isa::Scalar, vector_kernels::Isa::Avx2}) {
+        vector_kernels::SetIsa(isa);
+        const bool avx2 = isa == vector_kernels::Isa::Avx2;
+        for (int round = 0; round < rounds; ++round) {
+            vector_kernels::Fill(lhs.data(), 1.0, lanes);
+            start = std::chrono::steady_clock::now();
+            double sum = 0;
+            for (int i = 0; i < blocks; ++i) {
+                vector_kernels::Multiply(lhs.data(), rhs.data(), failed.data(), lanes);
+                vector_kernels::Divide(lhs.data(), rhs.data(), failed.data(), lanes);
+                sum += vector_kernels::Sum(lhs.data(), lanes) + vector_kernels::Max(lhs.data(), lanes);
+            }
+            kernels[avx2] = std::min(kernels[avx2], std::chrono::steady_clock::now() - start);
+            sums[avx2] = sum;
+        }
+    }
+    ASSERT_EQUAL(sums[0], sums[1]);
+    std::cerr << "BenchmarkBatchRecalculation: kernels over "sv << blocks << " blocks of "sv << lanes << " lanes, scalar "sv
+              << std::chrono::duration_cast<std::chrono::microseconds>(kernels[0]).count() << " us, AVX2 "sv
+              << std::chrono::duration_cast<std::chrono::microseconds>(kernels[1]).count() << " us"sv << std::endl;
+    if (vector_kernels::GetIsa() == vector_kernels::Isa::Avx2) {
+        ASSERT(kernels[1] * 4 < kernels[0] * 3);
+    }
+    vector_kernels::SetIsa(default_isa);
+}
+
+void BenchmarkRangeSum() {
+    const int rows = 16'000;
+    const int edits = 200;
+
+    // SUM обновляется приращением, а MAX после каждой правки ячейки
+    // диапазона пересчитывается целиком
+    const vector_kernels::Isa default_isa = vector_kernels::GetIsa();
+    for (std::string_view function : {"SUM"sv, "MAX"sv}) {
+        for (vector_kernels::Isa isa : {vector_kernels::Isa::Scalar, vector_kernels::Isa::Avx2}) {
+            vector_kernels::SetIsa(isa);
+            Sheet sheet;
+            for (int row = 0; row < rows; ++row) {
+                sheet.SetCell(Position{row, 0}, std::to_string(row % 100));
+            }
+            sheet.SetCell("B1"_pos, "="s + std::string(function) + "(A1:A" + std::to_string(rows) + ")");
+            sheet.GetCell("B1"_pos)->GetValue();
+
+            const auto start = std::chrono::steady_clock::now();
+            for (int edit = 0; edit < edits; ++edit) {
+                sheet.SetCell(Position{edit, 0}, std::to_string(edit % 100));
+                ASSERT(std::holds_alternative<double>(sheet.GetCell("B1"_pos)->GetValue()));
+            }
+            const auto duration = std::chrono::steady_clock::now() - start;
+
+            std::cerr << "BenchmarkRangeSum: "sv << function << ' '
+                      << (vector_kernels::GetIsa() == vector_kernels::Isa::Avx2 ? "AVX2"sv : "scalar"sv) << ' '
+                      << edits << " edits of "sv << rows << " cells in "sv
+                      << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us"sv
+                      << std::endl;
+        }
+    }
+    vector_kernels::SetIsa(default_isa);
+}
+
+void BenchmarkRangeDependents() {
+    const int rows = 16'000;
+    const int window = 10;
+
+    // скользящие суммы: B{n} = SUM(A{n}:A{n+9}), каждую ячейку A накрывают 10 диапазонов
+    Sheet sheet;
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell(Position{row, 0}, std::to_string(row % 7));
+    }
+    for (int row = 0; row + window <= rows; ++row) {
+        sheet.SetCell(Position{row, 1},
+                      "=SUM(A" + std::to_string(row + 1) + ":A" + std::to_string(row + window) + ")");
+    }
+    const auto setup = std::chrono::steady_clock::now() - start;
+
+    // запись в ячейку находит накрывающие ее формулы через индекс
+    start = std::chrono::steady_clock::now();
+    std::size_t dependents = 0;
+    for (int row = 0; row < rows; ++row) {
+        sheet.GetGraph().ForEachRangeDependent(Position{row, 0}, [&dependents](DependencyGraph::NodeId) {
+            ++dependents;
+        });
+    }
+    const auto lookups = std::chrono::steady_clock::now() - start;
+    ASSERT_EQUAL(dependents, static_cast<std::size_t>(rows - window + 1) * window);
+
+    auto us = [](auto duration) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    };
+    std::cerr << "BenchmarkRangeDependents: "sv << rows - window + 1 << " range formulas set in "sv << us(setup)
+              << " us, "sv << rows << " lookups in "sv << us(lookups) << " us, graph "sv
+              << sheet.GetStats().graph.edge_bytes << " edge bytes"sv << std::endl;
+}
+
+void BenchmarkSlidingWindows() {
+    const int rows = 16'000;
+    const int window = 30;
+
+    // SUM читает префиксные суммы столбца, MAX - каждую ячейку окна
+    for (std::string_view function : {"SUM"sv, "MAX"sv}) {
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 100));
+        }
+        for (int row = window - 1; row < rows; ++row) {
+            sheet.SetCell(Position{row, 1}, "="s + std::string(function) + "(A" + std::to_string(row - window + 2)
+                                                + ":A" + std::to_string(row + 1) + ")");
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        double total = 0;
+        for (int row = window - 1; row < rows; ++row) {
+            total += std::get<double>(sheet.GetCell(Position{row, 1})->GetValue());
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+        ASSERT(total > 0);
+
+        std::cerr << "BenchmarkSlidingWindows: "sv << rows - window + 1 << ' ' << function << " windows of "sv << window
+                  << " cells in "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count()
+                  << " us"sv << std::endl;
+    }
+}
+
+void BenchmarkEarlyCutoff() {
+    const int length = 16'000;
+    const int edits = 200;
+
+    // MAX отсекает изменения A1 ниже порога: цепочка за ним не пересчитывается.
+    // Чтение конца цепочки все равно проверяет весь ее конус, а пересчет
+    // по изменениям останавливается на MAX
+    for (bool push : {false, true}) {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "0");
+        sheet.SetCell("B1"_pos, "=MAX(A1,1000)");
+        for (int row = 1; row < length; ++row) {
+            sheet.SetCell(Position{row, 1}, "=B" + std::to_string(row) + "+1");
+        }
+        sheet.RecalculateAll(1);
+
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < edits; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            if (push) {
+                sheet.RecalculateChanged();
+            }
+            ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{length - 1, 1})->GetValue()), 1000.0 + length - 1);
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+
+        const RecalcStats stats = sheet.GetStats().recalc;
+        std::cerr << "BenchmarkEarlyCutoff: "sv << edits << (push ? " pushed"sv : " lazy"sv) << " edits over a chain of "sv
+                  << length << " in "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count()
+                  << " us, "sv << stats.recomputed << " recomputed, "sv << stats.cut_off << " cut off"sv << std::endl;
+    }
+}
+
+void BenchmarkBatchWrite() {
+    const int rows = 16'000;
+
+    // столбец чисел и два столбца формул над ним: по одной записи и одним пакетом
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        const std::string r = std::to_string(row + 1);
+        cells.emplace_back(Position{row, 0}, std::to_string(row));
+        cells.emplace_back(Position{row, 1}, "=A" + r + "*2");
+        cells.emplace_back(Position{row, 2}, row == 0 ? "=B1"s : "=C" + std::to_string(row) + "+B" + r);
+    }
+
+    for (bool batch : {false, true}) {
+        Sheet sheet;
+        const auto start = std::chrono::steady_clock::now();
+        if (batch) {
+            sheet.SetCells(cells);
+        } else {
+            for (const auto& [pos, text] : cells) {
+                sheet.SetCell(pos, text);
+            }
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell(Position{rows - 1, 2})->GetValue()), double(rows) * (rows - 1));
+
+        std::cerr << "BenchmarkBatchWrite: "sv << cells.size() << " cells "sv << (batch ? "in one batch"sv : "one by one"sv)
+                  << " in "sv << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us"sv
+                  << std::endl;
+    }
+}
+
+void BenchmarkBulkLoad() {
+    const int cols = 10;
+    // числа и формулы над соседними ячейками: нарастающие итоги сверху вниз
+    // или снизу вверх. Во втором случае ячейки приходят раньше тех, на
+    // которые ссылаются, и поячеечная проверка циклов переставляет порядок
+    // узлов почти при каждой записи
+    for (bool upwards : {false, true}) {
+        const int rows = upwards ? 600 : 16'000;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < rows; ++row) {
+            cells.emplace_back(Position{row, 0}, std::to_string(row % 100));
+            const int next = upwards ? row + 1 : row - 1;
+            for (int col = 1; col < cols; ++col) {
+                const std::string left = Position{row, col - 1}.ToString();
+                const std::string other = next >= 0 && next < rows ? Position{next, col}.ToString() : "0"s;
+                cells.emplace_back(Position{row, col}, "=" + left + "+" + other);
+            }
+        }
+
+        // лучший из нескольких чередующихся заходов, чтобы не мерить чужую нагрузку
+        const int rounds = 3;
+        std::chrono::steady_clock::duration durations[3];
+        std::fill(std::begin(durations), std::end(durations), std::chrono::steady_clock::duration::max());
+        for (int round = 0; round < rounds; ++round) {
+            for (int mode = 0; mode < 3; ++mode) {
+                Sheet sheet;
+                const auto start = std::chrono::steady_clock::now();
+                if (mode == 0) {
+                    for (const auto& [pos, text] : cells) {
+                        sheet.SetCell(pos, text);
+                    }
+                } else if (mode == 1) {
+                    sheet.SetCells(cells);
+                } else {
+                    sheet.Load(cells);
+                }
+                durations[mode] = std::min(durations[mode], std::chrono::steady_clock::now() - start);
+                ASSERT(std::holds_alternative<double>(
+                    sheet.GetCell(Position{upwards ? 0 : rows - 1, cols - 1})->GetValue()));
+            }
+        }
+
+        const std::string_view names[] = {"SetCell"sv, "SetCells"sv, "Load"sv};
+        for (int mode = 0; mode < 3; ++mode) {
+            std::cerr << "BenchmarkBulkLoad: "sv << cells.size() << " cells referencing "sv
+                      << (upwards ? "the row below"sv : "the row above"sv) << " with "sv << names[mode]
+                      << ", best of "sv << rounds << " in "sv
+                      << std::chrono::duration_cast<std::chrono::microseconds>(durations[mode]).count() << " us"sv
+                      << std::endl;
+        }
+        // пакет упорядочивает узлы один раз и не должен уступать поячеечной записи
+        ASSERT(durations[1] <= durations[0]);
+    }
+}
+
+void BenchmarkCompactCells() {
+    const int rows = 10'000;
+    const int cols = 1'000;
+
+    // 10 миллионов чисел, на которые не ссылается ни одна формула
+    Sheet sheet;
+    auto start = std::chrono::steady_clock::now();
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            sheet.SetCell(Position{row, col}, std::to_string((row + col) % 1000));
+        }
+    }
+    const auto duration = std::chrono::steady_clock::now() - start;
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.compact_cells, static_cast<std::size_t>(rows) * cols);
+    const double compact_bytes =
+        double(stats.storage_bytes + stats.cell_bytes + stats.graph.node_bytes + stats.graph.edge_bytes) / stats.cells;
+
+    // числа, на которые ссылается формула: каждое - объект Cell с узлом графа
+    const int side = 2 * TiledStorage<CellSlot>::TILE_SIZE;
+    Sheet referenced;
+    for (int row = 0; row < side; ++row) {
+        for (int col = 0; col < side; ++col) {
+            referenced.SetCell(Position{row, col}, std::to_string((row + col) % 1000));
+        }
+    }
+    referenced.SetCell(Position{side, 0}, "=SUM(A1:" + Position{side - 1, side - 1}.ToString() + ")");
+    ASSERT_EQUAL(referenced.GetStats().compact_cells, 0u);
+    referenced.ClearCell(Position{side, 0});
+    stats = referenced.GetStats();
+    const double cell_bytes =
+        double(stats.storage_bytes + stats.cell_bytes + stats.graph.node_bytes + stats.graph.edge_bytes) / stats.cells;
+
+    std::cerr << "BenchmarkCompactCells: "sv << rows * cols << " numeric cells set in "sv
+              << std::chrono::duration_cast<std::chrono::microseconds>(duration).count() << " us, "sv
+              << compact_bytes << " bytes per cell; "sv << cell_bytes << " bytes per referenced cell"sv << std::endl;
+}
+
+void BenchmarkCellMemory() {
+    const int rows = 10'000;
+    const int pairs = 20;
+    const int cells = 2 * rows * pairs;
+
+    // пары столбцов: числа и формулы, которые на них ссылаются, - у каждой
+    // ячейки объект Cell; лист заполняется, читается и удаляется целиком
+    auto measure = [](Sheet::Memory memory, const char* name) {
+        const std::size_t allocations_before = GetAllocationCount();
+        const auto start = std::chrono::steady_clock::now();
+        auto sheet = std::make_unique<Sheet>(memory);
+        for (int col = 0; col < 2 * pairs; col += 2) {
+            for (int row = 0; row < rows; ++row) {
+                sheet->SetCell(Position{row, col}, std::to_string(row));
+                sheet->SetCell(Position{row, col + 1}, "=" + Position{row, col}.ToString() + "*2");
+            }
+        }
+        sheet->RecalculateAll(1);
+        const auto filled = std::chrono::steady_clock::now();
+        ASSERT_EQUAL(sheet->GetStats().compact_cells, 0u);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{rows - 1, 1})->GetValue()), 2.0 * (rows - 1));
+        sheet.reset();
+        const auto destroyed = std::chrono::steady_clock::now();
+        const std::size_t allocations = GetAllocationCount() - allocations_before;
+
+        std::cerr << "BenchmarkCellMemory: "sv << name << ' ' << cells << " cells filled in "sv
+                  << std::chrono::duration_cast<std::chrono::microseconds>(filled - start).count()
+                  << " us, destroyed in "sv
+                  << std::chrono::duration_cast<std::chrono::microseconds>(destroyed - filled).count() << " us, "sv
+                  << double(allocations) / cells << " allocations per cell"sv << std::endl;
+    };
+
+    measure(Sheet::Memory::Pooled, "pooled");
+    measure(Sheet::Memory::Scratch, "scratch");
+}
+
+void BenchmarkFormulaParsing() {
+    // типичные для импортируемых моделей формулы
+    std::vector<std::string> formulas;
+    for (int row = 1; row <= 16'000; ++row) {
+        const std::string r = std::to_string(row);
+        formulas.push_back("A" + r + "*B" + r + "-(C" + r + "+D" + r + ")/2");
+        formulas.push_back("-E" + r + "+1.5e-2*(F" + r + "-G" + r + ")");
+    }
+
+    auto measure = [&formulas](const char* name, auto parse) {
+        std::size_t cells = 0;
+        std::size_t bytes = 0;
+        const std::size_t allocations_before = GetAllocationCount();
+        const auto start = std::chrono::steady_clock::now();
+        for (const std::string& formula : formulas) {
+            const FormulaAST ast = parse(formula);
+            cells += ast.GetCells().size();
+            bytes += ast.GetMemoryUsage();
+        }
+        const auto duration = std::chrono::steady_clock::now() - start;
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+        const std::size_t allocations = GetAllocationCount() - allocations_before;
+
+        std::cerr << "BenchmarkFormulaParsing: "sv << name << ' ' << formulas.size() << " formulas in "sv << us
+                  << " us ("sv << formulas.size() * 1'000'000 / std::max<long long>(us, 1) << " per second), "sv
+                  << double(allocations) / formulas.size() << " allocations and "sv
+                  << double(bytes) / formulas.size() << " bytes per formula"sv << std::endl;
+        return cells;
+    };
+
+    const std::size_t expected = measure("ANTLR", [](const std::string& s) { return ParseFormulaASTWithAntlr(s); });
+    ASSERT_EQUAL(measure("hand-written", [](const std::string& s) { return ParseFormulaAST(s); }), expected);
+}
 }  // namespace
 
-int main() {
+// Бенчмарки долгие и печатают время в std::cerr, поэтому запускаются только
+// с ключом --benchmarks: spreadsheet --benchmarks
+int main(int argc, char* argv[]) {
+    const bool benchmarks = argc > 1 && argv[1] == "--benchmarks"sv;
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
+    RUN_TEST(tr, TestTryGetCell);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
+    RUN_TEST(tr, TestFormulaDeepExpression);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
+    RUN_TEST(tr, TestTextToNumberConversion);
     RUN_TEST(tr, TestErrorDiv0);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintSparse);
+    RUN_TEST(tr, TestFarCell);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestSharedRelativeFormulas);
+    RUN_TEST(tr, TestBatchEvaluation);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeIndex);
+    RUN_TEST(tr, TestRangeAggregateDeltas);
+    RUN_TEST(tr, TestColumnSums);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestHubCellInvalidation);
+    RUN_TEST(tr, TestRecalculateAll);
+    RUN_TEST(tr, TestRecalculateChanged);
+    RUN_TEST(tr, TestSetCells);
+    RUN_TEST(tr, TestLoad);
+    RUN_TEST(tr, TestCompactCells);
+    RUN_TEST(tr, TestTextAsNumber);
+    RUN_TEST(tr, TestScratchSheet);
+    RUN_TEST(tr, TestLongChainEvaluation);
+    RUN_TEST(tr, TestDependencyGraphStats);
+    RUN_TEST(tr, TestRandomEditsConsistency);
 
     RUN_TEST(tr, MyFinalTest1);
     RUN_TEST(tr, MyFinalTest2);
 
+    if (!benchmarks) {
+        std::cout << std::endl << "ALL TESTS OK"sv << std::endl;
+        return 0;
+    }
+
+    if (!ALLOCATIONS_COUNTED) {
+        std::cerr << "Allocations are not counted: build with COUNT_ALLOCATIONS to check them"sv << std::endl;
+    }
+    RUN_TEST(tr, BenchmarkDeepFormulaEvaluation);
+    RUN_TEST(tr, BenchmarkNumericTextReads);
+    RUN_TEST(tr, BenchmarkErrorHeavyRecalculation);
+    RUN_TEST(tr, BenchmarkParallelRecalculation);
+    RUN_TEST(tr, BenchmarkBatchRecalculation);
+    RUN_TEST(tr, BenchmarkFormulaParsing);
+    RUN_TEST(tr, BenchmarkRangeSum);
+    RUN_TEST(tr, BenchmarkRangeDependents);
+    RUN_TEST(tr, BenchmarkSlidingWindows);
+    RUN_TEST(tr, BenchmarkEarlyCutoff);
+    RUN_TEST(tr, BenchmarkBatchWrite);
+    RUN_TEST(tr, BenchmarkBulkLoad);
+    RUN_TEST(tr, BenchmarkCompactCells);
+    RUN_TEST(tr, BenchmarkCellMemory);
+
     std::cout << std::endl << "ALL TESTS OK"sv << std::endl;
 }
\ No newline at end of file
@@ -0,0 +1,215 @@
+#include "range_index.h"
+
+#include <cmath>
+#include <utility>
+
+namespace {
+Range Union(const Range& lhs, const Range& rhs) {
+    return Range{
+        Position{std::min(lhs.first.row, rhs.first.row), std::min(lhs.first.col, rhs.first.col)},
+        Position{std::max(lhs.last.row, rhs.last.row), std::max(lhs.last.col, rhs.last.col)},
+    };
+}
+
+// первый угол правее и ниже второго: такой диапазон ничего не накрывает
+constexpr Range EMPTY_RANGE{Position{1, 1}, Position{0, 0}};
+}  // namespace
+
+RangeIndex::Tree::Tree(std::vector<Entry> entries)
+    : entries_(std::move(entries))
+{
+    const std::size_t count = entries_.size();
+    if (count == 0) {
+        return;
+    }
+
+    // Сортируем записи по центру по столбцам, режем на вертикальные полосы
+    // по slices листьев и внутри полосы сортируем по центру по строкам:
+    // тогда FANOUT записей подряд лежат рядом на листе
+    const std::size_t leaves = (count + FANOUT - 1) / FANOUT;
+    const std::size_t slices = static_cast<std::size_t>(std::ceil(std::sqrt(static_cast<double>(leaves))));
+    const std::size_t slice_size = slices * FANOUT;
+
+    std::sort(entries_.begin(), entries_.end(), [](const Entry& lhs, const Entry& rhs) {
+        return lhs.range.first.col + lhs.range.last.col < rhs.range.first.col + rhs.range.last.col;
+    });
+    for (std::size_t begin = 0; begin < count; begin += slice_size) {
+        const std::size_t end = std::min(count, begin + slice_size);
+        std::sort(entries_.begin() + begin, entries_.begin() + end, [](const Entry& lhs, const Entry& rhs) {
+            return lhs.range.first.row + lhs.range.last.row < rhs.range.first.row + rhs.range.last.row;
+        });
+    }
+
+    std::vector<Range> boxes;
+    boxes.reserve(leaves);
+    for (std::size_t begin = 0; begin < count; begin += FANOUT) {
+        Range box = entries_[begin].range;
+        for (std::size_t i = begin + 1; i < std::min(count, begin + FANOUT); ++i) {
+            box = Union(box, entries_[i].range);
+        }
+        boxes.push_back(box);
+    }
+    levels_.push_back(std::move(boxes));
+
+    while (levels_.back().size() > FANOUT) {
+        const std::vector<Range>& children = levels_.back();
+        std::vector<Range> parents;
+        parents.reserve((children.size() + FANOUT - 1) / FANOUT);
+        for (std::size_t begin = 0; begin < children.size(); begin += FANOUT) {
+            Range box = children[begin];
+            for (std::size_t i = begin + 1; i < std::min(children.size(), begin + FANOUT); ++i) {
+                box = Union(box, children[i]);
+            }
+            parents.push_back(box);
+        }
+        levels_.push_back(std::move(parents));
+    }
+}
+
+bool RangeIndex::Tree::Erase(const Range& range, Id id) {
+    if (entries_.empty()) {
+        return false;
+    }
+
+    const std::vector<Range>& top = levels_.back();
+    for (std::size_t i = 0; i < top.size(); ++i) {
+        if (Contains(top[i], range) && EraseFrom(levels_.size() - 1, i, range, id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RangeIndex::Tree::EraseFrom(std::size_t level, std::size_t index, const Range& range, Id id) {
+    if (level == 0) {
+        const std::size_t end = std::min(entries_.size(), (index + 1) * FANOUT);
+        for (std::size_t i = index * FANOUT; i < end; ++i) {
+            if (entries_[i].id == id && entries_[i].range == range) {
+                // ограничивающие прямоугольники не сужаем: поиск просто не найдет запись
+                entries_[i] = Entry{EMPTY_RANGE, ERASED};
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const std::vector<Range>& children = levels_[level - 1];
+    const std::size_t end = std::min(children.size(), (index + 1) * FANOUT);
+    for (std::size_t i = index * FANOUT; i < end; ++i) {
+        if (Contains(children[i], range) && EraseFrom(level - 1, i, range, id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::size_t RangeIndex::Tree::MoveLiveTo(std::vector<Entry>& out) {
+    std::size_t erased = 0;
+    for (const Entry& entry : entries_) {
+        if (entry.id == ERASED) {
+            ++erased;
+        } else {
+            out.push_back(entry);
+        }
+    }
+
+    entries_.clear();
+    entries_.shrink_to_fit();
+    levels_.clear();
+    return erased;
+}
+
+std::size_t RangeIndex::Tree::GetMemoryUsage() const {
+    std::size_t bytes = entries_.capacity() * sizeof(Entry) + levels_.capacity() * sizeof(std::vector<Range>);
+    for (const std::vector<Range>& level : levels_) {
+        bytes += level.capacity() * sizeof(Range);
+    }
+    return bytes;
+}
+
+void RangeIndex::Insert(const Range& range, Id id) {
+    buffer_.push_back({range, id});
+    ++size_;
+    if (buffer_.size() < BUFFER_SIZE) {
+        return;
+    }
+
+    // буфер и занятые деревья младших размеров подряд вмещаются в первое свободное дерево
+    std::vector<Entry> merged;
+    merged.swap(buffer_);
+    std::size_t level = 0;
+    for (; level < trees_.size() && !trees_[level].IsEmpty(); ++level) {
+        erased_ -= trees_[level].MoveLiveTo(merged);
+    }
+    if (level == trees_.size()) {
+        trees_.emplace_back();
+    }
+    trees_[level] = Tree(std::move(merged));
+}
+
+void RangeIndex::Erase(const Range& range, Id id) {
+    for (std::size_t i = 0; i < buffer_.size(); ++i) {
+        if (buffer_[i].id == id && buffer_[i].range == range) {
+            buffer_[i] = buffer_.back();
+            buffer_.pop_back();
+            --size_;
+            return;
+        }
+    }
+
+    for (Tree& tree : trees_) {
+        if (tree.Erase(range, id)) {
+            --size_;
+            ++erased_;
+            // удаленные записи замедляют поиск, пока не выброшены
+            if (erased_ > size_) {
+                Rebuild();
+            }
+            return;
+        }
+    }
+}
+
+void RangeIndex::Rebuild() {
+    std::vector<Entry> entries;
+    entries.reserve(size_);
+    entries.insert(entries.end(), buffer_.begin(), buffer_.end());
+    for (Tree& tree : trees_) {
+        tree.MoveLiveTo(entries);
+    }
+    buffer_.clear();
+    trees_.clear();
+    erased_ = 0;
+
+    if (entries.size() < BUFFER_SIZE) {
+        buffer_ = std::move(entries);
+        return;
+    }
+
+    std::size_t level = 0;
+    while ((BUFFER_SIZE << level) < entries.size()) {
+        ++level;
+    }
+    trees_.resize(level + 1);
+    trees_[level] = Tree(std::move(entries));
+}
+
+bool RangeIndex::AnyContaining(Position pos) const {
+    bool found = false;
+    ForEachContaining(pos, [&found](Id) {
+        found = true;
+    });
+    return found;
+}
+
+std::size_t RangeIndex::Size() const {
+    return size_;
+}
+
+std::size_t RangeIndex::GetMemoryUsage() const {
+    std::size_t bytes = buffer_.capacity() * sizeof(Entry) + trees_.capacity() * sizeof(Tree);
+    for (const Tree& tree : trees_) {
+        bytes += tree.GetMemoryUsage();
+    }
+    return bytes;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Пространственный индекс прямоугольных диапазонов: по позиции ячейки
+// находит все записи, диапазоны которых ее накрывают. Память - O(числа
+// записей), независимо от площади диапазонов.
+// Записи хранятся в нескольких неизменяемых упакованных R-деревьях
+// размеров BUFFER_SIZE * 2^i и в коротком буфере новых записей.
+// Заполненный буфер сливается с деревьями меньших размеров в одно новое
+// дерево, как при прибавлении единицы к двоичному числу, поэтому вставка
+// стоит O(log^2 n) амортизированно, а поиск - O(log^2 n + k). Удаленные
+// записи помечаются и выбрасываются при слиянии; когда их набирается
+// больше живых, индекс перестраивается целиком.
+// Поиск не меняет индекс, поэтому его можно вызывать из нескольких потоков.
+class RangeIndex {
+public:
+    using Id = std::uint32_t;
+
+    void Insert(const Range& range, Id id);
+    // Удаляет одну запись (range, id), если она есть
+    void Erase(const Range& range, Id id);
+
+    // f(Id) для каждой записи, диапазон которой накрывает pos; повторяющиеся
+    // записи передаются столько раз, сколько были вставлены
+    template <typename F>
+    void ForEachContaining(Position pos, F&& f) const {
+        for (const Entry& entry : buffer_) {
+            if (Contains(entry.range, pos)) {
+                f(entry.id);
+            }
+        }
+        for (const Tree& tree : trees_) {
+            tree.ForEachContaining(pos, f);
+        }
+    }
+
+    bool AnyContaining(Position pos) const;
+
+    std::size_t Size() const;
+    // память вне самого объекта
+    std::size_t GetMemoryUsage() const;
+
+private:
+    static constexpr std::size_t BUFFER_SIZE = 32;
+    static constexpr Id ERASED = std::numeric_limits<Id>::max();
+
+    struct Entry {
+        Range range;
+        Id id;
+    };
+
+    static bool Contains(const Range& box, Position pos) {
+        return box.first.row <= pos.row && pos.row <= box.last.row
+            && box.first.col <= pos.col && pos.col <= box.last.col;
+    }
+
+    static bool Contains(const Range& box, const Range& range) {
+        return Contains(box, range.first) && Contains(box, range.last);
+    }
+
+    // Упакованное R-дерево (Sort-Tile-Recursive): листья - группы по FANOUT
+    // записей, соседних на листе, узел уровня k ограничивает FANOUT узлов
+    // уровня k - 1. Дерево строится один раз; удаление только помечает запись
+    class Tree {
+    public:
+        static constexpr std::size_t FANOUT = 16;
+
+        Tree() = default;
+        explicit Tree(std::vector<Entry> entries);
+
+        bool IsEmpty() const {
+            return entries_.empty();
+        }
+
+        template <typename F>
+        void ForEachContaining(Position pos, F& f) const {
+            if (entries_.empty()) {
+                return;
+            }
+
+            const std::vector<Range>& top = levels_.back();
+            for (std::size_t i = 0; i < top.size(); ++i) {
+                if (Contains(top[i], pos)) {
+                    Visit(levels_.size() - 1, i, pos, f);
+                }
+            }
+        }
+
+        // помечает запись удаленной; возвращает false, если ее нет
+        bool Erase(const Range& range, Id id);
+        // переносит неудаленные записи в out и опустошает дерево;
+        // возвращает число выброшенных удаленных записей
+        std::size_t MoveLiveTo(std::vector<Entry>& out);
+
+        std::size_t GetMemoryUsage() const;
+
+    private:
+        template <typename F>
+        void Visit(std::size_t level, std::size_t index, Position pos, F& f) const {
+            if (level == 0) {
+                const std::size_t end = std::min(entries_.size(), (index + 1) * FANOUT);
+                for (std::size_t i = index * FANOUT; i < end; ++i) {
+                    // у удаленной записи вырожденный диапазон, она ничего не накрывает
+                    if (Contains(entries_[i].range, pos)) {
+                        f(entries_[i].id);
+                    }
+                }
+                return;
+            }
+
+            const std::vector<Range>& children = levels_[level - 1];
+            const std::size_t end = std::min(children.size(), (index + 1) * FANOUT);
+            for (std::size_t i = index * FANOUT; i < end; ++i) {
+                if (Contains(children[i], pos)) {
+                    Visit(level - 1, i, pos, f);
+                }
+            }
+        }
+
+        bool EraseFrom(std::size_t level, std::size_t index, const Range& range, Id id);
+
+        std::vector<Entry> entries_;
+        // levels_[0] - ограничивающие прямоугольники листьев, levels_.back() -
+        // верхний уровень, не больше FANOUT прямоугольников
+        std::vector<std::vector<Range>> levels_;
+    };
+
+    // собирает все живые записи в одно дерево
+    void Rebuild();
+
+    std::vector<Entry> buffer_;
+    // trees_[i] пусто или хранит не больше BUFFER_SIZE * 2^i записей
+    std::vector<Tree> trees_;
+    std::size_t size_ = 0;    // живые записи
+    std::size_t erased_ = 0;  // помеченные удаленными записи деревьев
+};
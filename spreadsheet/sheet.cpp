@@ -2,88 +2,516 @@
 
 #include "cell.h"
 #include "common.h"
+#include "work_stealing_pool.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <optional>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
-
-void Sheet::SetCell(Position pos, std::string text) {
+namespace {
+void ValidatePosition(Position pos) {
     if (!pos.IsValid()) {
         std::ostringstream out;
         out << '(' << pos.row << ", "s << pos.col << ')';
         throw InvalidPositionException("invalid position: "s + out.str());
     }
+}
+
+// вклад ячейки в префиксные суммы ее столбца (см. ColumnSums)
+ColumnSums::Totals ToTotals(const std::optional<Cell::AggregateInput>& input) {
+    if (!input) {
+        return ColumnSums::Totals{0, 0, 1};
+    }
+    if (!input->is_number) {
+        return ColumnSums::Totals{};
+    }
+    return ColumnSums::Totals{input->value, 1, 0};
+}
+
+// Проверяет позиции и разбирает тексты пакета записей (см. Sheet::SetCells).
+// Результат упорядочен по позициям, по одной записи на ячейку
+std::vector<std::pair<Position, Cell::Content>> ParseBatch(Sheet& sheet,
+                                                           std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells) {
+        ValidatePosition(pos);
+    }
+    // из нескольких записей в ячейку действует последняя
+    std::stable_sort(cells.begin(), cells.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    // Формулы, которые отличаются только ссылками, сдвинутыми вместе с
+    // ячейкой (столбец C2=A2*B2, C3=A3*B3, ...), разбираются один раз
+    struct Parsed {
+        std::shared_ptr<const SharedFormula> formula;
+        Position shift;
+        Position pos;
+    };
+    std::unordered_map<std::string, Parsed> parsed;
+    std::vector<std::pair<Position, Cell::Content>> contents;
+    contents.reserve(cells.size());
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        auto& [pos, text] = cells[i];
+        if (i + 1 < cells.size() && cells[i + 1].first == pos) {
+            continue;
+        }
+
+        std::optional<std::string> shape;
+        if (text.size() > 1 && text.front() == FORMULA_SIGN) {
+            shape = FormulaCache::GetTextShape(std::string_view(text).substr(1), pos);
+        }
+
+        Cell::Content content;
+        if (auto it = shape ? parsed.find(*shape) : parsed.end(); it != parsed.end()) {
+            const Parsed& same = it->second;
+            content.formula = same.formula;
+            content.shift = Position{same.shift.row + pos.row - same.pos.row, same.shift.col + pos.col - same.pos.col};
+        } else {
+            content = Cell::Parse(sheet, pos, std::move(text));
+            if (shape) {
+                parsed.emplace(std::move(*shape), Parsed{content.formula, content.shift, pos});
+            }
+        }
+        contents.emplace_back(pos, std::move(content));
+    }
+    return contents;
+}
+
+std::unique_ptr<std::pmr::memory_resource> MakeCellMemory(Sheet::Memory memory) {
+    if (memory == Sheet::Memory::Scratch) {
+        return std::make_unique<std::pmr::monotonic_buffer_resource>();
+    }
+    // лист пишется из одного потока, синхронизация пулу не нужна
+    return std::make_unique<std::pmr::unsynchronized_pool_resource>();
+}
+}  // namespace
+
+// Ячейка, которая хранится прямо в слоте, для чтения через CellInterface (см.
+// TryGetCell). Слот не копируется, а читается при каждом вызове, поэтому
+// представление видит и последующие записи в ячейку, в том числе свой Set
+class Sheet::SlotView final : public CellInterface {
+public:
+    SlotView(Sheet& sheet, Position pos)
+        : sheet_(sheet)
+        , pos_(pos) {
+    }
+
+    Value GetValue() const override {
+        return GetSlot().GetValue();
+    }
+
+    std::string GetText() const override {
+        return GetSlot().GetText();
+    }
+
+    void Set(std::string text) override {
+        sheet_.SetCell(pos_, std::move(text));
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        const Cell* cell = GetSlot().GetCell();
+        return cell ? cell->GetReferencedCells() : std::vector<Position>{};
+    }
+
+    bool IsEmpty() const override {
+        return GetSlot().IsEmpty();
+    }
+
+    std::optional<double> GetTextAsNumber() const override {
+        const Cell* cell = GetSlot().GetCell();
+        return cell ? cell->GetTextAsNumber() : std::nullopt;
+    }
 
-    if (pos.row + 1 > static_cast<int>(data_.size())) {
-        data_.resize(pos.row + 1);
+private:
+    const CellSlot& GetSlot() const {
+        static const CellSlot empty;
+        const CellSlot* slot = sheet_.data_.Find(pos_);
+        return slot ? *slot : empty;
     }
 
-    if (pos.col + 1 > static_cast<int>(data_.at(pos.row).size())) {
-        data_.at(pos.row).resize(pos.col + 1);
+    Sheet& sheet_;
+    const Position pos_;
+};
+
+Sheet::Sheet(Memory memory)
+    : cell_memory_(MakeCellMemory(memory))
+    , graph_([this](const Range& range, FunctionRef<void(DependencyGraph::NodeId)> f) {
+        // ячейки, хранящиеся прямо в слотах, не в графе: на них не ссылается ни одна формула
+        data_.ForEachInRange(range.first, range.last, [f](Position, const CellSlot& slot) {
+            if (const Cell* cell = slot.GetCell()) {
+                f(cell->GetNode());
+            }
+        });
+    })
+{
+}
+
+Sheet::~Sheet() {}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    ValidatePosition(pos);
+
+    const bool in_ranges = graph_.HasRangeDependents(pos);
+    const bool indexed_column = column_sums_.HasColumn(pos.col);
+    if (const CellSlot* slot = data_.Find(pos); (!slot || !slot->GetCell()) && !in_ranges) {
+        // на ячейку не ссылается ни одна формула: если в ней не формула,
+        // она хранится прямо в слоте, без объекта Cell
+        if (CellSlot compact = CellSlot::FromText(text)) {
+            if (indexed_column) {
+                column_sums_.Set(pos.col, pos.row, ToTotals(compact.GetAggregateInput()));
+            }
+            data_.Set(pos, std::move(compact));
+            ++epoch_;
+            return;
+        }
     }
 
-    // сохраним прежнюю ячейку, потому что если установка нового значения окажется
-    // успешной (не вылетит FormulaException или CircularDependencyException), то
-    // надо будет сходить по детям прежней ячейки и разорвать зависимость прежней ячейки от ее детей
-    // чтобы однажды дети не обнулили кэш раньше зависящей от них ячейки
-    auto old_cell = std::move(data_.at(pos.row).at(pos.col));
+    Cell* cell = PromoteCell(pos);
+    const bool is_new_cell = cell == nullptr;
+    if (is_new_cell) {
+        // от новой ячейки зависят только формулы, чей диапазон ее накрывает;
+        // если таких нет, ставим ее в конец порядка: тогда все ее ссылки
+        // сразу согласованы с ним
+        data_.Set(pos, CellSlot(NewCell(pos, in_ranges)));
+        cell = data_.Find(pos)->GetCell();
+    }
 
-    data_.at(pos.row).at(pos.col) = std::make_unique<Cell>(*this);
+    // вклад ячейки в SUM/COUNT/AVERAGE накрывающих ее диапазонов до записи
+    std::optional<Cell::AggregateInput> before;
+    if (in_ranges || indexed_column) {
+        before = cell->GetAggregateInput();
+    }
 
     try { // попробуем записать формулу в ячейку
         // бросит FormulaException при синтаксически некорректной формуле
-        // или CircularDependencyException если text несет в таблицу циклы
-        data_.at(pos.row).at(pos.col)->Set(text);
+        // или CircularDependencyException если text несет в таблицу циклы;
+        // в обоих случаях ячейка и ее зависимости остаются прежними
+        cell->Set(std::move(text));
+    } catch (...) {
+        if (is_new_cell) {
+            RemoveCell(pos);
+        }
 
-        if (old_cell) {
-            // разрываем зависимость родителя от его детей; если это не сделать,
-            // у детей в parents будут указатели на погибших родителей
-            // если в old_cell был текст, ничего не произойдет, т.к. детей не было
-            static_cast<Cell*>(old_cell.get())->DeleteThisFromChildren();
+        throw;
+    }
 
-            // если на прежнюю ячейку кто-то ссылался (родители), надо их в новую ячейку
-            // которая пришла на эту позицию на замену прежней, перенести
-            auto& actual_parents = static_cast<Cell*>(GetCell(pos))->GetParentSet();
-            auto& previous_parents = static_cast<Cell*>(old_cell.get())->GetParentSet();
-            actual_parents = previous_parents;
+    // зависимые ячейки не обходим: они сравнят эпоху изменения этой ячейки
+    // с эпохой своего кэша при следующем чтении
+    cell->MarkChanged(++epoch_);
+    NoteChanged(pos);
+
+    // исключение - SUM/COUNT/AVERAGE от диапазонов: они обновляют значение
+    // приращением, не перечитывая весь диапазон
+    if (in_ranges || indexed_column) {
+        const std::optional<Cell::AggregateInput> after = cell->GetAggregateInput();
+        if (indexed_column) {
+            column_sums_.Set(pos.col, pos.row, ToTotals(after));
         }
-        
-        // создаем новую зависимость родителя от детей
-        // если text не формула, ничего не произойдет, т.к. детей нет
-        static_cast<Cell*>(GetCell(pos))->AddThisToChildren();
+        graph_.ForEachRangeDependent(pos, [&](DependencyGraph::NodeId node) {
+            graph_.GetCell(node)->ApplyRangeDelta(before, after, epoch_);
+        });
+    }
+}
 
-    } catch (const CircularDependencyException& ex) {
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    struct Write {
+        Position pos;
+        Cell* cell = nullptr;
+        bool created = false;
+        Cell::Content content;  // новое содержимое, после замены - прежнее
+        std::optional<Cell::AggregateInput> before;
+    };
+    // Как и в SetCell, ячейка без формулы, на которую не ссылается ни одна
+    // формула, пишется прямо в слот. Если на нее сошлется формула пакета,
+    // она станет Cell при привязке ссылок
+    struct SlotWrite {
+        Position pos;
+        CellSlot slot;  // новое содержимое, после записи - прежнее
+    };
+    std::vector<std::pair<Position, Cell::Content>> contents = ParseBatch(*this, std::move(cells));
+    std::vector<Write> writes;
+    std::vector<SlotWrite> slot_writes;
+    writes.reserve(contents.size());
+    for (auto& [pos, content] : contents) {
+        if (!content.formula && !FindCell(pos) && !graph_.HasRangeDependents(pos)) {
+            slot_writes.push_back({pos, CellSlot::FromText(content.text)});
+        } else {
+            writes.push_back({pos, nullptr, false, std::move(content), std::nullopt});
+        }
+    }
 
-        // если оказалось, что формула несет циклы, откатим все назад
-        data_.at(pos.row).at(pos.col) = std::move(old_cell);
+    // вклад ячейки в префиксные суммы столбца по ее текущему содержимому
+    auto totals = [this](Position pos) {
+        const CellSlot* slot = data_.Find(pos);
+        return slot ? ToTotals(slot->GetAggregateInput()) : ColumnSums::Totals{};
+    };
 
-        // и перевыбросим
-        throw;
+    // Отвязываем от графа все записываемые ячейки и только потом привязываем
+    // их с новым содержимым: тогда ссылки, которые пакет убирает, не
+    // участвуют в проверке циклов
+    for (Write& write : writes) {
+        write.cell = PromoteCell(write.pos);
+        const bool in_ranges = graph_.HasRangeDependents(write.pos);
+        if (!write.cell) {
+            data_.Set(write.pos, CellSlot(NewCell(write.pos, in_ranges)));
+            write.cell = data_.Find(write.pos)->GetCell();
+            write.created = true;
+        }
+        if (in_ranges || column_sums_.HasColumn(write.pos.col)) {
+            write.before = write.cell->GetAggregateInput();
+        }
+        write.cell->DeleteThisFromChildren();
+    }
+    for (Write& write : writes) {
+        write.content = write.cell->Exchange(std::move(write.content));
+    }
+    for (SlotWrite& write : slot_writes) {
+        CellSlot previous = data_.Take(write.pos);
+        data_.Set(write.pos, std::move(write.slot));
+        write.slot = std::move(previous);
     }
 
-    static_cast<Cell*>(GetCell(pos))->InvalidateCache();
+    // Ссылки всего пакета добавляются в граф без проверок, а потом порядок
+    // узлов восстанавливается одним проходом по затронутой его части (см.
+    // DependencyGraph::RestoreOrder), который заодно находит циклы
+    std::vector<Position> created_refs;
+    std::vector<DependencyGraph::NodeId> dependents;
+    dependents.reserve(writes.size());
+    for (Write& write : writes) {
+        for (const Position& ref : write.cell->GetReferencedCells()) {
+            if (!TryGetCell(ref)) {
+                CreateEmptyCell(ref);
+                created_refs.push_back(ref);
+            }
+        }
+        write.cell->AddThisToChildren();
+        dependents.push_back(write.cell->GetNode());
+    }
+
+    std::vector<DependencyGraph::NodeId> cyclic = graph_.RestoreOrder(dependents);
+    if (!cyclic.empty()) {
+        // цикл проходит через новую ссылку, то есть через записанную ячейку
+        std::sort(cyclic.begin(), cyclic.end());
+        const auto on_cycle = std::find_if(writes.begin(), writes.end(), [&cyclic](const Write& write) {
+            return std::binary_search(cyclic.begin(), cyclic.end(), write.cell->GetNode());
+        });
+        assert(on_cycle != writes.end());
+        const std::string as_text = on_cycle->cell->GetText().substr(1);
+
+        // Возвращаем прежние ссылки и содержимое. Порядок узлов при цикле не
+        // менялся, поэтому с прежними ссылками он согласован
+        for (Write& write : writes) {
+            write.cell->DeleteThisFromChildren();
+        }
+        for (Write& write : writes) {
+            write.cell->Exchange(std::move(write.content));
+        }
+        for (Write& write : writes) {
+            write.cell->AddThisToChildren();
+        }
+        for (auto it = created_refs.rbegin(); it != created_refs.rend(); ++it) {
+            RemoveCell(*it);
+        }
+        for (SlotWrite& write : slot_writes) {
+            // формулы пакета могли перевести ячейку в Cell, но ссылок на нее уже нет
+            RemoveCell(write.pos);
+            data_.Set(write.pos, std::move(write.slot));
+            if (column_sums_.HasColumn(write.pos.col)) {
+                column_sums_.Set(write.pos.col, write.pos.row, totals(write.pos));
+            }
+        }
+
+        // Кэш ячеек могли прочитать с новым содержимым (например, при сборе
+        // префиксных сумм), поэтому восстановленные ячейки считаются
+        // измененными: зависимые пересчитаются и получат прежние значения
+        ++epoch_;
+        for (Write& write : writes) {
+            if (write.created) {
+                RemoveCell(write.pos);
+            } else {
+                write.cell->MarkChanged(epoch_);
+                NoteChanged(write.pos);
+            }
+            if (column_sums_.HasColumn(write.pos.col)) {
+                column_sums_.Set(write.pos.col, write.pos.row, totals(write.pos));
+            }
+        }
+        throw CircularDependencyException("Have circular dependicies: "s + as_text);
+    }
+
+    // весь пакет - одно изменение листа
+    ++epoch_;
+    for (Write& write : writes) {
+        write.cell->MarkChanged(epoch_);
+        NoteChanged(write.pos);
+    }
+    for (Write& write : writes) {
+        const bool indexed_column = column_sums_.HasColumn(write.pos.col);
+        if (!indexed_column && !graph_.HasRangeDependents(write.pos)) {
+            continue;
+        }
+
+        // формулы, которые пакет добавил, еще не ведут сумм, и для них
+        // before не важен
+        const std::optional<Cell::AggregateInput> after = write.cell->GetAggregateInput();
+        if (indexed_column) {
+            column_sums_.Set(write.pos.col, write.pos.row, ToTotals(after));
+        }
+        graph_.ForEachRangeDependent(write.pos, [&](DependencyGraph::NodeId node) {
+            graph_.GetCell(node)->ApplyRangeDelta(write.before, after, epoch_);
+        });
+    }
+    // диапазоны, которые накрывают ячейки в слотах, - только у формул пакета
+    for (const SlotWrite& write : slot_writes) {
+        if (column_sums_.HasColumn(write.pos.col)) {
+            column_sums_.Set(write.pos.col, write.pos.row, totals(write.pos));
+        }
+    }
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if (!pos.IsValid()) {
-        std::ostringstream out;
-        out << '(' << pos.row << ", "s << pos.col << ')';
-        throw InvalidPositionException("invalid position: "s + out.str());
+void Sheet::Load(std::vector<std::pair<Position, std::string>> cells) {
+    if (data_.GetTileCount() > 0) {
+        throw std::logic_error("Load needs an empty sheet");
+    }
+    std::vector<std::pair<Position, Cell::Content>> contents = ParseBatch(*this, std::move(cells));
+
+    // Ячейки и пустые ячейки для ссылок ставятся без проверок, потом все
+    // ссылки добавляются в граф одним проходом, и порядок узлов строится
+    // заново. Ячейки без формул ставятся прямо в слоты; те из них, на которые
+    // ссылаются формулы, получают объекты Cell при добавлении ссылок
+    std::vector<Cell*> loaded;
+    for (auto& [pos, content] : contents) {
+        if (CellSlot compact = content.formula ? CellSlot() : CellSlot::FromText(content.text)) {
+            data_.Set(pos, std::move(compact));
+            continue;
+        }
+        data_.Set(pos, CellSlot(NewCell(pos, false)));
+        loaded.push_back(data_.Find(pos)->GetCell());
+        loaded.back()->Exchange(std::move(content));
+    }
+    contents = {};
+    for (const Cell* cell : loaded) {
+        for (const Position& ref : cell->GetReferencedCells()) {
+            if (!TryGetCell(ref)) {
+                CreateEmptyCell(ref);
+            }
+        }
+    }
+    for (Cell* cell : loaded) {
+        cell->AddThisToChildren();
     }
 
+    const std::vector<DependencyGraph::NodeId> cyclic = graph_.RebuildOrder();
+    if (!cyclic.empty()) {
+        std::vector<Position> positions;
+        for (DependencyGraph::NodeId node : cyclic) {
+            positions.push_back(graph_.GetPosition(node));
+        }
+        std::sort(positions.begin(), positions.end());
+        std::string message = "Have circular dependicies:"s;
+        for (const Position& pos : positions) {
+            message += ' ' + pos.ToString();
+        }
+
+        // лист остается пустым
+        for (Cell* cell : loaded) {
+            cell->DeleteThisFromChildren();
+        }
+        std::vector<Position> all;
+        data_.ForEach([&all](Position pos, const CellSlot&) {
+            all.push_back(pos);
+        });
+        for (const Position& pos : all) {
+            RemoveCell(pos);
+        }
+        throw CircularDependencyException(message);
+    }
+
+    // Формулы еще не вычислены; RecalculateChanged пересчитает лист целиком
+    ++epoch_;
+    for (Cell* cell : loaded) {
+        cell->MarkChanged(epoch_);
+    }
+    changed_cells_ = {};
+    changed_overflow_ = true;
+}
+
+CellPtr Sheet::NewCell(Position pos, bool first) {
+    void* memory = cell_memory_->allocate(sizeof(Cell), alignof(Cell));
     try {
-        return data_.at(pos.row).at(pos.col).get();
-    } catch (const std::out_of_range& ex) {
+        return CellPtr(new (memory) Cell(*this, pos, first));
+    } catch (...) {
+        cell_memory_->deallocate(memory, sizeof(Cell), alignof(Cell));
+        throw;
+    }
+}
+
+void Sheet::FreeCell(Cell* cell) {
+    // в режиме Scratch ничего не делает: память вернется вместе с листом
+    cell_memory_->deallocate(cell, sizeof(Cell), alignof(Cell));
+}
+
+Cell& Sheet::CreateEmptyCell(Position pos) {
+    data_.Set(pos, CellSlot(NewCell(pos, true)));
+    return *data_.Find(pos)->GetCell();
+}
+
+Cell& Sheet::Promote(Position pos) {
+    const std::string text = data_.Find(pos)->GetText();
+    // ячейка без формулы ни от чего не зависит и ставится в начало порядка;
+    // содержимое прежнее, поэтому эпоха изменения не сдвигается
+    CellPtr cell = NewCell(pos, true);
+    cell->Exchange(Cell::Content{text, nullptr, Position{}});
+    Cell& result = *cell;
+    data_.Set(pos, CellSlot(std::move(cell)));
+    return result;
+}
 
+Cell* Sheet::FindCell(Position pos) const {
+    const CellSlot* slot = pos.IsValid() ? data_.Find(pos) : nullptr;
+    return slot ? slot->GetCell() : nullptr;
+}
+
+Cell* Sheet::PromoteCell(Position pos) {
+    const CellSlot* slot = pos.IsValid() ? data_.Find(pos) : nullptr;
+    if (!slot || !*slot) {
+        return nullptr;
     }
+    if (Cell* cell = slot->GetCell()) {
+        return cell;
+    }
+    return &Promote(pos);
+}
 
-    return nullptr;    
+void Sheet::PromoteRange(const Range& range) {
+    std::vector<Position> compact;
+    data_.ForEachInRange(range.first, range.last, [&compact](Position pos, const CellSlot& slot) {
+        if (!slot.GetCell()) {
+            compact.push_back(pos);
+        }
+    });
+    for (Position pos : compact) {
+        Promote(pos);
+    }
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    ValidatePosition(pos);
+
+    return TryGetCell(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
@@ -92,113 +520,400 @@ CellInterface* Sheet::GetCell(Position pos) {
            );
 }
 
-void Sheet::ClearCell(Position pos) {
+const CellInterface* Sheet::TryGetCell(Position pos) const {
     if (!pos.IsValid()) {
-        std::ostringstream out;
-        out << '(' << pos.row << ", "s << pos.col << ')';
-        throw InvalidPositionException("invalid position: "s + out.str());
+        return nullptr;
     }
-    
-    try {
-        data_.at(pos.row).at(pos.col).release();
-    } catch (const std::out_of_range& ex) { }
-}
 
-Size Sheet::GetPrintableSize() const {
-    Size size;
+    // невыделенный тайл или пустой слот - это просто отсутствующая ячейка
+    const CellSlot* slot = data_.Find(pos);
+    if (!slot || !*slot) {
+        return nullptr;
+    }
+    if (Cell* cell = slot->GetCell()) {
+        return cell;
+    }
 
-    for (int row_counter = 0; row_counter < static_cast<int>(data_.size()); ++row_counter) {
-        const auto& row = data_.at(row_counter);
-        for (int col_counter = 0; col_counter < static_cast<int>(row.size()); ++col_counter) {
-            
-            const std::unique_ptr<CellInterface>& cell = row.at(col_counter);
+    // Формулы читают только ячейки, на которые ссылаются, а они всегда -
+    // объекты Cell, поэтому пересчет представлений не использует
+    std::lock_guard lock(slot_views_mutex_);
+    auto& view = slot_views_[pos.row * Position::MAX_COLS + pos.col];
+    if (!view) {
+        view = std::make_unique<SlotView>(const_cast<Sheet&>(*this), pos);
+    }
+    return view.get();
+}
 
-            if (cell && !static_cast<Cell*>(cell.get())->IsEmpty()) {
-                if (size.rows < row_counter + 1) {
-                    size.rows = row_counter + 1;
-                }
+bool Sheet::ReadColumnNumbers(Position first, std::size_t count, double* values) const {
+    // ячейки, которых нет, читаются нулем
+    std::fill(values, values + count, VALUE_IF_EMPTY_CELL);
+    const Position last{first.row + static_cast<int>(count) - 1, first.col};
+    bool read = true;
+    data_.ForEachInRange(first, last, [&](Position pos, const CellSlot& slot) {
+        std::optional<double> number;
+        if (const Cell* cell = slot.GetCell()) {
+            number = cell->GetActualNumber();
+        } else if (slot.GetTag() == CellSlot::Tag::Number) {
+            // субнормальные числа ссылка читает как текст, с ошибкой (см. Cell::SetText)
+            number = slot.GetAggregateInput()->value;
+            number = std::fpclassify(*number) == FP_SUBNORMAL ? std::nullopt : number;
+        }
 
-                if (size.cols < col_counter + 1) {
-                    size.cols = col_counter + 1;
-                }
-            }
+        if (number) {
+            values[pos.row - first.row] = *number;
+        } else {
+            read = false;
         }
+    });
+    return read;
+}
+
+CellInterface* Sheet::TryGetCell(Position pos) {
+    return const_cast<CellInterface*>(
+              static_cast<const Sheet&>(*this).TryGetCell(pos)
+           );
+}
+
+void Sheet::ClearCell(Position pos) {
+    ValidatePosition(pos);
+
+    const CellSlot* slot = data_.Find(pos);
+    if (!slot || !*slot) {
+        return;
+    }
+
+    Cell* cell = slot->GetCell();
+    if (cell && cell->HasDependents()) {
+        // на ячейку ссылаются формулы, поэтому оставляем ее в таблице пустой,
+        // чтобы не потерять зависимости и сбросить кэш зависимых ячеек
+        SetCell(pos, ""s);
+        return;
     }
 
+    if (cell) {
+        cell->DeleteThisFromChildren();
+    }
+    RemoveCell(pos);
+    // представление очищенной ячейки, как и ее объект Cell, больше не действительно
+    slot_views_.erase(pos.row * Position::MAX_COLS + pos.col);
+    if (column_sums_.HasColumn(pos.col)) {
+        column_sums_.Set(pos.col, pos.row, ColumnSums::Totals{});
+    }
+    ++epoch_;
+}
+
+void Sheet::RemoveCell(Position pos) {
+    const CellSlot slot = data_.Take(pos);
+    if (const Cell* cell = slot.GetCell()) {
+        graph_.RemoveNode(cell->GetNode());
+    }
+}
+
+void Sheet::NoteChanged(Position pos) {
+    if (changed_overflow_) {
+        return;
+    }
+    if (changed_cells_.size() == MAX_CHANGED_CELLS) {
+        changed_overflow_ = true;
+        changed_cells_ = {};
+        return;
+    }
+    changed_cells_.push_back(pos);
+}
+
+Size Sheet::GetPrintableSize() const {
+    Size size;
+
+    data_.ForEach([&size](Position pos, const CellSlot& slot) {
+        if (!slot.IsEmpty()) {
+            size.rows = std::max(size.rows, pos.row + 1);
+            size.cols = std::max(size.cols, pos.col + 1);
+        }
+    });
+
     return size;
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    auto value_getter = [](const std::unique_ptr<CellInterface>& cell) {
-        return cell->GetValue();
+    auto value_getter = [](const CellSlot& slot) {
+        return slot.GetValue();
     };
 
     PrintSheet(output, value_getter);
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    auto text_getter = [](const std::unique_ptr<CellInterface>& cell) {
-        return cell->GetText();
+    auto text_getter = [](const CellSlot& slot) {
+        return CellInterface::Value(slot.GetText());
     };
 
     PrintSheet(output, text_getter);
 }
 
-bool Sheet::IsEmptyRow(const std::vector<std::unique_ptr<CellInterface>>& row) const {
-    return std::all_of(row.begin(), row.end(),
-        [](const std::unique_ptr<CellInterface>& cell) {
-            return !cell;
+void Sheet::PrintSheet(std::ostream& output, std::function<CellInterface::Value(const CellSlot&)> getter) const {
+    Size size = GetPrintableSize();
+
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
+            if (col > 0) {
+                output << '\t';
+            }
+
+            const CellSlot* slot = data_.Find({row, col});
+            if (!slot || !*slot) {
+                continue;
+            }
+
+            // в PrintSheet передан такой функциональный объект, котрый вернет все что нужно
+            const auto& result = getter(*slot);
+
+            if (std::holds_alternative<std::string>(result)) {
+                output << std::get<std::string>(result);
+            } else if (std::holds_alternative<double>(result)) {
+                output << std::get<double>(result);
+            } else {
+                output << std::get<FormulaError>(result);
+            }
         }
-    ); // вернет true если вектор row пустой
+
+        output << '\n';
+    }
 }
 
-void Sheet::PrintSheet(std::ostream& output, std::function<CellInterface::Value(const std::unique_ptr<CellInterface>&)> getter) const {
-    Size size = GetPrintableSize();
+std::uint64_t Sheet::GetEpoch() const {
+    return epoch_;
+}
 
-    for (int row = 0; row < size.rows; ++row) {
-        bool is_first = true;
-        bool is_last_char_is_tab = false;
+DependencyGraph& Sheet::GetGraph() {
+    return graph_;
+}
 
-        const std::vector<std::unique_ptr<CellInterface>>& table_row = data_.at(row);
+const DependencyGraph& Sheet::GetGraph() const {
+    return graph_;
+}
+
+FormulaCache& Sheet::GetFormulaCache() {
+    return formula_cache_;
+}
+
+void Sheet::AddAggregateRange(const Range& range) {
+    if (range.last.col - range.first.col >= COLUMN_SUMS_MAX_WIDTH) {
+        return;
+    }
 
-        if (IsEmptyRow(table_row)) {
-            output << '\t' << '\n';
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        if (++aggregate_ranges_[col] != COLUMN_SUMS_MIN_RANGES || column_sums_.HasColumn(col)) {
             continue;
         }
 
-        for (int col = 0; col < size.cols; ++col) {
-            try {
-                const std::unique_ptr<CellInterface>& cell = table_row.at(col);
-                
-                if (cell) {
-                    if (!is_first && !is_last_char_is_tab) {
-                        output << '\t';
-                    }
-
-                    const auto& result = getter(cell); // в PrintSheet передан такой функциональный объект, котрый вернет все что нужно
-
-                    if (std::holds_alternative<std::string>(result)) {
-                        output << std::get<std::string>(result);
-                    } else if (std::holds_alternative<double>(result)) {
-                        output << std::get<double>(result);
-                    } else {
-                        output << std::get<FormulaError>(result);
-                    }
-
-                    is_first = false;
-                    is_last_char_is_tab = false;
-                } else {
-                    output << '\t';
-                    is_last_char_is_tab = true;
-                }
-            } catch (const std::out_of_range& ex) {
-                output << '\t';
-                is_last_char_is_tab = true;
+        // столбец стал востребован: собираем вклады его ячеек
+        column_sums_.AddColumn(col);
+        data_.ForEachInRange(Position{0, col}, Position{Position::MAX_ROWS - 1, col},
+                             [this, col](Position pos, const CellSlot& slot) {
+                                 column_sums_.Set(col, pos.row, ToTotals(slot.GetAggregateInput()));
+                             });
+    }
+}
+
+void Sheet::RemoveAggregateRange(const Range& range) {
+    if (range.last.col - range.first.col >= COLUMN_SUMS_MAX_WIDTH) {
+        return;
+    }
+
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        auto it = aggregate_ranges_.find(col);
+        if (--it->second == 0) {
+            aggregate_ranges_.erase(it);
+            column_sums_.RemoveColumn(col);
+        }
+    }
+}
+
+bool Sheet::TrySumRanges(const std::vector<Range>& ranges, double& sum, std::uint64_t& count) const {
+    sum = 0;
+    count = 0;
+    for (const Range& range : ranges) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            if (!column_sums_.HasColumn(col)) {
+                return false;
             }
+
+            const ColumnSums::Totals totals = column_sums_.Query(col, range.first.row, range.last.row);
+            if (totals.others > 0) {
+                return false;
+            }
+            sum += totals.sum;
+            count += totals.count;
         }
+    }
+    return true;
+}
 
-        output << '\n';
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    data_.ForEach([&stats](Position, const CellSlot& slot) {
+        ++stats.cells;
+        stats.compact_cells += slot.GetCell() ? 0 : 1;
+        stats.cell_bytes += slot.GetHeapUsage();
+    });
+    stats.storage_bytes = data_.GetMemoryUsage();
+    stats.graph = graph_.GetMemoryStats();
+    stats.formulas = formula_cache_.GetStats();
+    for (const auto& [col, ranges] : aggregate_ranges_) {
+        stats.indexed_columns += column_sums_.HasColumn(col) ? 1 : 0;
     }
+    stats.column_sums_bytes = column_sums_.GetMemoryUsage();
+    stats.recalc = recalc_stats_;
+
+    return stats;
+}
+
+void Sheet::RecalculateAll(std::size_t threads) {
+    // Сначала последовательно актуализируем ячейки без формул: они ни от чего
+    // не зависят. После этого ячейка читает только уже актуальные ячейки, и
+    // потоки не пишут в одни и те же кэши
+    std::vector<DependencyGraph::NodeId> formulas;
+    data_.ForEach([&formulas](Position, const CellSlot& slot) {
+        // у ячеек, хранящихся прямо в слотах, кэша нет
+        const Cell* real_cell = slot.GetCell();
+        if (!real_cell) {
+            return;
+        }
+        if (real_cell->IsFormula()) {
+            formulas.push_back(real_cell->GetNode());
+        } else {
+            real_cell->Actualize();
+        }
+    });
+
+    // число еще не вычисленных формул, на которые ссылается формула
+    std::vector<std::atomic<std::uint32_t>> pending(graph_.GetNodeIdBound());
+    // формулы, ссылающиеся только на ячейки без формул, по разделяемым формулам
+    std::unordered_map<const SharedFormula*, std::vector<const Cell*>> leaves;
+    std::vector<WorkStealingPool::Task> ready;
+    for (DependencyGraph::NodeId node : formulas) {
+        std::uint32_t count = 0;
+        graph_.ForEachPrecedent(node, [this, &count](DependencyGraph::NodeId precedent) {
+            count += graph_.GetCell(precedent)->IsFormula() ? 1 : 0;
+        });
+        pending[node].store(count, std::memory_order_relaxed);
+        if (count == 0) {
+            const Cell* cell = graph_.GetCell(node);
+            leaves[cell->GetSharedFormula()].push_back(cell);
+        }
+    }
+
+    // Формулы одной формы (столбец C2=A2*B2, C3=A3*B3, ...) вычисляются
+    // пакетами: одна задача на пакет вместо задачи на ячейку. Задачи пакетов
+    // нумеруются после NodeId
+    constexpr std::size_t MIN_BATCH_SIZE = 8;
+    constexpr std::size_t MAX_BATCH_SIZE = 4096;  // чтобы пакеты делились между потоками
+    const std::size_t batch_task_base = graph_.GetNodeIdBound();
+    std::vector<std::vector<const Cell*>> batches;
+    std::size_t batched_cells = 0;
+    for (auto& [formula, cells] : leaves) {
+        if (cells.size() < MIN_BATCH_SIZE) {
+            for (const Cell* cell : cells) {
+                ready.push_back(cell->GetNode());
+            }
+            continue;
+        }
+
+        for (std::size_t begin = 0; begin < cells.size(); begin += MAX_BATCH_SIZE) {
+            const std::size_t end = std::min(cells.size(), begin + MAX_BATCH_SIZE);
+            ready.push_back(static_cast<WorkStealingPool::Task>(batch_task_base + batches.size()));
+            batches.emplace_back(cells.begin() + begin, cells.begin() + end);
+        }
+        batched_cells += cells.size();
+    }
+
+    auto release_dependents = [this, &pending](DependencyGraph::NodeId node, auto& push) {
+        graph_.ForEachDependent(node, [&pending, &push](DependencyGraph::NodeId dependent) {
+            if (pending[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                push(dependent);
+            }
+        });
+    };
+
+    WorkStealingPool pool(threads);
+    const std::size_t total = formulas.size() - batched_cells + batches.size();
+    pool.Run(ready, total, [&](WorkStealingPool::Task task, auto&& push) {
+        if (task < batch_task_base) {
+            graph_.GetCell(task)->Actualize();
+            release_dependents(task, push);
+            return;
+        }
+
+        const std::vector<const Cell*>& batch = batches[task - batch_task_base];
+        Cell::ActualizeBatch(batch);
+        for (const Cell* cell : batch) {
+            release_dependents(cell->GetNode(), push);
+        }
+    });
+
+    changed_cells_.clear();
+    changed_overflow_ = false;
+    recalculated_at_ = epoch_;
+}
+
+RecalcStats Sheet::RecalculateChanged(std::size_t threads) {
+    RecalcStats stats;
+    if (changed_overflow_) {
+        RecalculateAll(threads);
+        stats.full_recalculations = 1;
+        ++recalc_stats_.full_recalculations;
+        return stats;
+    }
+
+    // Ячейка пересчитывается после всех ячеек, на которые ссылается: очередь
+    // упорядочена по топологическому порядку, а в нее попадают только
+    // зависимые уже обработанных ячеек. Поэтому то, что читает формула, либо
+    // уже пересчитано, либо не затронуто записями, и его кэш можно брать как есть
+    const std::uint64_t since = recalculated_at_;
+    recalculated_at_ = epoch_;
+
+    using Item = std::pair<std::int64_t, DependencyGraph::NodeId>;
+    std::priority_queue<Item, std::vector<Item>, std::greater<Item>> queue;
+    std::unordered_set<DependencyGraph::NodeId> queued;
+    auto push = [this, &queue, &queued](DependencyGraph::NodeId node) {
+        if (queued.insert(node).second) {
+            queue.emplace(graph_.GetOrder(node), node);
+        }
+    };
+
+    for (Position pos : changed_cells_) {
+        // ячейку могли удалить после записи или записать в нее значение,
+        // которое хранится прямо в слоте: тогда от нее ничего не зависит
+        const CellSlot* slot = data_.Find(pos);
+        if (const Cell* cell = slot ? slot->GetCell() : nullptr) {
+            push(cell->GetNode());
+        }
+    }
+    changed_cells_.clear();
+
+    while (!queue.empty()) {
+        const DependencyGraph::NodeId node = queue.top().second;
+        queue.pop();
+
+        const Cell* cell = graph_.GetCell(node);
+        if (cell->Refresh() && cell->IsFormula()) {
+            ++stats.recomputed;
+        }
+        if (!cell->ChangedSince(since)) {
+            // значение то же, что видели зависимые ячейки: их не трогаем
+            ++stats.cut_off;
+            continue;
+        }
+        graph_.ForEachDependent(node, push);
+    }
+
+    recalc_stats_.recomputed += stats.recomputed;
+    recalc_stats_.cut_off += stats.cut_off;
+    return stats;
+}
+
+bool Sheet::IsRecalculated() const {
+    return recalculated_at_ == epoch_;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,27 +1,191 @@
 #pragma once
 
 #include "cell.h"
+#include "cell_slot.h"
+#include "column_sums.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula_cache.h"
+#include "tiled_storage.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class Cell;
+
+// Счетчики пересчета по изменениям (см. Sheet::RecalculateChanged)
+struct RecalcStats {
+    std::size_t recomputed = 0;  // пересчитанные формулы
+    // Ячейки, значение которых не изменилось: их зависимые не пересчитывались.
+    // Сюда входят и пересчитанные формулы с прежним значением
+    std::size_t cut_off = 0;
+    std::size_t full_recalculations = 0;  // пересчеты всего листа вместо изменений
+};
+
+struct SheetStats {
+    std::size_t cells = 0;          // включая пустые ячейки, на которые ссылаются формулы
+    std::size_t compact_cells = 0;  // ячейки, хранящиеся прямо в слотах (см. CellSlot)
+    std::size_t storage_bytes = 0;  // хранилище вместе со слотами ячеек
+    std::size_t cell_bytes = 0;     // объекты Cell и длинные тексты вне слотов
+    DependencyGraph::MemoryStats graph;
+    FormulaCache::Stats formulas;
+    std::size_t indexed_columns = 0;    // столбцы с префиксными суммами
+    std::size_t column_sums_bytes = 0;
+    RecalcStats recalc;  // сумма по всем вызовам RecalculateChanged
+};
 
 class Sheet : public SheetInterface {
 public:
+    // Откуда берется память под объекты Cell. Pooled - пул блоков одного
+    // размера: память удаленной ячейки достается следующей. Scratch - память
+    // только выделяется, подряд большими блоками, и вся разом возвращается
+    // при удалении листа; для временных листов, которые заполняются и
+    // читаются, но почти не стирают ячеек
+    enum class Memory {
+        Pooled,
+        Scratch,
+    };
+
+    explicit Sheet(Memory memory = Memory::Pooled);
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
+    // Записывает несколько ячеек одной операцией: либо все, либо ни одной.
+    // Все формулы разбираются до первого изменения листа, циклы проверяются
+    // один раз на итоговом графе (промежуточные состояния пакета не в счет),
+    // и все записанные ячейки меняются в одной эпохе листа. Из нескольких
+    // записей в одну ячейку действует последняя. При InvalidPositionException,
+    // FormulaException и CircularDependencyException содержимое листа не меняется
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+    // Заполняет пустой лист (например, при чтении из файла) без работы с
+    // графом на каждую ячейку: ячейки ставятся как есть, ссылки добавляются
+    // в граф одним проходом, а циклы ищутся один раз по всему графу (см.
+    // DependencyGraph::RebuildOrder). CircularDependencyException перечисляет
+    // все ячейки, лежащие на циклах. Ни одна формула не вычисляется: кэши
+    // пусты. При исключении лист остается пустым; std::logic_error, если
+    // лист не пуст
+    void Load(std::vector<std::pair<Position, std::string>> cells);
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    // Ячейка, которая хранится прямо в слоте (см. CellSlot), возвращается как
+    // представление слота: слот остается прежним, а лист заводит для позиции
+    // одно представление, которое читает слот при каждом вызове. Как и объект
+    // Cell, оно живет, пока ячейку не очистят (ClearCell) или не удалят лист,
+    // и видит все записи в ячейку. Константный лист можно читать из нескольких
+    // потоков
+    const CellInterface* TryGetCell(Position pos) const override;
+    CellInterface* TryGetCell(Position pos) override;
+
+    // Идет по слотам тайлов, пропуская пустые, и читает числа ячеек без
+    // виртуальных вызовов (см. Cell::GetActualNumber)
+    bool ReadColumnNumbers(Position first, std::size_t count, double* values) const override;
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+
+    // Текущая эпоха листа. Увеличивается при каждом изменении содержимого ячеек
+    std::uint64_t GetEpoch() const;
+
+    // Создает пустую ячейку, на которую ссылается формула. Ячейка ставится
+    // в начало топологического порядка, так как ни от чего не зависит
+    Cell& CreateEmptyCell(Position pos);
+    // Объект Cell ячейки pos или nullptr, если ячейки нет или она хранится
+    // прямо в слоте: такая ячейка не в графе и ни от чего не зависит
+    Cell* FindCell(Position pos) const;
+    // То же, но ячейку из слота переводит в Cell: на нее ссылается формула
+    Cell* PromoteCell(Position pos);
+    // Заводит объекты Cell для ячеек диапазона, которые хранятся прямо в
+    // слотах: на ячейки диапазона формула ссылается через граф зависимостей
+    void PromoteRange(const Range& range);
+
+    DependencyGraph& GetGraph();
+    const DependencyGraph& GetGraph() const;
+
+    FormulaCache& GetFormulaCache();
+
+    // Учет диапазонов формул SUM/COUNT/AVERAGE (см. SharedFormula::GetRangeAggregate).
+    // Для столбца, на который ссылаются COLUMN_SUMS_MIN_RANGES таких диапазонов,
+    // лист заводит префиксные суммы и поддерживает их при записи в ячейки;
+    // столбец выходит из индекса, когда на него не остается ссылок. Диапазоны
+    // шире COLUMN_SUMS_MAX_WIDTH столбцов не учитываются: индекс столбца
+    // занимает полмегабайта, и заводить его для каждого столбца листа нельзя
+    static constexpr std::uint32_t COLUMN_SUMS_MIN_RANGES = 16;
+    static constexpr int COLUMN_SUMS_MAX_WIDTH = 16;
+    void AddAggregateRange(const Range& range);
+    void RemoveAggregateRange(const Range& range);
+    // Сумма и число непустых ячеек диапазонов за O(log) на столбец. false, если
+    // какой-то из столбцов не в индексе или в диапазонах есть формулы, текст,
+    // не читающийся как число, или ошибки: тогда диапазоны надо читать по ячейкам
+    bool TrySumRanges(const std::vector<Range>& ranges, double& sum, std::uint64_t& count) const;
+
+    SheetStats GetStats() const;
+
+    // Актуализирует кэш всех ячеек листа. Формулы вычисляются параллельно
+    // на threads потоках (0 - по числу аппаратных потоков): формула
+    // запускается, как только вычислены все формулы, на которые она ссылается.
+    // Формулы одной формы, ссылающиеся только на ячейки без формул,
+    // вычисляются пакетами (см. Cell::ActualizeBatch)
+    void RecalculateAll(std::size_t threads = 0);
+
+    // Актуализирует кэш всех ячеек листа, пересчитывая только то, что
+    // затронули записи после прошлого RecalculateChanged или RecalculateAll.
+    // Записанные ячейки и их зависимые обходятся в топологическом порядке,
+    // и формула, значение которой не изменилось, дальше изменение не передает.
+    // Если записей набралось больше MAX_CHANGED_CELLS, лист пересчитывается
+    // целиком через RecalculateAll(threads)
+    static constexpr std::size_t MAX_CHANGED_CELLS = 1 << 16;
+    RecalcStats RecalculateChanged(std::size_t threads = 0);
+    // Актуальны ли кэши всех ячеек: с последнего RecalculateChanged или
+    // RecalculateAll в лист ничего не записывали. Тогда ячейкам не нужно
+    // проверять, не изменилось ли то, на что ссылаются их формулы
+    bool IsRecalculated() const;
 private:
-    std::vector<std::vector<std::unique_ptr<CellInterface>>> data_;
-    bool IsEmptyRow(const std::vector<std::unique_ptr<CellInterface>>& row) const;
-    void PrintSheet(std::ostream& output, std::function<CellInterface::Value(const std::unique_ptr<CellInterface>&)> getter) const;
-};
\ No newline at end of file
+    friend struct CellDeleter;
+    class SlotView;
+
+    // объявлена первой, чтобы освобождаться после всех ячеек
+    std::unique_ptr<std::pmr::memory_resource> cell_memory_;
+    DependencyGraph graph_;
+    FormulaCache formula_cache_;
+    TiledStorage<CellSlot> data_;
+    std::uint64_t epoch_ = 1;
+
+    ColumnSums column_sums_;
+    // число диапазонов SUM/COUNT/AVERAGE, накрывающих столбец
+    std::unordered_map<int, std::uint32_t> aggregate_ranges_;
+
+    // записанные после прошлого пересчета ячейки; если их слишком много,
+    // changed_overflow_ и следующий пересчет - целиком
+    std::vector<Position> changed_cells_;
+    bool changed_overflow_ = false;
+    std::uint64_t recalculated_at_ = 0;  // эпоха последнего пересчета листа
+    RecalcStats recalc_stats_;
+
+    // представления ячеек в слотах, выданные TryGetCell, по номеру позиции
+    // (row * MAX_COLS + col); заводятся при чтении константного листа,
+    // поэтому под мьютексом
+    mutable std::mutex slot_views_mutex_;
+    mutable std::unordered_map<int, std::unique_ptr<SlotView>> slot_views_;
+
+    // создает ячейку в памяти листа (см. Memory); аргументы - как у конструктора Cell
+    CellPtr NewCell(Position pos, bool first);
+    void FreeCell(Cell* cell);
+    // заменяет ячейку, хранящуюся прямо в слоте, объектом Cell с тем же содержимым
+    Cell& Promote(Position pos);
+    // удаляет ячейку без ребер из хранилища и графа
+    void RemoveCell(Position pos);
+    void NoteChanged(Position pos);
+    void PrintSheet(std::ostream& output, std::function<CellInterface::Value(const CellSlot&)> getter) const;
+};
@@ -73,6 +73,46 @@ Position Position::FromString(std::string_view str) {
     return {row - 1, col - 1};
 }
 
+bool Range::operator==(const Range& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(const Range& rhs) const {
+    return std::tie(first, last) < std::tie(rhs.first, rhs.last);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+std::string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+
+    return first.ToString() + ':' + last.ToString();
+}
+
+Range Range::FromString(std::string_view str) {
+    const auto colon = str.find(':');
+    if (colon == str.npos) {
+        return {Position::NONE, Position::NONE};
+    }
+
+    const Position lhs = Position::FromString(str.substr(0, colon));
+    const Position rhs = Position::FromString(str.substr(colon + 1));
+    if (!lhs.IsValid() || !rhs.IsValid()) {
+        return {Position::NONE, Position::NONE};
+    }
+
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
\ No newline at end of file
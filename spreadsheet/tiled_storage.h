@@ -0,0 +1,201 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Разреженное хранилище значений листа.
+// Лист разбит на квадратные блоки (тайлы) TILE_SIZE x TILE_SIZE. Тайл выделяется
+// при первой записи в него и освобождается, когда в нем не остается ни одного
+// непустого значения. Каталог тайлов индексируется координатами тайла, поэтому
+// занимаемая память растет с числом занятых тайлов, а не с размером
+// ограничивающего прямоугольника.
+// Value должен конструироваться по умолчанию в "пустое" состояние и приводиться
+// к bool (например, std::unique_ptr).
+template <typename Value>
+class TiledStorage {
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+    static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+    // Возвращает слот для позиции или nullptr, если тайл еще не выделен.
+    // Слот выделенного тайла может быть пустым. Позиция должна быть корректной.
+    const Value* Find(Position pos) const {
+        const auto& tile_row = directory_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            return nullptr;
+        }
+
+        const auto& tile = tile_row->tiles[pos.col / TILE_SIZE];
+        if (!tile) {
+            return nullptr;
+        }
+
+        return &tile->slots[SlotIndex(pos)];
+    }
+
+    Value* Find(Position pos) {
+        return const_cast<Value*>(static_cast<const TiledStorage&>(*this).Find(pos));
+    }
+
+    // Записывает значение в слот, при необходимости выделяя тайл.
+    // Запись пустого значения равносильна Take.
+    void Set(Position pos, Value value) {
+        if (!value) {
+            Take(pos);
+            return;
+        }
+
+        Tile& tile = GetOrCreateTile(pos);
+        Value& slot = tile.slots[SlotIndex(pos)];
+        if (!slot) {
+            ++tile.occupied;
+        }
+        slot = std::move(value);
+    }
+
+    // Забирает значение из слота. Если тайл опустел, он освобождается.
+    Value Take(Position pos) {
+        auto& tile_row = directory_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            return Value{};
+        }
+
+        auto& tile = tile_row->tiles[pos.col / TILE_SIZE];
+        if (!tile) {
+            return Value{};
+        }
+
+        Value result = std::move(tile->slots[SlotIndex(pos)]);
+        tile->slots[SlotIndex(pos)] = Value{};
+        if (result && --tile->occupied == 0) {
+            tile.reset();
+            if (--tile_row->occupied == 0) {
+                tile_row.reset();
+            }
+        }
+
+        return result;
+    }
+
+    // Вызывает f(Position, const Value&) для каждого непустого слота.
+    // Порядок обхода - по тайлам, внутри тайла по строкам.
+    template <typename F>
+    void ForEach(F&& f) const {
+        for (int tile_row = 0; tile_row < TILE_ROWS; ++tile_row) {
+            const auto& row = directory_[tile_row];
+            if (!row) {
+                continue;
+            }
+
+            for (int tile_col = 0; tile_col < TILE_COLS; ++tile_col) {
+                const auto& tile = row->tiles[tile_col];
+                if (!tile) {
+                    continue;
+                }
+
+                for (int i = 0; i < TILE_SIZE * TILE_SIZE; ++i) {
+                    const Value& value = tile->slots[i];
+                    if (value) {
+                        f(Position{tile_row * TILE_SIZE + i / TILE_SIZE,
+                                   tile_col * TILE_SIZE + i % TILE_SIZE},
+                          value);
+                    }
+                }
+            }
+        }
+    }
+
+    // То же для слотов прямоугольника first:last; невыделенные тайлы
+    // пропускаются целиком, поэтому обход разреженного диапазона дешев
+    template <typename F>
+    void ForEachInRange(Position first, Position last, F&& f) const {
+        for (int tile_row = first.row / TILE_SIZE; tile_row <= last.row / TILE_SIZE; ++tile_row) {
+            const auto& row = directory_[tile_row];
+            if (!row) {
+                continue;
+            }
+
+            const int row_begin = std::max(first.row, tile_row * TILE_SIZE);
+            const int row_end = std::min(last.row, tile_row * TILE_SIZE + TILE_SIZE - 1);
+            for (int tile_col = first.col / TILE_SIZE; tile_col <= last.col / TILE_SIZE; ++tile_col) {
+                const auto& tile = row->tiles[tile_col];
+                if (!tile) {
+                    continue;
+                }
+
+                const int col_begin = std::max(first.col, tile_col * TILE_SIZE);
+                const int col_end = std::min(last.col, tile_col * TILE_SIZE + TILE_SIZE - 1);
+                for (int r = row_begin; r <= row_end; ++r) {
+                    for (int c = col_begin; c <= col_end; ++c) {
+                        const Value& value = tile->slots[SlotIndex({r, c})];
+                        if (value) {
+                            f(Position{r, c}, value);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::size_t GetTileCount() const {
+        std::size_t count = 0;
+        for (const auto& row : directory_) {
+            if (row) {
+                count += row->occupied;
+            }
+        }
+
+        return count;
+    }
+
+    // Оценка памяти, занятой самим хранилищем (без учета памяти, на которую
+    // ссылаются значения).
+    std::size_t GetMemoryUsage() const {
+        std::size_t bytes = sizeof(*this);
+        for (const auto& row : directory_) {
+            if (row) {
+                bytes += sizeof(TileRow) + row->occupied * sizeof(Tile);
+            }
+        }
+
+        return bytes;
+    }
+
+private:
+    struct Tile {
+        std::array<Value, TILE_SIZE * TILE_SIZE> slots{};
+        int occupied = 0;  // число непустых слотов
+    };
+
+    struct TileRow {
+        std::array<std::unique_ptr<Tile>, TILE_COLS> tiles;
+        int occupied = 0;  // число выделенных тайлов
+    };
+
+    static int SlotIndex(Position pos) {
+        return (pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        auto& tile_row = directory_[pos.row / TILE_SIZE];
+        if (!tile_row) {
+            tile_row = std::make_unique<TileRow>();
+        }
+
+        auto& tile = tile_row->tiles[pos.col / TILE_SIZE];
+        if (!tile) {
+            tile = std::make_unique<Tile>();
+            ++tile_row->occupied;
+        }
+
+        return *tile;
+    }
+
+    std::array<std::unique_ptr<TileRow>, TILE_ROWS> directory_;
+};
@@ -0,0 +1,328 @@
+#include "vector_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+
+// The AVX2 kernels are compiled with a per-function target attribute and
+// picked at run time, so the build needs no -mavx2 and the binary still runs
+// on processors without AVX2. Other compilers get the scalar kernels only
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define VECTOR_KERNELS_AVX2
+#include <immintrin.h>
+#endif
+
+namespace vector_kernels {
+namespace {
+
+// the scalar stack machine reports #DIV/0! for divisors this close to zero
+constexpr double DIVISOR_EPSILON = 1e-6;
+
+enum class Op {
+    Add,
+    Subtract,
+    Multiply,
+};
+
+enum class Reduction {
+    Sum,
+    Min,
+    Max,
+};
+
+using ArithmeticKernel = bool (*)(double*, const double*, std::uint8_t*, std::size_t);
+using ReductionKernel = double (*)(const double*, std::size_t);
+
+struct Kernels {
+    Isa isa;
+    ArithmeticKernel add;
+    ArithmeticKernel subtract;
+    ArithmeticKernel multiply;
+    ArithmeticKernel divide;
+    ReductionKernel sum;
+    ReductionKernel min;
+    ReductionKernel max;
+};
+
+constexpr std::size_t REDUCTION_LANES = 4;
+
+// one step of a reduction; the same expressions as _mm256_min_pd(value, acc)
+// and _mm256_max_pd(value, acc), so that both sets treat signed zeros alike
+template <Reduction reduction>
+double Reduce(double acc, double value) {
+    if constexpr (reduction == Reduction::Sum) {
+        return acc + value;
+    } else if constexpr (reduction == Reduction::Min) {
+        return value < acc ? value : acc;
+    } else {
+        return value > acc ? value : acc;
+    }
+}
+
+template <Reduction reduction>
+constexpr double ReductionIdentity() {
+    if constexpr (reduction == Reduction::Sum) {
+        return 0;
+    } else if constexpr (reduction == Reduction::Min) {
+        return HUGE_VAL;
+    } else {
+        return -HUGE_VAL;
+    }
+}
+
+// Folds the lane accumulators and the tail shorter than REDUCTION_LANES,
+// the common ending of both implementations
+template <Reduction reduction>
+double FinishReduction(const double (&acc)[REDUCTION_LANES], bool any_nan, const double* tail, std::size_t n) {
+    double result = Reduce<reduction>(Reduce<reduction>(acc[0], acc[1]), Reduce<reduction>(acc[2], acc[3]));
+    for (std::size_t i = 0; i < n; ++i) {
+        any_nan = any_nan || std::isnan(tail[i]);
+        result = Reduce<reduction>(result, tail[i]);
+    }
+
+    if constexpr (reduction != Reduction::Sum) {
+        // the comparisons above skip NaN, a sum propagates it by itself
+        if (any_nan) {
+            return NAN;
+        }
+    }
+    return result;
+}
+
+template <Reduction reduction>
+double ReduceScalar(const double* values, std::size_t n) {
+    double acc[REDUCTION_LANES];
+    std::fill(acc, acc + REDUCTION_LANES, ReductionIdentity<reduction>());
+    bool any_nan = false;
+
+    std::size_t i = 0;
+    for (; i + REDUCTION_LANES <= n; i += REDUCTION_LANES) {
+        for (std::size_t lane = 0; lane < REDUCTION_LANES; ++lane) {
+            any_nan = any_nan || std::isnan(values[i + lane]);
+            acc[lane] = Reduce<reduction>(acc[lane], values[i + lane]);
+        }
+    }
+
+    return FinishReduction<reduction>(acc, any_nan, values + i, n - i);
+}
+
+template <Op op>
+bool ArithmeticScalar(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    bool any_failed = false;
+    for (std::size_t i = 0; i < n; ++i) {
+        if constexpr (op == Op::Add) {
+            lhs[i] += rhs[i];
+        } else if constexpr (op == Op::Subtract) {
+            lhs[i] -= rhs[i];
+        } else {
+            lhs[i] *= rhs[i];
+        }
+
+        if (!std::isfinite(lhs[i])) {
+            failed[i] = 1;
+            any_failed = true;
+        }
+    }
+
+    return any_failed;
+}
+
+bool DivideScalar(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    bool any_failed = false;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (std::abs(rhs[i]) <= DIVISOR_EPSILON) {
+            failed[i] = 1;
+            any_failed = true;
+        }
+        lhs[i] /= rhs[i];
+    }
+
+    return any_failed;
+}
+
+constexpr Kernels SCALAR_KERNELS{
+    Isa::Scalar,
+    &ArithmeticScalar<Op::Add>,
+    &ArithmeticScalar<Op::Subtract>,
+    &ArithmeticScalar<Op::Multiply>,
+    &DivideScalar,
+    &ReduceScalar<Reduction::Sum>,
+    &ReduceScalar<Reduction::Min>,
+    &ReduceScalar<Reduction::Max>,
+};
+
+#ifdef VECTOR_KERNELS_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+// sets the flags of the lanes whose bits are set in mask
+inline bool MarkFailed(int mask, std::uint8_t* failed) {
+    if (mask == 0) {
+        return false;
+    }
+
+    for (int lane = 0; lane < 4; ++lane) {
+        if (mask >> lane & 1) {
+            failed[lane] = 1;
+        }
+    }
+    return true;
+}
+
+template <Op op>
+AVX2_TARGET bool ArithmeticAvx2(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffff));
+    const __m256d max = _mm256_set1_pd(DBL_MAX);
+
+    bool any_failed = false;
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256d a = _mm256_loadu_pd(lhs + i);
+        const __m256d b = _mm256_loadu_pd(rhs + i);
+        __m256d result;
+        if constexpr (op == Op::Add) {
+            result = _mm256_add_pd(a, b);
+        } else if constexpr (op == Op::Subtract) {
+            result = _mm256_sub_pd(a, b);
+        } else {
+            result = _mm256_mul_pd(a, b);
+        }
+        _mm256_storeu_pd(lhs + i, result);
+
+        // |x| <= DBL_MAX is false for infinities and NaN, just like isfinite
+        const __m256d finite = _mm256_cmp_pd(_mm256_and_pd(result, abs_mask), max, _CMP_LE_OQ);
+        any_failed |= MarkFailed(_mm256_movemask_pd(finite) ^ 0xF, failed + i);
+    }
+
+    // the tail shorter than a vector
+    return ArithmeticScalar<op>(lhs + i, rhs + i, failed + i, n - i) || any_failed;
+}
+
+AVX2_TARGET bool DivideAvx2(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffff));
+    const __m256d epsilon = _mm256_set1_pd(DIVISOR_EPSILON);
+
+    bool any_failed = false;
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256d divisor = _mm256_loadu_pd(rhs + i);
+        // false for NaN, so a NaN divisor is not an error, as in the scalar check
+        const __m256d near_zero = _mm256_cmp_pd(_mm256_and_pd(divisor, abs_mask), epsilon, _CMP_LE_OQ);
+        any_failed |= MarkFailed(_mm256_movemask_pd(near_zero), failed + i);
+        _mm256_storeu_pd(lhs + i, _mm256_div_pd(_mm256_loadu_pd(lhs + i), divisor));
+    }
+
+    return DivideScalar(lhs + i, rhs + i, failed + i, n - i) || any_failed;
+}
+
+template <Reduction reduction>
+AVX2_TARGET double ReduceAvx2(const double* values, std::size_t n) {
+    __m256d acc = _mm256_set1_pd(ReductionIdentity<reduction>());
+    __m256d nan = _mm256_setzero_pd();
+
+    std::size_t i = 0;
+    for (; i + REDUCTION_LANES <= n; i += REDUCTION_LANES) {
+        const __m256d value = _mm256_loadu_pd(values + i);
+        if constexpr (reduction == Reduction::Sum) {
+            acc = _mm256_add_pd(acc, value);
+        } else if constexpr (reduction == Reduction::Min) {
+            acc = _mm256_min_pd(value, acc);
+            nan = _mm256_or_pd(nan, _mm256_cmp_pd(value, value, _CMP_UNORD_Q));
+        } else {
+            acc = _mm256_max_pd(value, acc);
+            nan = _mm256_or_pd(nan, _mm256_cmp_pd(value, value, _CMP_UNORD_Q));
+        }
+    }
+
+    double lanes[REDUCTION_LANES];
+    _mm256_storeu_pd(lanes, acc);
+    return FinishReduction<reduction>(lanes, _mm256_movemask_pd(nan) != 0, values + i, n - i);
+}
+
+#undef AVX2_TARGET
+
+constexpr Kernels AVX2_KERNELS{
+    Isa::Avx2,
+    &ArithmeticAvx2<Op::Add>,
+    &ArithmeticAvx2<Op::Subtract>,
+    &ArithmeticAvx2<Op::Multiply>,
+    &DivideAvx2,
+    &ReduceAvx2<Reduction::Sum>,
+    &ReduceAvx2<Reduction::Min>,
+    &ReduceAvx2<Reduction::Max>,
+};
+#endif
+
+const Kernels* SelectKernels(Isa isa) {
+#ifdef VECTOR_KERNELS_AVX2
+    if (isa == Isa::Avx2) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return &AVX2_KERNELS;
+        }
+    }
+#endif
+    return &SCALAR_KERNELS;
+}
+
+// The threads of RecalculateAll read the set on every kernel call while SetIsa
+// may switch it; the sets themselves are constants, so no ordering is needed
+std::atomic<const Kernels*>& CurrentKernelsPointer() {
+    static std::atomic<const Kernels*> kernels{SelectKernels(Isa::Avx2)};
+    return kernels;
+}
+
+const Kernels* CurrentKernels() {
+    return CurrentKernelsPointer().load(std::memory_order_relaxed);
+}
+
+}  // namespace
+
+Isa GetIsa() {
+    return CurrentKernels()->isa;
+}
+
+void SetIsa(Isa isa) {
+    CurrentKernelsPointer().store(SelectKernels(isa), std::memory_order_relaxed);
+}
+
+void Fill(double* lanes, double value, std::size_t n) {
+    std::fill(lanes, lanes + n, value);
+}
+
+bool Add(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    return CurrentKernels()->add(lhs, rhs, failed, n);
+}
+
+bool Subtract(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    return CurrentKernels()->subtract(lhs, rhs, failed, n);
+}
+
+bool Multiply(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    return CurrentKernels()->multiply(lhs, rhs, failed, n);
+}
+
+bool Divide(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n) {
+    return CurrentKernels()->divide(lhs, rhs, failed, n);
+}
+
+double Sum(const double* values, std::size_t n) {
+    return CurrentKernels()->sum(values, n);
+}
+
+double Min(const double* values, std::size_t n) {
+    return CurrentKernels()->min(values, n);
+}
+
+double Max(const double* values, std::size_t n) {
+    return CurrentKernels()->max(values, n);
+}
+
+void Negate(double* lanes, std::size_t n) {
+    // a loop the compiler vectorizes by itself; negation never fails
+    for (std::size_t i = 0; i < n; ++i) {
+        lanes[i] = -lanes[i];
+    }
+}
+
+}  // namespace vector_kernels
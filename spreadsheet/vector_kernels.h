@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Lane-wise arithmetic for evaluating one formula over many cells at once
+// (see FormulaAST::ExecuteBatch). Operands are contiguous arrays of n lanes.
+// A kernel sets failed[i] = 1 for every lane where the scalar stack machine
+// would stop with #DIV/0!, leaves the other flags untouched and returns
+// whether any lane failed. Results of failed lanes are unspecified.
+namespace vector_kernels {
+
+enum class Isa {
+    Scalar,
+    Avx2,
+};
+
+// AVX2 is used if the compiler can target it and the processor supports it
+Isa GetIsa();
+// Lets tests and benchmarks compare the implementations; asking for AVX2
+// where it is not available selects Scalar. Safe to call while other threads
+// run kernels: each kernel call uses one set or the other
+void SetIsa(Isa isa);
+
+void Fill(double* lanes, double value, std::size_t n);
+// lhs[i] op= rhs[i], a lane fails if the result is not finite
+bool Add(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n);
+bool Subtract(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n);
+bool Multiply(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n);
+// lhs[i] /= rhs[i], a lane fails if |rhs[i]| <= 1e-6 (the result is not checked)
+bool Divide(double* lhs, const double* rhs, std::uint8_t* failed, std::size_t n);
+void Negate(double* lanes, std::size_t n);
+
+// Reductions for the aggregate functions of formulas. The summation order is
+// fixed (four interleaved partial sums), so every instruction set returns the
+// same bits. Min and Max return NaN if any value is NaN; for n == 0 they
+// return +inf and -inf
+double Sum(const double* values, std::size_t n);
+double Min(const double* values, std::size_t n);
+double Max(const double* values, std::size_t n);
+
+}  // namespace vector_kernels
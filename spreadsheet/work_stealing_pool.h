@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с кражей задач для однократного выполнения графа задач.
+// Задача - число (например, NodeId). Каждый поток берет задачи с конца своей
+// очереди, а опустевший поток крадет их с начала чужих очередей. Выполненная
+// задача может запустить новые, передав их в push, - они попадают в очередь
+// того же потока, который скорее всего еще держит в кэше их входные данные.
+// Поток, которому нечего взять, немного уступает процессор, а потом засыпает
+// до появления новых задач, не занимая ядро, пока другие дорабатывают граф.
+class WorkStealingPool {
+public:
+    using Task = std::uint32_t;
+
+    // threads == 0 - по числу аппаратных потоков
+    explicit WorkStealingPool(std::size_t threads)
+        : queues_(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency()))
+    {
+    }
+
+    std::size_t GetThreadCount() const {
+        return queues_.size();
+    }
+
+    // попыток взять задачу, после которых простаивающий поток засыпает
+    static constexpr int SPIN_COUNT = 64;
+
+    // Выполняет execute(task, push) для начальных задач и всех задач, запущенных
+    // через push(task), пока не будет выполнено total задач. Вызывающий поток
+    // работает как один из потоков пула. execute не должен бросать исключений.
+    // Всего задач, начальных и запущенных, должно быть ровно total; если их
+    // меньше, Run возвращается, когда все потоки остались без задач
+    template <typename F>
+    void Run(const std::vector<Task>& initial, std::size_t total, F&& execute) {
+        if (total == 0) {
+            return;
+        }
+
+        for (std::size_t i = 0; i < initial.size(); ++i) {
+            queues_[i % queues_.size()].tasks.push_back(initial[i]);
+        }
+        queued_ = initial.size();
+        pushed_ = initial.size();
+        remaining_ = total;
+        sleeping_ = 0;
+
+        auto worker = [this, &execute](std::size_t index) {
+            auto push = [this, index](Task task) {
+                {
+                    Queue& queue = queues_[index];
+                    std::lock_guard guard(queue.mutex);
+                    queue.tasks.push_back(task);
+                }
+                pushed_.fetch_add(1, std::memory_order_relaxed);
+                queued_.fetch_add(1);
+                if (sleeping_.load() > 0) {
+                    std::lock_guard guard(idle_mutex_);
+                    idle_.notify_one();
+                }
+            };
+
+            Task task;
+            int misses = 0;
+            while (remaining_.load(std::memory_order_acquire) > 0) {
+                if (!Pop(index, task) && !Steal(index, task)) {
+                    if (++misses < SPIN_COUNT) {
+                        std::this_thread::yield();
+                    } else {
+                        WaitForTasks();
+                        misses = 0;
+                    }
+                    continue;
+                }
+
+                misses = 0;
+                execute(task, push);
+                if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::lock_guard guard(idle_mutex_);
+                    idle_.notify_all();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        threads.reserve(queues_.size() - 1);
+        for (std::size_t i = 1; i < queues_.size(); ++i) {
+            threads.emplace_back(worker, i);
+        }
+        worker(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        // задач должно быть ровно total: лишние остались бы в очередях
+        assert(pushed_ == total && queued_ == 0);
+        for (Queue& queue : queues_) {
+            queue.tasks.clear();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool Pop(std::size_t index, Task& task) {
+        Queue& queue = queues_[index];
+        std::lock_guard guard(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        queued_.fetch_sub(1);
+        return true;
+    }
+
+    // Засыпает, пока в очередях нет задач, а граф не выполнен. Задачи
+    // запускают только выполняющиеся потоки, поэтому если уснули все, новых
+    // задач не будет: задач оказалось меньше total, и Run завершается
+    void WaitForTasks() {
+        std::unique_lock lock(idle_mutex_);
+        if (sleeping_.fetch_add(1) + 1 == queues_.size() && queued_.load() == 0) {
+            assert(!"WorkStealingPool: fewer tasks than total");
+            remaining_ = 0;
+            idle_.notify_all();
+        }
+        idle_.wait(lock, [this] {
+            return queued_.load() > 0 || remaining_.load() == 0;
+        });
+        sleeping_.fetch_sub(1);
+    }
+
+    bool Steal(std::size_t thief, Task& task) {
+        for (std::size_t i = 1; i < queues_.size(); ++i) {
+            Queue& queue = queues_[(thief + i) % queues_.size()];
+            std::lock_guard guard(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+                queued_.fetch_sub(1);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    std::vector<Queue> queues_;
+    std::atomic<std::size_t> remaining_{0};
+    std::atomic<std::size_t> queued_{0};  // задачи во всех очередях
+    std::atomic<std::size_t> pushed_{0};  // все задачи текущего Run, для проверки total
+
+    // простаивающие потоки спят здесь до новой задачи или конца Run
+    std::mutex idle_mutex_;
+    std::condition_variable idle_;
+    std::atomic<std::size_t> sleeping_{0};
+};